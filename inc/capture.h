@@ -0,0 +1,28 @@
+#include <stdint.h>  //for declaring uint64_t
+
+#define CAPMAGIC "CHATCAP1"    //first bytes of a trace file
+#define CAPBUF (256 << 10)     //bytes a shard gathers before it writes them out
+
+//records of a trace, a capRec and then len bytes
+#define CAP_OPEN  1  //a connection was accepted
+#define CAP_FIELD 2  //the parser took a field, state says which
+#define CAP_CLOSE 3  //the connection is gone
+
+//header of a trace record, in network byte order
+typedef struct capRec {
+  uint64_t us;             //monotonic time the record was taken, in us
+  uint32_t conn;           //connection number, unique in the trace
+  uint16_t len;            //bytes of the field that follow
+  uint8_t type;            //CAP_*
+  uint8_t state;           //CAP_FIELD: the PARSE_* state the field completed
+}capRec;
+
+struct client;
+
+extern int captureFd;
+
+int captureStart(const char*);
+void captureOpen(struct client*);
+void captureField(struct client*, const char*, uint16_t);
+void captureClose(struct client*);
+void captureFlush();
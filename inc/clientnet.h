@@ -0,0 +1,22 @@
+#include <stdint.h>  //for declaring uint8_t
+#include "proto.h"
+
+int dialHost(char*, int);
+int openSocket(char*, int);
+char sendName(int, char*, uint8_t);
+int sendFrame(int, char*, uint16_t, int);
+int sendHello(int);
+char sendResume(int, uint64_t, uint64_t);
+int sendTyped(int, uint8_t, const char*, const char*, uint16_t, int);
+
+#define READMAX (1 << 20)  /* most bytes one readAll takes before parsing */
+
+typedef struct {
+  char *data;      /* bytes from the server, oldest first */
+  uint32_t start;  /* first byte not yet handed out as a frame */
+  uint32_t len;    /* bytes held in data */
+  uint32_t cap;    /* bytes allocated for data */
+} reader;
+
+int readAll(int, reader*);
+char* nextFrame(reader*, int, uint32_t*);
@@ -0,0 +1,86 @@
+#include <stdint.h>  //for declaring uint64_t
+
+#define HOCHUNK 32768    //queued bytes sent in one record
+#define HOVERSION 1      //bump whenever a record's layout changes
+
+//records of a hot restart, one per seqpacket message
+#define HO_HELLO   1     //new process: hand everything over
+#define HO_CLIENT  2     //a client, its socket attached, HO_QUEUE records follow
+#define HO_QUEUE   3     //the next bytes of the last client's outbound queue
+#define HO_SESSION 4     //a resume session
+#define HO_LISTEN  5     //a listening socket, attached
+#define HO_END     6     //nothing more, or a refusal
+#define HO_ACK     7     //new process: got it all, the old one may go
+
+//what the new process opens with, the old one refuses a layout it does not share
+typedef struct hoHello {
+  uint8_t type;            //HO_HELLO
+  uint8_t version;         //HOVERSION
+  uint16_t clientSize;     //sizeof(hoClient)
+  uint32_t sessionSize;    //sizeof(session)
+}hoHello;
+
+//one connected client as the old process left it
+typedef struct hoClient {
+  uint8_t type;            //HO_CLIENT
+  uint8_t isActive;        //past the handshake
+  uint8_t proto;           //PROTO_V1 or PROTO_V2
+  uint8_t state;           //PARSE_*
+  uint8_t op;              //v2: opcode being parsed
+  uint8_t argLen;          //v2: its name length
+  uint8_t nameLen;         //length of name
+  uint8_t hdrSent;         //bytes of cont already written
+  uint16_t want;           //bytes the parser needs
+  uint16_t inLen;          //bytes in inbuf
+  uint16_t contMsgs;       //queued messages the open container still holds
+  contHdr cont;            //the open container's header
+  uint32_t id;             //user id
+  uint64_t token;          //resume token, 0 for none
+  uint32_t queueLen;       //bytes of the queue stream in the HO_QUEUE records
+  char name[NAMELENGTH+1]; //username, empty before the handshake
+  char room[NAMELENGTH+1]; //room, empty before the handshake
+  char inbuf[];            //inLen bytes received but not parsed
+}hoClient;
+
+//one outbound queue entry in the queue stream, its bytes follow
+typedef struct hoEntry {
+  uint8_t typed;           //v2 message, goes in a container
+  uint32_t len;            //bytes of the entry
+  uint32_t sent;           //bytes of it already written
+}hoEntry;
+
+//the last record, or a refusal
+typedef struct hoEnd {
+  uint8_t type;            //HO_END
+  uint8_t status;          //0, else why the old process will not hand over: HOREFUSE_*
+  uint32_t nextUserId;     //last user id handed out
+  uint64_t lastSeq;        //newest message number
+}hoEnd;
+
+//refusals in hoEnd.status
+#define HOREFUSE_URING   1 //its sockets belong to io_uring
+#define HOREFUSE_VERSION 2 //the hello does not match its record layout
+
+//a session record
+typedef struct hoSession {
+  uint8_t type;            //HO_SESSION
+  session s;               //the session, next is meaningless
+}hoSession;
+
+//a client received from the old process, waiting for its shard
+typedef struct hoStaged {
+  int fd;                  //its socket
+  hoClient *rec;           //its state, inbuf included
+  char *queue;             //queue stream, rec->queueLen bytes
+}hoStaged;
+
+extern hoStaged *staged;
+extern int numStaged;
+extern session *stagedHeld;
+extern int numHeld;
+
+int handoverTake(const char*, int*, int);
+void handoverServe(const char*);
+void handoverBarrier();
+void handoverSend(hoClient*, size_t, int, const char*, uint32_t);
+void handoverDone();
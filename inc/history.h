@@ -0,0 +1,56 @@
+#include <stdint.h>  //for declaring uint64_t
+
+#define HISTSEGBYTES (4 << 20)   //size of one segment file
+#define HISTSEGS 8               //segments kept, the oldest is deleted
+#define HISTSPARES 2             //segments the helper keeps made ahead of time
+#define HISTINDEX 16             //records between sparse index entries
+#define HISTHEADS 4096           //rooms with a replayable history, a power of two
+#define HISTREPLAY 20            //messages replayed on join by default
+#define HISTAGE (60 * 60 * 1000) //ms after which a message is not replayed
+#define HISTCATCHUP 1000         //most missed messages replayed on a resume
+
+//header in front of every frame in a segment, records are 8 byte aligned
+typedef struct histRec {
+  uint64_t seq;            //message number, counts up across segments from 1
+  int64_t ms;              //wall clock time it was said, in ms
+  uint64_t prev;           //seq of the room's previous message, 0 for none
+  char room[NAMELENGTH+1]; //room it was said in
+  uint16_t frameLen;       //bytes of the v1 frame that follows, prefix included
+  uint16_t altLen;         //bytes of the v2 message after it, 0 if there is none
+}histRec;
+
+//sparse index entry, every HISTINDEX records of a segment
+typedef struct histIdx {
+  uint64_t seq;            //seq of the record
+  int64_t ms;              //its time
+  uint32_t off;            //its offset in the segment
+}histIdx;
+
+//one segment file, mapped for its whole life
+typedef struct histSeg {
+  uint32_t no;             //file number, names the file
+  char *base;              //the mapping, HISTSEGBYTES long
+  uint32_t used;           //bytes of records written
+  uint64_t firstSeq;       //seq of the first record, 0 while empty
+  uint64_t lastSeq;        //seq of the newest record
+  int64_t lastMs;          //time of the newest record
+  msgbuf *anchor;          //replayed frames hold this, unmapped once only we do
+  struct histSeg *next;    //next retired segment
+  int numIdx;              //entries in index
+  histIdx index[];         //sparse index by seq and time
+}histSeg;
+
+//newest message of a room, heads of the per-room chains
+typedef struct histHead {
+  char room[NAMELENGTH+1]; //room name, empty if the slot was never used
+  uint64_t last;           //seq of its newest message
+}histHead;
+
+extern int historyDepth;
+
+int historyStart(const char*, int);
+void historyAppend(const char*, msgbuf*);
+void historyReplay(struct client*, const char*, uint64_t);
+uint64_t historyLastSeq();
+uint64_t historyDropped();
+void historyContinue(uint64_t);
@@ -0,0 +1,24 @@
+#include <stdint.h>  //for declaring uint64_t
+
+//log levels, a record is kept when its level is at most logLevel
+#define LOG_ERROR 0
+#define LOG_WARN  1
+#define LOG_INFO  2
+#define LOG_DEBUG 3
+
+#define LOGRING (1 << 18)  //bytes of records each thread may have waiting
+#define LOGRINGS 72        //most threads that can log
+#define LOGMAXREC 2048     //largest record, later arguments are cut off
+#define LOGMAXSTR 1024     //longest string argument kept
+#define LOGFLUSHMS 1000    //longest logFlush waits for the writer
+
+extern int logLevel;
+
+//a disabled level costs one compare, the arguments are not evaluated
+#define LOG(level, ...) do { if ((level) <= logLevel) logWrite((level), __VA_ARGS__); } while (0)
+
+int logParseLevel(const char*);
+void logStart();
+void logWrite(int, const char*, ...);
+uint64_t logDropped();
+void logFlush();
@@ -0,0 +1,23 @@
+#include <stdint.h>  //for declaring uint16_t
+
+#define FRAMEHDR sizeof(uint16_t)  //length prefix in front of every message
+
+//an encoded frame shared by every queue it is sent to
+//immutable once sealed, freed when the last reference is released
+typedef struct msgbuf {
+  uint32_t refs;           //queues (and callers) still holding the frame
+  uint16_t len;            //bytes in data, prefix included
+  uint8_t typed;           //data is a v2 message, it goes out in a container
+  uint8_t v1only;          //its v2 form could not be made, v2 clients skip it
+  struct msgbuf *alt;      //the same message for v2 clients, released with this one
+  char data[];             //the frame as it goes on the wire
+}msgbuf;
+
+msgbuf* allocMessage(uint16_t);
+void sealMessage(msgbuf*, uint16_t);
+msgbuf* newMessage(const char*, ...) __attribute__((format(printf, 1, 2)));
+msgbuf* rawMessage(const char*, uint16_t);
+msgbuf* typedMessage(uint8_t, uint32_t, const char*, const char*, uint16_t);
+void stampMessage(msgbuf*, uint64_t);
+msgbuf* holdMessage(msgbuf*);
+void releaseMessage(msgbuf*);
@@ -0,0 +1,23 @@
+#define NAMETABLE 512    //initial username directory slots, a power of two
+
+struct client;
+
+//one slot in the username directory, empty when name[0] is 0
+typedef struct nameEntry {
+  char name[NAMELENGTH+1]; //username, stored inline to avoid a pointer chase
+  struct client *owner;    //client holding the name, only valid on its shard, NULL while held
+  int shard;               //shard the owner lives on
+  int node;                //peer link a remote owner lives behind, 0 for this server
+}nameEntry;
+
+struct client* nameFind(const char*, int*);
+int nameInsert(const char*, struct client*, int);
+void nameHold(const char*);
+int nameClaim(const char*, struct client*, int);
+void nameRemove(const char*);
+int nameRemoveNode(const char*, int);
+int nameNode(const char*);
+int nameMove(const char*, int, int*);
+void nameEach(int, void (*)(const char*, void*), void*);
+char* nameSnapshot(uint32_t*);
+uint32_t nameCount();
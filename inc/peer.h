@@ -0,0 +1,63 @@
+#include <stdint.h>  //for declaring uint64_t
+
+#define MAXPEERS 16            //most peer links, dialed and accepted together
+#define PEERBUF (256 << 10)    //receive buffer of a link, twice the largest record
+#define PEERQUEUE (16 << 20)   //unsent bytes a link may pile up before it is dropped
+#define PEERRETRY 1000         //ms between attempts to dial a peer that is down
+#define PEERSECRET 256         //longest shared secret, read from the -K file
+#define PEERBIND "127.0.0.1"   //address the peer listener binds to without -A
+
+//records on a peer link, a peerHdr then dest, the v1 frame and its v2 form
+#define PEER_HELLO  0  //first record both ways, the frame is the node id then the secret
+#define PEER_ROOM   1  //a frame for the members of room dest
+#define PEER_DIRECT 2  //a frame for the user named dest
+#define PEER_ADD    3  //user dest joined the sending node
+#define PEER_DEL    4  //user dest left the sending node
+
+//header of a record on a peer link, lengths in network byte order
+typedef struct peerHdr {
+  uint8_t type;            //PEER_*
+  uint8_t destLen;         //bytes of the room or user name that follows
+  uint16_t len;            //bytes of the v1 frame after it, prefix included
+  uint16_t altLen;         //bytes of its v2 form after that, 0 for none
+}peerHdr;
+
+//a TCP connection to another server of the federation
+typedef struct peerLink {
+  int sd;                  //socket, -1 while the slot is free
+  int dial;                //peer address it was dialed for, -1 if accepted
+  uint8_t connecting;      //waiting for a non-blocking connect
+  uint8_t ready;           //HELLO received, names are synced
+  uint32_t events;         //events registered with epoll
+  uint64_t node;           //node id of the other end
+  char *in;                //received bytes not yet parsed, PEERBUF long
+  uint32_t inLen;          //bytes in in
+  char *out;               //bytes not yet sent
+  uint32_t outLen;         //bytes in out
+  uint32_t outCap;         //room in out before it has to grow
+}peerLink;
+
+//a peer given with -P, dialed until a link to it is up
+typedef struct peerAddr {
+  char host[64];           //host name or address
+  char port[8];            //port, as text for getaddrinfo
+  int link;                //link dialed for it, -1 while down
+  long retryMs;            //when to dial again
+}peerAddr;
+
+//federation counters, written by the federation thread only
+typedef struct peerCounters {
+  uint64_t links;          //links synced right now
+  uint64_t recordsIn;      //records received from peers
+  uint64_t recordsOut;     //records queued for peers
+  uint64_t collisions;     //names claimed on two nodes at once
+}peerCounters;
+
+extern int peerPort;
+extern const char *peerBind;
+extern peerCounters peerStats;
+
+int peerAdd(const char*);
+int peerSecret(const char*);
+void peerStart();
+void peerPost(uint8_t, msgbuf*, const char*);
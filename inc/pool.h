@@ -0,0 +1,34 @@
+#include <stddef.h>  //for declaring size_t
+#include <stdint.h>  //for declaring uint64_t
+
+#define SLABBYTES 65536  //memory a pool grabs at a time
+#define MAXPOOLS 512     //pools the metrics dump can list
+#define SIZECLASSES 6    //message buffer classes, 64 bytes up to 64KiB
+
+//hidden header in front of every pooled object
+typedef struct poolObj {
+  struct pool *home;       //pool the object returns to, NULL if malloced
+  struct poolObj *next;    //next free object
+}poolObj;
+
+//fixed size objects carved from slabs, owned by one thread
+//other threads may free into it, those frees wait on a separate list
+typedef struct pool {
+  const char *name;        //label in the metrics dump
+  size_t size;             //object size, header excluded
+  void *owner;             //thread that gets from the pool, set on first use
+  int shard;               //shard of the owner
+  poolObj *free;           //objects ready to hand out, owner only
+  poolObj *remote;         //objects other threads freed
+  uint64_t reserved;       //objects carved from slabs
+  uint64_t gets;           //objects handed out ever
+  uint64_t puts;           //objects the owner gave back
+  uint64_t remoteFrees;    //objects other threads gave back
+}pool;
+
+extern pool *pools[];
+extern int numPools;
+
+void* poolGet(pool*);
+void poolPut(void*);
+void* sizedGet(size_t);
@@ -0,0 +1,45 @@
+#include <stdint.h>  //for declaring uint8_t
+
+//a v2 client sends a hello where the first name length would go,
+//the server answers HELLOACK and the version it will speak
+#define HELLO 0xFF       //never a valid name length
+#define HELLOACK 'V'     //first byte of the server's answer
+#define PROTO_V1 1       //uint16_t length and text, the first character says what it is
+#define PROTO_V2 2       //typed messages, from the server in containers
+
+//after the hello a v2 client may resume a session where the name would go:
+//RESUME, the token and the last seq it saw, both uint64_t in network order.
+//the answer is 'Y', or 'X' when the session is gone and a name is needed
+#define RESUME 0xFE      //never a valid name length either
+
+//opcodes of v2 messages
+#define OP_CHAT      1   //room chat, name is the sender
+#define OP_ACTION    2   ///me, name is the sender
+#define OP_PRIVATE   3   //direct message, name is the sender (from a client, the recipient)
+#define OP_NOTICE    4   //joins and leaves, name is who it is about
+#define OP_WARNING   5   //something went wrong, sent only to you
+#define OP_ROSTER    6   //every connected user, the body holds " name\n" lines
+#define OP_ROSTERADD 7   //name connected, without a name more " name\n" lines of the roster
+#define OP_ROSTERDEL 8   //name disconnected
+#define OP_ROOM      9   //you are now in the room named in the body
+#define OP_JOIN      10  //from a client: move to the room named in the body
+#define OP_PART      11  //from a client: go back to the lobby
+#define OP_SESSION   12  //your resume token is the 8 byte body, seq is the newest message so far
+#define OP_BATCH     0x80 //container header
+
+//in front of every run of v2 messages from the server
+typedef struct contHdr {
+  uint8_t op;              //OP_BATCH
+  uint8_t pad;             //0
+  uint16_t count;          //messages in the container, network order
+  uint32_t len;            //bytes of messages that follow, network order
+}contHdr;
+
+//every v2 message, both ways, followed by the name and then the body
+typedef struct typedHdr {
+  uint8_t op;              //OP_*
+  uint8_t nameLen;         //bytes of name after the header
+  uint16_t bodyLen;        //bytes of body after the name, network order
+  uint32_t sender;         //id of the user it is from, 0 for the server, network order
+  uint64_t seq;            //room message number, 0 for none, network order
+}typedHdr;
@@ -0,0 +1,18 @@
+#define ROOMTABLE 256    //room hash buckets per shard, a power of two
+#define LOBBY "lobby"    //room every user starts in
+
+struct client;
+
+//one room's members on this shard
+//a room lives on every shard that has members in it
+typedef struct room {
+  char name[NAMELENGTH+1]; //room name, same rules as a username
+  struct room *next;       //next room in the hash bucket
+  struct client **members; //local members, packed at the front
+  int numMembers;          //entries in members
+  int cap;                 //room in members before it has to grow
+}room;
+
+room* roomFind(const char*);
+int roomJoin(struct client*, const char*);
+void roomLeave(struct client*);
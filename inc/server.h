@@ -1,15 +1,126 @@
 #include <stdint.h>  //for declaring uint8_t
-#include <sys/select.h>
+#include "message.h"
+#include "proto.h"
+#include "timer.h"
 
 #define TIMEOUT 60
-#define MAXCLIENT 255
+#define MAXCLIENT 100000  //default limit on connected clients, -c changes it
 #define NAMELENGTH 10
 #define MSGLENGTH 1001
+#define INBUFSIZE 4096   //per-connection receive buffer, holds several frames
+#define IOVBATCH 64      //queued frames gathered into one sendmsg
+#define CONTMAX 65536    //v2 message bytes a container is filled up to
+#define HIGHWATER 65536  //default outbound queue limit per client, in bytes
+#ifndef ROSTERCHUNK  //make test builds a server with a small one
+#define ROSTERCHUNK (MSGLENGTH * 64)  //most roster bytes in one frame, a bigger roster takes several
+#endif
+#define HARDLIMIT 4      //paused clients are dropped at HARDLIMIT * high water
+#define RATEBURST 2      //seconds of traffic a full token bucket holds
+#define ACCEPTBUDGET 64  //connections accepted per listener wakeup
+#define ACCEPTPAUSE 100  //ms accepts stop for when nothing can be accepted
 
+//what to do with a client whose outbound queue passes the high water mark
+#define POLICY_DROP       0  //drop the oldest unsent messages
+#define POLICY_DISCONNECT 1  //disconnect the client
+#define POLICY_PAUSE      2  //stop reading from the client until it catches up
+
+#include "names.h"
+#include "session.h"
+#include "room.h"
+#include "history.h"
+#include "shard.h"
+#include "uring.h"
+#include "handover.h"
+#include "peer.h"
+#include "capture.h"
+#include "stats.h"
+#include "log.h"
+#include "pool.h"
+
+//parse states for the per-connection frame parser
+#define PARSE_NAMELEN 0  //waiting for the uint8_t username length
+#define PARSE_NAME    1  //waiting for the username itself
+#define PARSE_MSGLEN  2  //waiting for the uint16_t message length
+#define PARSE_BODY    3  //waiting for the message body
+#define PARSE_HELLO   4  //waiting for the version a v2 client asks for
+#define PARSE_TYPEDHDR 5 //v2: waiting for a typedHdr
+#define PARSE_TYPED   6  //v2: waiting for the name and body after it
+#define PARSE_RESUME  7  //v2: waiting for the token and seq of a resume
+
+//one entry in a client's outbound queue
+typedef struct outmsg {
+  struct outmsg *next;     //next frame in the queue
+  msgbuf *buf;             //shared frame, one reference held per entry
+  const char *data;        //bytes to send, buf's frame or what buf keeps mapped
+  uint32_t len;            //bytes at data
+  uint32_t sent;           //bytes of the frame already written
+  uint8_t typed;           //a v2 message, sent inside a container
+}outmsg;
+
+struct client;
+
+//the parts of a client only its own traffic touches
+typedef struct clientCold {
+  struct client *hot;      //client this belongs to
+  uint32_t id;             //user id v2 messages carry, set at the handshake
+  uint32_t capId;          //connection number in the capture trace
+  uint64_t token;          //v2: resume token of its session, 0 for none
+  uint8_t nameLen;         //length of username
+  char name[NAMELENGTH+1]; //client name, empty until the handshake
+  timer timeout;           //timer for checkin timeouts
+  uint8_t state;           //where the frame parser is, PARSE_*
+  uint16_t want;           //bytes the parser needs for the current field
+  uint16_t inLen;          //bytes waiting in inbuf
+  uint8_t op;              //v2: opcode of the message being parsed
+  uint8_t argLen;          //v2: its name length
+  uint64_t msgTokens;      //message bucket, in thousandths of a message
+  uint64_t byteTokens;     //byte bucket, in thousandths of a byte
+  long refillMs;           //when the buckets were last topped up
+  timer throttle;          //fires when a throttled client may read again
+  char inbuf[INBUFSIZE+1]; //bytes received but not yet parsed, +1 for a null
+}clientCold;
+
+//what fan-out touches for every client, kept small and together
 typedef struct client {
+  int socket;              //socket for client, 0 once deleted
   uint8_t isActive;        //flag for if user is "active"
-  uint8_t nameLen;         //length of username
-  uint16_t socket;         //socket for client
-  char* name;              //client name
-  struct timeval timeout;  //timer for checkin timeouts
+  uint8_t paused;          //reads stopped until the queue drains
+  uint8_t throttled;       //reads stopped until the token buckets refill
+  uint8_t closing;         //queued for disconnect at the end of the pass
+  uint8_t dirty;           //listed for the end of pass batch flush
+  uint8_t proto;           //PROTO_V1 or PROTO_V2
+  uint8_t hdrSent;         //bytes of contHdr written
+  uint16_t contMsgs;       //queued messages still to go in the open container
+  contHdr cont;            //header of the open container
+  uint32_t events;         //events currently registered with epoll
+  uint32_t outBytes;       //unsent bytes in the outbound queue
+  outmsg *outHead;         //oldest queued frame
+  outmsg *outTail;         //newest queued frame
+  int outLocked;           //frames at the head the kernel is sending from
+  int slot;                //index in the live list
+  struct room *room;       //room the client talks in, NULL before the handshake
+  int roomSlot;            //index in the room's member list
+  struct client *nextClosing; //link in the close list
+  struct client *nextDirty;   //link in the dirty list
+  struct client *nextFree;    //link in the list freed at the end of the pass
+  uringConn *ur;           //io_uring state, NULL under epoll
+  clientCold *cold;        //name, timer and receive buffer
 }client;
+
+extern uint32_t nextUserId;
+
+//shared by the epoll loop and the io_uring backend
+void newParticipant(int);
+int shedConnection(int);
+void parseInput(client*);
+void leaveUser(client*);
+void dropUser(client*);
+void closeClient(client*);
+void queueSpan(client*, msgbuf*, const char*, uint32_t, uint8_t);
+int gatherQueue(client*, struct iovec*, int, int*);
+void retireBytes(client*, size_t);
+void afterSend(client*);
+void deliverMail();
+msgbuf* withTyped(msgbuf*, uint8_t, uint32_t, const char*, const char*, int);
+int passTimeout();
+void endPass();
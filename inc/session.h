@@ -0,0 +1,32 @@
+#include <stdint.h>  //for declaring uint64_t
+
+#define SESSIONTABLE 4096 //session hash buckets, a power of two
+#define RESUMEGRACE 30    //default seconds a dropped session is held, -g changes it
+
+//a v2 user's session, kept while connected and for a grace period after
+typedef struct session {
+  uint64_t token;          //secret the client resumes with, never 0
+  uint32_t id;             //user id its messages carry
+  char name[NAMELENGTH+1]; //username, still claimed while held
+  char room[NAMELENGTH+1]; //room it was in when the connection dropped
+  uint8_t held;            //connection dropped, waiting for a resume
+  uint32_t holds;          //times it was held, a grace timer ends only its own hold
+  struct session *next;    //next session in the hash bucket
+}session;
+
+//grace timer of a held session, on the shard the connection dropped on
+typedef struct hold {
+  timer t;                 //fires when the grace period is over
+  uint64_t token;          //session it times out
+  uint32_t gen;            //which of the session's holds it belongs to
+}hold;
+
+extern int resumeGrace;
+
+uint64_t sessionOpen(const char*, uint32_t);
+uint32_t sessionHold(uint64_t, const char*);
+int sessionTake(uint64_t, session*);
+int sessionExpire(uint64_t, uint32_t, session*);
+void sessionClose(uint64_t);
+void sessionEach(void (*)(const session*));
+void sessionRestore(const session*);
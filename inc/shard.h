@@ -0,0 +1,44 @@
+#include <pthread.h>
+
+#define MAXSHARDS 64     //most reactor threads -t will start
+
+//kinds of mail one shard sends another
+#define MAIL_ROOM      0 //fan a frame out to the local members of room dest
+#define MAIL_DIRECT    1 //queue a frame for one named local client
+#define MAIL_ROSTER    2 //a roster delta for the user named in dest
+#define MAIL_HANDOVER  3 //stop and hand every client to a new process
+#define MAIL_KICK      4 //the local user named dest lost its name to another node
+
+//one cross-shard message, linked into the receiving shard's mailbox
+typedef struct mail {
+  struct mail *next;       //next mail in the mailbox
+  uint8_t type;            //MAIL_*
+  msgbuf *buf;             //frame to deliver, one reference held
+  char dest[NAMELENGTH+1]; //recipient for MAIL_DIRECT, user for MAIL_ROSTER, room for MAIL_ROOM
+}mail;
+
+//lock-free multi producer, single consumer queue of mail
+typedef struct mailbox {
+  mail *head;              //newest mail, producers swap themselves in here
+  mail *tail;              //oldest mail, only the owning shard touches it
+  mail stub;               //keeps the queue from ever being empty
+  int efd;                 //eventfd that wakes the owning shard
+  int signalled;           //set while a wakeup is outstanding
+}mailbox;
+
+//one reactor thread with its own listener and clients
+typedef struct shard {
+  int listener;            //SO_REUSEPORT listening socket
+  pthread_t thread;        //thread running the shard
+  mailbox box;             //mail from the other shards
+}shard;
+
+extern shard *shards;
+extern int numShards;
+extern _Thread_local int myShard;
+
+void startShards(int*, int, void (*)(int));
+void postMail(int, uint8_t, msgbuf*, const char*);
+void postAll(uint8_t, msgbuf*, const char*);
+mail* takeMail();
+void doneMail(mail*);
@@ -0,0 +1,45 @@
+#include <stdint.h>  //for declaring uint64_t
+
+#define HISTBUCKETS 24   //power of two histogram buckets, the last takes the rest
+
+//counters for one shard, only the owning shard writes them
+typedef struct stats {
+  _Alignas(64) uint64_t accepts; //connections accepted
+  uint64_t rejects;              //connections turned away at the client limit
+  uint64_t timeouts;             //handshake timers that fired
+  uint64_t bytesIn;              //bytes received from clients
+  uint64_t framesIn;             //names and messages parsed
+  uint64_t bytesOut;             //bytes written to clients
+  uint64_t framesOut;            //frames completely written
+  uint64_t partialSends;         //writes the socket only took part of
+  uint64_t dropped;              //queued frames thrown away by the drop policy
+  uint64_t slowCloses;           //clients disconnected for falling behind
+  uint64_t held;                 //sessions held after their connection dropped
+  uint64_t resumed;              //held sessions a client came back for
+  uint64_t expired;              //held sessions whose grace period ran out
+  uint64_t throttles;            //times a client's reads were stopped by its token buckets
+  uint64_t throttled;            //clients whose reads are stopped right now
+  uint64_t acceptErrors;         //accepts that failed for a reason other than an empty queue
+  uint64_t acceptShed;           //connections turned away for want of a descriptor
+  uint64_t acceptPauses;         //times accepting stopped for a moment
+  uint64_t acceptBudgetHits;     //readiness events that left connections queued
+  uint64_t acceptRearms;         //multishot accepts that had to be armed again
+  uint64_t clients;              //connected clients right now
+  uint64_t passUs[HISTBUCKETS];  //time spent handling one loop pass, in us
+  uint64_t passUsSum;
+  uint64_t queue[HISTBUCKETS];   //outbound queue bytes after each enqueue
+  uint64_t queueSum;
+}stats;
+
+extern stats shardStats[];
+extern _Thread_local stats *myStats;
+
+//a plain add the scraping thread can read without tearing
+#define STAT_ADD(field, n) __atomic_store_n(&myStats->field, myStats->field + (n), __ATOMIC_RELAXED)
+#define STAT_SET(field, v) __atomic_store_n(&myStats->field, (v), __ATOMIC_RELAXED)
+
+void statsInit(int);
+void statsHist(uint64_t*, uint64_t*, uint64_t);
+void statsPassStart();
+void statsPassEnd();
+void statsServe(int);
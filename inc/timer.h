@@ -0,0 +1,23 @@
+#include <stdint.h>  //for declaring uint64_t
+
+#define TIMERTICK 10     //milliseconds per wheel tick
+#define WHEELBITS 8      //level 0 has 1 << WHEELBITS slots of one tick
+#define WHEELSIZE (1 << WHEELBITS)
+#define UPPERBITS 6      //level 1 has 1 << UPPERBITS slots of WHEELSIZE ticks
+#define UPPERSIZE (1 << UPPERBITS)
+
+//an intrusive timer, embed it in whatever it times out
+typedef struct timer {
+  struct timer *next;          //next timer in the same slot
+  struct timer **pprev;        //link pointing at us, NULL when not armed
+  uint64_t expires;            //tick the timer fires on
+  void (*fire)(struct timer*); //called once when the timer expires
+}timer;
+
+long nowMs();
+uint64_t nowUs();
+void timerInit();
+void timerArm(timer*, uint32_t, void (*)(timer*));
+void timerCancel(timer*);
+int timerArmed(timer*);
+int timerRun();
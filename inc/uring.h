@@ -0,0 +1,39 @@
+#include <sys/socket.h>  //for struct msghdr
+#include <sys/uio.h>     //for struct iovec
+
+#define RINGSIZE 4096    //submission queue entries per shard
+#define RECVBUFS 512     //provided receive buffers per shard, a power of two
+#define RECVBUFSIZE 2048 //bytes per provided receive buffer
+#define RECVGROUP 1      //buffer group id of the provided buffer ring
+#define SPILLMAX (256 << 10) //bytes a connection may receive while its reads stop
+
+struct client;
+
+//io_uring side of one connection, outlives the client while the
+//kernel still has requests for it in flight
+typedef struct uringConn {
+  struct client *owner;      //client the connection belongs to, NULL once gone
+  int fd;                    //socket, closed when the last request completes
+  uint8_t recvArmed;         //multishot receive is outstanding
+  uint8_t sendBusy;          //a sendmsg is outstanding
+  uint8_t cancelBusy;        //a cancel of the receive is outstanding
+  struct msghdr mh;          //header of the outstanding sendmsg
+  struct iovec iov[IOVBATCH];//frames in the outstanding sendmsg
+  msgbuf *held[IOVBATCH];    //references keeping those frames alive
+  contHdr hdr;               //container header the sendmsg may start with
+  int heldCnt;               //entries in held
+  char *spill;               //bytes received after reads were told to stop
+  uint32_t spillLen;         //bytes in spill
+  uint32_t spillCap;         //bytes allocated for spill
+}uringConn;
+
+extern int useUring;
+
+int uringProbe();
+int uringInit(int);
+void uringLoop();
+void uringAttach(struct client*);
+void uringDetach(struct client*);
+void uringSend(struct client*);
+void uringUpdate(struct client*);
+void uringDrain(struct client*);
@@ -0,0 +1,132 @@
+/* capture.c - records what clients send to a trace file for the replay tool
+ *
+ * every field the parser takes is written with the connection it came
+ * on and when, along with the opens and closes around it. each shard
+ * gathers its records in its own buffer and writes them out at the end
+ * of a pass, so records of different shards are only ordered within a
+ * buffer, the replay tool sorts them by time
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include "../inc/server.h"
+
+int captureFd = -1;                        //trace file, -1 when not capturing
+static uint32_t nextConn = 0;              //last connection number handed out
+static _Thread_local char *capBuf = NULL;  //records not yet written, CAPBUF long
+static _Thread_local uint32_t capLen = 0;  //bytes in capBuf
+
+static void capRecord(uint32_t, uint8_t, uint8_t, const char*, uint16_t);
+
+/*
+ * Function: captureStart
+ * -------------------
+ * create the trace file, called before the shards start
+ *
+ * *path:  file to write, replaced if it exists
+ *
+ * returns 0 on success, -1 if the file can not be written
+ */
+int captureStart(const char *path) {
+  //appends from several shards never overwrite each other
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return -1;
+  if (write(fd, CAPMAGIC, strlen(CAPMAGIC)) != strlen(CAPMAGIC)) {
+    close(fd);
+    return -1;
+  }
+  captureFd = fd;
+  return 0;
+}
+
+/*
+ * Function: captureOpen
+ * -------------------
+ * give a new connection its number and record that it opened
+ *
+ * *user:  client that was just added
+ */
+void captureOpen(client *user) {
+  user->cold->capId = __atomic_add_fetch(&nextConn, 1, __ATOMIC_RELAXED);
+  capRecord(user->cold->capId, CAP_OPEN, 0, NULL, 0);
+}
+
+/*
+ * Function: captureField
+ * -------------------
+ * record a field the parser is about to handle
+ *
+ * *user:   client that sent it, cold->state says what it is
+ * *field:  the bytes as they arrived
+ * len:     bytes in field
+ */
+void captureField(client *user, const char *field, uint16_t len) {
+  capRecord(user->cold->capId, CAP_FIELD, user->cold->state, field, len);
+}
+
+/*
+ * Function: captureClose
+ * -------------------
+ * record that a connection is gone
+ *
+ * *user:  client being deleted
+ */
+void captureClose(client *user) {
+  capRecord(user->cold->capId, CAP_CLOSE, 0, NULL, 0);
+}
+
+/*
+ * Function: captureFlush
+ * -------------------
+ * write the calling shard's records to the trace, one write so
+ * they land in one piece next to those of the other shards
+ */
+void captureFlush() {
+  uint32_t done = 0;
+  while (done < capLen) {
+    ssize_t n = write(captureFd, capBuf + done, capLen - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      LOG(LOG_WARN, "capture: write failed: %s", strerror(errno));
+      break;
+    }
+    done += n;
+  }
+  capLen = 0;
+}
+
+/*
+ * Function: capRecord
+ * -------------------
+ * add a record to the calling shard's buffer
+ *
+ * conn:    connection number
+ * type:    CAP_*
+ * state:   PARSE_* for CAP_FIELD, 0 otherwise
+ * *field:  bytes after the header, NULL for none
+ * len:     bytes in field
+ */
+static void capRecord(uint32_t conn, uint8_t type, uint8_t state, const char *field, uint16_t len) {
+  capRec rec;
+  if (capBuf == NULL && (capBuf = malloc(CAPBUF)) == NULL)
+    return;
+  if (capLen + sizeof(rec) + len > CAPBUF)
+    captureFlush();
+  rec.us = htobe64(nowUs());
+  rec.conn = htonl(conn);
+  rec.len = htons(len);
+  rec.type = type;
+  rec.state = state;
+  memcpy(capBuf + capLen, &rec, sizeof(rec));
+  if (len > 0)
+    memcpy(capBuf + capLen + sizeof(rec), field, len);
+  capLen += sizeof(rec) + len;
+}
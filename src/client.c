@@ -9,11 +9,24 @@
 #include <ctype.h>
 #include <stdio.h>
 #include <ncurses.h>
+#include <endian.h>
+#include <time.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "../inc/clientnet.h"
 
 #define NAMELENGTH 10
 
 #define LINELEN 100
+#define MAXFRAME 65535  /* largest frame the uint16_t length allows */
 #define QLEN 6
+#define FPS 30          /* most screen updates a second */
+#define RETRIES 30      /* reconnect attempts a second apart, the server holds a session 30s */
+
+#define DIRTY_OUT    1  /* chat window has new lines */
+#define DIRTY_ROSTER 2  /* roster or room changed */
+#define DIRTY_INPUT  4  /* input line changed */
+#define DIRTY_FRAME  8  /* borders need redrawing */
 
 /*
 *****************************************************************************
@@ -21,8 +34,27 @@
 *****************************************************************************
 */
 int readLine(char* buffptr, int length);
-int openSocket(char*, int);
 int isValidName(char* name);
+void rosterAdd(char* name);
+void rosterRemove(char* name);
+void rosterLoad(char* list);
+void rosterAppend(char* list);
+void drawRoster(WINDOW *win);
+void showTyped(char *msg, WINDOW *out);
+void showFrame(char *msg, uint32_t len, WINDOW *out);
+void sendLine(int sd, char *line);
+long long msNow(void);
+int reconnect(char *host, int port, WINDOW *out);
+
+char (*roster)[NAMELENGTH+1] = NULL; /* names of everyone in the room */
+int rosterLen = 0;                   /* names in roster */
+int rosterCap = 0;                   /* slots allocated in roster */
+char room[NAMELENGTH+1] = "";        /* room we are talking in */
+int proto = PROTO_V1;                /* protocol the server agreed to */
+int dirty = 0;                       /* DIRTY_* windows waiting for a repaint */
+char username[LINELEN];              /* name the server accepted */
+uint64_t token = 0;                  /* v2: session to resume if the connection drops */
+uint64_t lastSeq = 0;                /* v2: newest message seen */
 
 void draw_borders(WINDOW *screen) {
   int x, y, i;
@@ -57,8 +89,8 @@ int main(int argc, char *argv[]) {
   int ch = 0;
   int sd; /* socket descriptor */
   uint16_t Pport;
-  uint16_t msglen;
-  uint16_t hostmsglen;
+  reader in = {0};
+  long long nextDraw = 0;
   if (argc != 3) {
     fprintf(stderr,"Error: Wrong number of arguments\n");
     fprintf(stderr,"usage:\n");
@@ -72,16 +104,16 @@ int main(int argc, char *argv[]) {
   
   recv(sd, &valid, sizeof(char), 0);
   if (valid == 'Y') {
+    if ((proto = sendHello(sd)) == 0) {
+      fprintf(stderr, "Error: server did not answer the hello\n");
+      exit(EXIT_FAILURE);
+    }
     do {
-      char username[NAMELENGTH];
       do {
         dprintf(1, "Enter username: ");
         readLine(username, LINELEN);
       } while (!isValidName(username));
-      uint8_t nameLen = strlen(username);
-      send(sd, &nameLen, sizeof(uint8_t), MSG_WAITALL);
-      send(sd, &username, nameLen, MSG_WAITALL);
-      recv(sd, &valid, sizeof(valid), 0);
+      valid = sendName(sd, username, strlen(username));
     } while (valid != 'Y');
     dprintf(1, "\nUsername accepted...\n\n");
 
@@ -101,7 +133,9 @@ int main(int argc, char *argv[]) {
   cbreak();
   scrollok(outbuffer, TRUE);
   timeout(1);
+  nodelay(input, TRUE);
   fd_set readset;
+  dirty = DIRTY_OUT | DIRTY_ROSTER | DIRTY_INPUT | DIRTY_FRAME;
 
   while(1) {
     FD_ZERO(&readset);
@@ -119,70 +153,89 @@ int main(int argc, char *argv[]) {
       wclear(output);
       wclear(input);
       wclear(connected);
-      draw_borders(output);
-      draw_borders(input);
+      dirty |= DIRTY_OUT | DIRTY_ROSTER | DIRTY_INPUT | DIRTY_FRAME;
+    }
+    // repaint at most FPS times a second, sleep until then if anything is waiting
+    long long now = msNow();
+    if (dirty && now >= nextDraw) {
+      if (dirty & DIRTY_FRAME) {
+        draw_borders(output);
+        draw_borders(input);
+        wnoutrefresh(output);
+      }
+      if (dirty & DIRTY_ROSTER) {
+        drawRoster(connected);
+        wnoutrefresh(connected);
+      }
+      if (dirty & DIRTY_OUT)
+        wnoutrefresh(outbuffer);
+      if (dirty & DIRTY_INPUT) {
+        mvwprintw(input, 1, 1, "%-*s", new_x - 2, buf);
+        wmove(input, 1, 1 + (s - buf));
+        wnoutrefresh(input);
+      }
+      doupdate();
+      dirty = 0;
+      nextDraw = now + 1000 / FPS;
     }
-    select(5, &readset, NULL,NULL, NULL);
+    struct timeval wait = {0, 0};
+    if (dirty) {
+      wait.tv_usec = (nextDraw - now) * 1000;
+    }
+    if (select(sd + 1, &readset, NULL, NULL, dirty ? &wait : NULL) < 0)
+      continue;
     if (FD_ISSET(sd, &readset)) {
-      char buff[LINELEN] = {0};
-      msglen = 0;
-      recv(sd, &msglen, sizeof(uint16_t), 0);
-      hostmsglen = ntohs(msglen);
-      recv(sd, &buff, hostmsglen, 0);
-      buff[hostmsglen] = 0;
-      if (buff[0] == 'U')
-        wattron(outbuffer, A_BLINK);
-      if (buff[0] == '*')
-        wattron(outbuffer, A_BOLD);
-      if (buff[0] == 'W') {
-        wattron(outbuffer, A_BLINK | A_BOLD);
+      //take everything that arrived, then show every complete frame
+      char *frame;
+      uint32_t len;
+      if (readAll(sd, &in) < 0) {
+        //come back as the same user, the server held our session
+        close(sd);
+        if ((sd = reconnect(host, Pport, outbuffer)) < 0)
+          break;
+        in.start = in.len = 0;
+        continue;
       }
-      if (buff[0] == '%') {
-        wclear(connected);
-        wprintw(connected, "%s\n", buff+1);
-      } else if (buff[hostmsglen -1] != '\n') {
-        wprintw(outbuffer, "%s\n", buff);
-      } else {
-        wprintw(outbuffer, "%s", buff);
+      while ((frame = nextFrame(&in, proto, &len)) != NULL) {
+        if (proto == PROTO_V2) {
+          for (uint32_t pos = 0; pos + sizeof(typedHdr) <= len;) {
+            typedHdr *h = (typedHdr*)(frame + pos);
+            uint32_t size = sizeof(typedHdr) + h->nameLen + ntohs(h->bodyLen);
+            if (pos + size > len)
+              break;
+            showTyped(frame + pos, outbuffer);
+            pos += size;
+          }
+        } else {
+          showFrame(frame, len, outbuffer);
+        }
       }
-      wattroff(outbuffer,A_BLINK | A_BOLD);
     }
     if (FD_ISSET(0, &readset)) {
-      if ((ch = wgetch(input)) != ERR) {
+      //every key waiting, a paste is one wakeup
+      while ((ch = wgetch(input)) != ERR) {
         if (ch == '\n') {
           if (strlen(buf) > 0) {
             *s = 0;
-            hostmsglen = strlen(buf);
-            msglen = htons(hostmsglen);
-            send(sd, &msglen,sizeof(uint16_t), MSG_DONTWAIT); 
-            send(sd, &buf, hostmsglen, MSG_DONTWAIT);
-            for (int i = 1; i < new_x-1; i++) {
-              mvwprintw(input,1,i, " ");
-            }
+            if (proto == PROTO_V2)
+              sendLine(sd, buf);
+            else
+              sendFrame(sd, buf, strlen(buf), 0);
             s = buf;
             *s = 0;
           }
         } else if (ch == KEY_BACKSPACE) {
-          if (s > buf) {
+          if (s > buf)
             *--s = 0;
-            wprintw(input, "\b \b"); 
-          } else {
-            *s = 0;
-          }
+        } else if (ch == KEY_RESIZE || ch > UINT8_MAX) {
+          continue;
         } else if (s - buf < (long)sizeof buf - 1) {
           *s++ = ch;
           *s = 0;
-          waddch(input, ch);
         }
+        dirty |= DIRTY_INPUT;
       }
-    mvwprintw(input, 1, 1, "%s", buf);
     }
-    // draw to our windows
-    wnoutrefresh(output);
-    wnoutrefresh(outbuffer);
-    wnoutrefresh(input);
-    wnoutrefresh(connected);
-    doupdate();
   }
   endwin();
 }
@@ -190,54 +243,6 @@ int main(int argc, char *argv[]) {
 }
 
 
-/*
- * Function: openSocket
- * -------------------
- * Opens up a connection to the host
- *
- * *host: address of host to connect to
- * port:  port to connect to on host
- *
- * returns file descriptor of connected socket
- */
-int openSocket(char* host, int port) {
-  struct sockaddr_in sad; /* structure to hold an IP address */
-  struct hostent *ptrh;
-  int sd;
-  int n;
-  struct protoent *ptrp; /* pointer to a protocol table entry */
-
-  memset((char *)&sad,0,sizeof(sad)); /* clear sockaddr structure */
-  sad.sin_family = AF_INET; /* set family to Internet */
-
-  ptrh = gethostbyname(host);
-  if ( ptrh == NULL ) {
-    fprintf(stderr,"Error: Invalid host: %s\n", host);
-    exit(EXIT_FAILURE);
-  }
-  sad.sin_port = htons((u_short)port);
-  memcpy(&sad.sin_addr, ptrh->h_addr, ptrh->h_length);
-
-  /* Map TCP transport protocol name to protocol number. */
-  if ( ((long int)(ptrp = getprotobyname("tcp"))) == 0) {
-    fprintf(stderr, "Error: Cannot map \"tcp\" to protocol number");
-    exit(EXIT_FAILURE);
-  }
-
-  /* Create a socket. */
-  sd = socket(PF_INET, SOCK_STREAM, ptrp->p_proto);
-  if (sd < 0) {
-    fprintf(stderr, "Error: Socket creation failed\n");
-    exit(EXIT_FAILURE);
-  }
-
-  if ((n = connect(sd, (struct sockaddr *)&sad, sizeof(sad))) < 0) {
-    fprintf(stderr, "connect failed\n");
-    exit(EXIT_FAILURE);
-  }
-  return sd;
-}
-
 /*
  * Function: isValidName
  * -------------------
@@ -283,3 +288,282 @@ int readLine(char* buffptr, int length) {
   }
   return strlen(buffptr);
 }
+
+/*
+ * Function: rosterAdd
+ * -------------------
+ * add a name to the roster, ignoring names already there
+ *
+ * *name:  name to add
+ */
+void rosterAdd(char* name) {
+  if (*name == 0 || strlen(name) > NAMELENGTH)
+    return;
+  for (int i = 0; i < rosterLen; i++) {
+    if (strcmp(roster[i], name) == 0)
+      return;
+  }
+  if (rosterLen == rosterCap) {
+    int cap = rosterCap ? rosterCap * 2 : 64;
+    void *grown = realloc(roster, cap * sizeof(*roster));
+    if (grown == NULL)
+      return;
+    roster = grown;
+    rosterCap = cap;
+  }
+  strcpy(roster[rosterLen++], name);
+}
+
+/*
+ * Function: rosterRemove
+ * -------------------
+ * remove a name from the roster
+ *
+ * *name:  name to remove
+ */
+void rosterRemove(char* name) {
+  for (int i = 0; i < rosterLen; i++) {
+    if (strcmp(roster[i], name) == 0) {
+      memmove(roster[i], roster[i+1], (rosterLen - i - 1) * sizeof(*roster));
+      rosterLen--;
+      return;
+    }
+  }
+}
+
+/*
+ * Function: rosterLoad
+ * -------------------
+ * replace the roster with a full list from the server
+ *
+ * *list:  names separated by whitespace
+ */
+void rosterLoad(char* list) {
+  rosterLen = 0;
+  rosterAppend(list);
+}
+
+/*
+ * Function: rosterAppend
+ * -------------------
+ * add every name of a list, a join or the rest of a long roster
+ *
+ * *list:  names separated by whitespace
+ */
+void rosterAppend(char* list) {
+  for (char *name = strtok(list, " \n"); name != NULL; name = strtok(NULL, " \n"))
+    rosterAdd(name);
+}
+
+/*
+ * Function: drawRoster
+ * -------------------
+ * redraw the window of connected users from the roster,
+ * under the name of the current room
+ *
+ * *win:  window to draw in
+ */
+void drawRoster(WINDOW *win) {
+  wclear(win);
+  if (room[0] != 0)
+    wprintw(win, "#%s\n", room);
+  for (int i = 0; i < rosterLen; i++)
+    wprintw(win, " %s\n", roster[i]);
+}
+
+/*
+ * Function: showTyped
+ * -------------------
+ * display one v2 message, the opcode says how
+ *
+ * *msg:  the message, header first
+ * *out:  chat window
+ */
+void showTyped(char *msg, WINDOW *out) {
+  typedHdr h;
+  char name[UINT8_MAX + 1];
+  static char body[MAXFRAME + 1];
+  memcpy(&h, msg, sizeof(h));
+  uint16_t bodyLen = ntohs(h.bodyLen);
+  memcpy(name, msg + sizeof(h), h.nameLen);
+  name[h.nameLen] = 0;
+  memcpy(body, msg + sizeof(h) + h.nameLen, bodyLen);
+  body[bodyLen] = 0;
+  if (be64toh(h.seq) > lastSeq)
+    lastSeq = be64toh(h.seq);
+  switch (h.op) {
+    case OP_CHAT:
+      wprintw(out, ">%*c%s: %s\n", 10 - h.nameLen, ' ', name, body);
+      break;
+    case OP_ACTION:
+      wattron(out, A_BOLD);
+      wprintw(out, "*%s %s\n", name, body);
+      break;
+    case OP_PRIVATE:
+      wattron(out, A_BOLD);
+      wprintw(out, "*%*c%s: %s\n", 11 - h.nameLen, ' ', name, body);
+      break;
+    case OP_NOTICE:
+      wattron(out, A_BLINK);
+      wprintw(out, "%s\n", body);
+      break;
+    case OP_WARNING:
+      wattron(out, A_BLINK | A_BOLD);
+      wprintw(out, "%s\n", body);
+      break;
+    case OP_ROSTER:
+      rosterLoad(body);
+      dirty |= DIRTY_ROSTER;
+      break;
+    case OP_ROSTERADD:
+      //no name: the rest of a roster too long for one message
+      if (h.nameLen == 0)
+        rosterAppend(body);
+      else
+        rosterAdd(name);
+      dirty |= DIRTY_ROSTER;
+      break;
+    case OP_ROSTERDEL:
+      rosterRemove(name);
+      dirty |= DIRTY_ROSTER;
+      break;
+    case OP_ROOM:
+      strncpy(room, body, NAMELENGTH);
+      dirty |= DIRTY_ROSTER;
+      break;
+    case OP_SESSION:
+      if (bodyLen == sizeof(token)) {
+        memcpy(&token, body, sizeof(token));
+        token = be64toh(token);
+      }
+      break;
+  }
+  if (h.op <= OP_WARNING)
+    dirty |= DIRTY_OUT;
+  wattroff(out, A_BLINK | A_BOLD);
+}
+
+/*
+ * Function: showFrame
+ * -------------------
+ * display one v1 message, its first character says how
+ *
+ * *msg:  the message, not null terminated
+ * len:   length of the message
+ * *out:  chat window
+ */
+void showFrame(char *msg, uint32_t len, WINDOW *out) {
+  static char buff[MAXFRAME + 1];
+  memcpy(buff, msg, len);
+  buff[len] = 0;
+  if (buff[0] == 'U')
+    wattron(out, A_BLINK);
+  if (buff[0] == '*')
+    wattron(out, A_BOLD);
+  if (buff[0] == 'W')
+    wattron(out, A_BLINK | A_BOLD);
+  if (buff[0] == '%') {
+    //the full list arrives once, then only joins and leaves
+    //"%+" is a join, or the rest of a list too long for one frame
+    if (buff[1] == '+')
+      rosterAppend(buff+2);
+    else if (buff[1] == '-')
+      rosterRemove(buff+2);
+    else
+      rosterLoad(buff+1);
+    dirty |= DIRTY_ROSTER;
+  } else if (buff[0] == '#') {
+    //the server moved us to another room
+    strncpy(room, buff+1, NAMELENGTH);
+    dirty |= DIRTY_ROSTER;
+  } else if (len > 0) {
+    wprintw(out, buff[len - 1] != '\n' ? "%s\n" : "%s", buff);
+    dirty |= DIRTY_OUT;
+  }
+  wattroff(out, A_BLINK | A_BOLD);
+}
+
+/*
+ * Function: msNow
+ * -------------------
+ * returns monotonic time in milliseconds, paces the repaints
+ */
+long long msNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Function: sendLine
+ * -------------------
+ * turn a typed line into the v2 message it stands for and send it
+ * "@name text", "/me text", "/join room" and "/part" are commands,
+ * anything else is chat
+ *
+ * *line:  what the user typed, null terminated
+ */
+void sendLine(int sd, char *line) {
+  if (line[0] == '@') {
+    char *msg = line + 1 + strcspn(line + 1, " ");
+    if (*msg != 0)
+      *(msg++) = 0;
+    sendTyped(sd, OP_PRIVATE, line + 1, msg, strlen(msg), 0);
+  } else if (strncmp(line, "/me", 3) == 0 && (line[3] == ' ' || line[3] == 0)) {
+    char *msg = line + 3 + (line[3] == ' ');
+    sendTyped(sd, OP_ACTION, "", msg, strlen(msg), 0);
+  } else if (strncmp(line, "/join ", 6) == 0) {
+    sendTyped(sd, OP_JOIN, "", line + 6, strlen(line + 6), 0);
+  } else if (strcmp(line, "/part") == 0) {
+    sendTyped(sd, OP_PART, "", "", 0, 0);
+  } else {
+    sendTyped(sd, OP_CHAT, "", line, strlen(line), 0);
+  }
+}
+
+/*
+ * Function: reconnect
+ * -------------------
+ * the connection dropped: connect again and resume the session,
+ * or ask for the same name if the server no longer has it
+ *
+ * *host:  server to connect to
+ * port:   its port
+ * *out:   chat window, for progress
+ *
+ * returns the new socket, -1 after RETRIES failed attempts
+ */
+int reconnect(char *host, int port, WINDOW *out) {
+  wattron(out, A_BLINK);
+  wprintw(out, "Connection lost, reconnecting...\n");
+  wattroff(out, A_BLINK);
+  wnoutrefresh(out);
+  doupdate();
+  for (int i = 0; i < RETRIES; i++) {
+    char valid = 'N';
+    int sd = dialHost(host, port);
+    if (sd >= 0 && recv(sd, &valid, sizeof(char), MSG_WAITALL) == sizeof(char) && valid == 'Y' &&
+        (proto = sendHello(sd)) != 0) {
+      valid = 'X';
+      if (proto == PROTO_V2 && token != 0)
+        valid = sendResume(sd, token, lastSeq);
+      //a new session starts with a fresh roster and history
+      if (valid == 'X') {
+        token = 0;
+        valid = sendName(sd, username, strlen(username));
+      }
+      if (valid == 'Y') {
+        wprintw(out, "Reconnected\n");
+        dirty |= DIRTY_OUT;
+        return sd;
+      }
+      //somebody else has our name now, trying again will not help
+      if (valid == 'T')
+        i = RETRIES;
+    }
+    if (sd >= 0)
+      close(sd);
+    sleep(1);
+  }
+  return -1;
+}
@@ -0,0 +1,310 @@
+/* clientnet.c - connection and framing helpers shared by the clients */
+#include <string.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <endian.h>
+#include <errno.h>
+#include "../inc/clientnet.h"
+
+/*
+ * Function: dialHost
+ * -------------------
+ * Opens up a connection to the host
+ *
+ * *host: address of host to connect to
+ * port:  port to connect to on host
+ *
+ * returns file descriptor of connected socket, -1 on failure
+ */
+int dialHost(char* host, int port) {
+  struct sockaddr_in sad; /* structure to hold an IP address */
+  struct hostent *ptrh;
+  int sd;
+  struct protoent *ptrp; /* pointer to a protocol table entry */
+
+  memset((char *)&sad,0,sizeof(sad)); /* clear sockaddr structure */
+  sad.sin_family = AF_INET; /* set family to Internet */
+
+  ptrh = gethostbyname(host);
+  if ( ptrh == NULL )
+    return -1;
+  sad.sin_port = htons((u_short)port);
+  memcpy(&sad.sin_addr, ptrh->h_addr, ptrh->h_length);
+
+  /* Map TCP transport protocol name to protocol number. */
+  if ( ((long int)(ptrp = getprotobyname("tcp"))) == 0)
+    return -1;
+
+  /* Create a socket. */
+  sd = socket(PF_INET, SOCK_STREAM, ptrp->p_proto);
+  if (sd < 0)
+    return -1;
+
+  if (connect(sd, (struct sockaddr *)&sad, sizeof(sad)) < 0) {
+    close(sd);
+    return -1;
+  }
+  return sd;
+}
+
+/*
+ * Function: openSocket
+ * -------------------
+ * Opens up a connection to the host, exits if it can not
+ *
+ * *host: address of host to connect to
+ * port:  port to connect to on host
+ *
+ * returns file descriptor of connected socket
+ */
+int openSocket(char* host, int port) {
+  int sd = dialHost(host, port);
+  if (sd < 0) {
+    fprintf(stderr, "Error: could not connect to %s port %d\n", host, port);
+    exit(EXIT_FAILURE);
+  }
+  return sd;
+}
+
+/*
+ * Function: sendName
+ * -------------------
+ * sends a username request and waits for the server's verdict
+ *
+ * sd:       connected socket that already got its 'Y'
+ * *name:    username to ask for
+ * nameLen:  length of the username
+ *
+ * returns 'Y' if accepted, 'T' if taken, 'I' if invalid, 0 on error
+ */
+char sendName(int sd, char* name, uint8_t nameLen) {
+  char req[UINT8_MAX + 1];
+  char valid = 0;
+  req[0] = nameLen;
+  memcpy(req + 1, name, nameLen);
+  if (send(sd, req, nameLen + 1, 0) != nameLen + 1)
+    return 0;
+  if (recv(sd, &valid, sizeof(valid), MSG_WAITALL) != sizeof(valid))
+    return 0;
+  return valid;
+}
+
+/*
+ * Function: sendAll
+ * -------------------
+ * write a message, going on after short writes and signals so a
+ * blocking caller never leaves half a frame in the stream
+ * a non-blocking caller gets what the first write took
+ *
+ * sd:     connected socket
+ * *mh:    the message, its iovecs are used up as they go out
+ * flags:  flags for send, MSG_DONTWAIT for non-blocking callers
+ *
+ * returns bytes written, -1 on error
+ */
+static int sendAll(int sd, struct msghdr *mh, int flags) {
+  int total = 0;
+  while (mh->msg_iovlen > 0) {
+    ssize_t n = sendmsg(sd, mh, flags | MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return total > 0 ? total : -1;
+    total += n;
+    if (flags & MSG_DONTWAIT)
+      break;
+    //skip what went out, the rest of a part goes next
+    while (mh->msg_iovlen > 0 && (size_t)n >= mh->msg_iov->iov_len) {
+      n -= mh->msg_iov->iov_len;
+      mh->msg_iov++;
+      mh->msg_iovlen--;
+    }
+    if (mh->msg_iovlen > 0) {
+      mh->msg_iov->iov_base = (char*)mh->msg_iov->iov_base + n;
+      mh->msg_iov->iov_len -= n;
+    }
+  }
+  return total;
+}
+
+/*
+ * Function: sendFrame
+ * -------------------
+ * sends one message with its uint16_t length prefix in a single write
+ *
+ * sd:     connected socket
+ * *buf:   message body
+ * len:    length of the body
+ * flags:  flags for send, MSG_DONTWAIT for non-blocking callers
+ *
+ * returns bytes written, short or -1 only when non-blocking
+ */
+int sendFrame(int sd, char* buf, uint16_t len, int flags) {
+  uint16_t netLen = htons(len);
+  struct iovec iov[2] = {{&netLen, sizeof(uint16_t)}, {buf, len}};
+  struct msghdr mh;
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = iov;
+  mh.msg_iovlen = 2;
+  return sendAll(sd, &mh, flags);
+}
+
+/*
+ * Function: sendHello
+ * -------------------
+ * ask for protocol v2 before sending the name
+ *
+ * sd:  connected socket that already got its 'Y'
+ *
+ * returns the version the server will speak, 0 on error
+ */
+int sendHello(int sd) {
+  char req[2] = {(char)HELLO, PROTO_V2};
+  char ack[2];
+  if (send(sd, req, sizeof(req), 0) != sizeof(req))
+    return 0;
+  if (recv(sd, ack, sizeof(ack), MSG_WAITALL) != sizeof(ack) || ack[0] != HELLOACK)
+    return 0;
+  return ack[1];
+}
+
+/*
+ * Function: sendResume
+ * -------------------
+ * ask for a dropped session back instead of sending a name
+ *
+ * sd:       connected socket that already agreed on v2
+ * token:    the session's token from OP_SESSION
+ * lastSeq:  newest message seen
+ *
+ * returns 'Y' if resumed, 'X' if a name is needed, 0 on error
+ */
+char sendResume(int sd, uint64_t token, uint64_t lastSeq) {
+  char req[1 + 2 * sizeof(uint64_t)];
+  char valid = 0;
+  req[0] = (char)RESUME;
+  token = htobe64(token);
+  lastSeq = htobe64(lastSeq);
+  memcpy(req + 1, &token, sizeof(token));
+  memcpy(req + 1 + sizeof(token), &lastSeq, sizeof(lastSeq));
+  if (send(sd, req, sizeof(req), 0) != sizeof(req))
+    return 0;
+  if (recv(sd, &valid, sizeof(valid), MSG_WAITALL) != sizeof(valid))
+    return 0;
+  return valid;
+}
+
+/*
+ * Function: sendTyped
+ * -------------------
+ * sends one v2 message in a single write
+ *
+ * sd:     connected socket
+ * op:     OP_*
+ * *name:  name field, the recipient of OP_PRIVATE, otherwise empty
+ * *body:  message body
+ * len:    length of the body
+ * flags:  flags for send, MSG_DONTWAIT for non-blocking callers
+ *
+ * returns bytes written, short or -1 only when non-blocking
+ */
+int sendTyped(int sd, uint8_t op, const char* name, const char* body, uint16_t len, int flags) {
+  typedHdr h;
+  struct iovec iov[3];
+  struct msghdr mh;
+  memset(&h, 0, sizeof(h));
+  h.op = op;
+  h.nameLen = strlen(name);
+  h.bodyLen = htons(len);
+  iov[0].iov_base = &h;
+  iov[0].iov_len = sizeof(h);
+  iov[1].iov_base = (char*)name;
+  iov[1].iov_len = h.nameLen;
+  iov[2].iov_base = (char*)body;
+  iov[2].iov_len = len;
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = iov;
+  mh.msg_iovlen = 3;
+  return sendAll(sd, &mh, flags);
+}
+
+/*
+ * Function: readAll
+ * -------------------
+ * take everything the socket has ready into the reader, without blocking,
+ * so one wakeup can hand out every frame that arrived
+ *
+ * sd:  connected socket
+ * *r:  reader to fill, frames already handed out are dropped first
+ *
+ * returns bytes read, -1 when the server went away
+ */
+int readAll(int sd, reader* r) {
+  int total = 0;
+  r->len -= r->start;
+  memmove(r->data, r->data + r->start, r->len);
+  r->start = 0;
+  while (total < READMAX) {
+    if (r->cap - r->len < 4096) {
+      uint32_t cap = r->cap ? r->cap * 2 : 65536;
+      char *grown = realloc(r->data, cap);
+      if (grown == NULL)
+        return -1;
+      r->data = grown;
+      r->cap = cap;
+    }
+    int n = recv(sd, r->data + r->len, r->cap - r->len, MSG_DONTWAIT);
+    if (n > 0) {
+      r->len += n;
+      total += n;
+    } else if (n == 0) {
+      return -1;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      break;
+    } else if (errno != EINTR) {
+      return -1;
+    }
+  }
+  return total;
+}
+
+/*
+ * Function: nextFrame
+ * -------------------
+ * hand out the next complete frame held by the reader
+ * a v1 frame is a message behind its uint16_t length,
+ * a v2 frame is a container behind its contHdr
+ *
+ * *r:     reader filled by readAll
+ * proto:  PROTO_V1 or PROTO_V2
+ * *len:   set to the length of what is returned
+ *
+ * returns the message or the container's messages, NULL if none is complete
+ */
+char* nextFrame(reader* r, int proto, uint32_t* len) {
+  uint32_t hdr = proto == PROTO_V2 ? sizeof(contHdr) : sizeof(uint16_t);
+  uint32_t have = r->len - r->start;
+  char *p = r->data + r->start;
+  if (have < hdr)
+    return NULL;
+  if (proto == PROTO_V2) {
+    contHdr ch;
+    memcpy(&ch, p, sizeof(ch));
+    *len = ntohl(ch.len);
+  } else {
+    uint16_t netLen;
+    memcpy(&netLen, p, sizeof(netLen));
+    *len = ntohs(netLen);
+  }
+  if (have - hdr < *len)
+    return NULL;
+  r->start += hdr + *len;
+  return p + hdr;
+}
@@ -0,0 +1,396 @@
+/* handover.c - hot restart: a new server process takes the listeners,
+ * the client sockets and their state from the running one
+ *
+ * the running server listens on a unix seqpacket socket. a new process
+ * started with the same -H path connects to it, the old shards stop at
+ * a barrier and send every client with its socket attached, the old
+ * process exits once the new one has it all. nobody reconnects
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "../inc/server.h"
+
+hoStaged *staged = NULL;        //clients taken over, adopted by their shards
+int numStaged = 0;              //entries in staged
+session *stagedHeld = NULL;     //held sessions taken over, timed by shard 0
+int numHeld = 0;                //entries in stagedHeld
+
+static int hoSock = -1;         //connection to the new process while handing over
+static int shardsDone = 0;      //shards that have sent their clients
+static pthread_mutex_t hoLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hoCond = PTHREAD_COND_INITIALIZER;
+static pthread_barrier_t hoBarrier;
+
+static void* handoverMain(void*);
+
+/*
+ * Function: hoSend
+ * -------------------
+ * send one record, with a descriptor attached if there is one
+ *
+ * sd:    unix socket
+ * rec:   the record
+ * len:   its length
+ * fd:    descriptor to pass along, -1 for none
+ *
+ * returns 0 on success, -1 on failure
+ */
+static int hoSend(int sd, const void *rec, size_t len, int fd) {
+  struct iovec iov = {(void*)rec, len};
+  struct msghdr mh;
+  char ctl[CMSG_SPACE(sizeof(int))];
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  if (fd >= 0) {
+    memset(ctl, 0, sizeof(ctl));
+    mh.msg_control = ctl;
+    mh.msg_controllen = sizeof(ctl);
+    struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(c), &fd, sizeof(int));
+  }
+  while (sendmsg(sd, &mh, MSG_NOSIGNAL) < 0) {
+    if (errno != EINTR)
+      return -1;
+  }
+  return 0;
+}
+
+/*
+ * Function: hoRecv
+ * -------------------
+ * receive one record and the descriptor that came with it
+ *
+ * sd:   unix socket
+ * buf:  where the record goes
+ * max:  room in buf
+ * *fd:  set to the descriptor, -1 if none came
+ *
+ * returns the record's length, -1 on failure or a short read
+ */
+static ssize_t hoRecv(int sd, void *buf, size_t max, int *fd) {
+  struct iovec iov = {buf, max};
+  struct msghdr mh;
+  char ctl[CMSG_SPACE(sizeof(int))];
+  ssize_t n;
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = ctl;
+  mh.msg_controllen = sizeof(ctl);
+  *fd = -1;
+  while ((n = recvmsg(sd, &mh, MSG_CMSG_CLOEXEC)) < 0) {
+    if (errno != EINTR)
+      return -1;
+  }
+  struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+  if (c != NULL && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+    memcpy(fd, CMSG_DATA(c), sizeof(int));
+  if (n == 0 || (mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC)))
+    return -1;
+  return n;
+}
+
+/*
+ * Function: hoAddress
+ * -------------------
+ * fill in the address of the handover socket
+ *
+ * path:  its path
+ * *sun:  address to fill in
+ *
+ * returns 0, -1 if the path is too long
+ */
+static int hoAddress(const char *path, struct sockaddr_un *sun) {
+  memset(sun, 0, sizeof(*sun));
+  sun->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(sun->sun_path))
+    return -1;
+  strcpy(sun->sun_path, path);
+  return 0;
+}
+
+/*
+ * Function: handoverTake
+ * -------------------
+ * take over from a server already running with the same -H path:
+ * its listeners go into Psd, its clients and held sessions are staged
+ * for the shards, ids and message numbers carry on where it left off
+ *
+ * path:  the handover socket
+ * Psd:   where the listeners go
+ * max:   room in Psd, listeners beyond it are closed
+ *
+ * returns the number of listeners taken, -1 if nothing is running
+ */
+int handoverTake(const char *path, int *Psd, int max) {
+  struct sockaddr_un sun;
+  uint64_t recBuf[(sizeof(hoClient) + INBUFSIZE) / sizeof(uint64_t) + 1];
+  char *rec = (char*)recBuf;
+  int numListen = 0;
+  int fd, sd;
+  ssize_t n;
+  hoHello hello = {HO_HELLO, HOVERSION, sizeof(hoClient), sizeof(session)};
+  if (hoAddress(path, &sun) < 0 || (sd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0)
+    return -1;
+  if (connect(sd, (struct sockaddr*)&sun, sizeof(sun)) < 0) {
+    close(sd);
+    return -1;
+  }
+  if (hoSend(sd, &hello, sizeof(hello), -1) < 0)
+    goto fail;
+  while ((n = hoRecv(sd, rec, sizeof(recBuf), &fd)) > 0) {
+    switch ((uint8_t)rec[0]) {
+      case HO_CLIENT: {
+        hoClient *c = (hoClient*)rec;
+        hoStaged *st;
+        if (fd < 0 || (size_t)n != sizeof(hoClient) + c->inLen)
+          goto fail;
+        //a name stays held until the shard adopting its client claims it
+        if (c->isActive)
+          nameInsert(c->name, NULL, -1);
+        if (numStaged % 1024 == 0) {
+          hoStaged *grown = realloc(staged, (numStaged + 1024) * sizeof(hoStaged));
+          if (grown == NULL)
+            goto fail;
+          staged = grown;
+        }
+        st = &staged[numStaged++];
+        st->fd = fd;
+        st->rec = malloc(n);
+        st->queue = malloc(c->queueLen ? c->queueLen : 1);
+        if (st->rec == NULL || st->queue == NULL)
+          goto fail;
+        memcpy(st->rec, rec, n);
+        //the queue follows in order, a chunk at a time
+        for (uint32_t got = 0; got < c->queueLen; got += n - 1) {
+          char chunk[1 + HOCHUNK];
+          if ((n = hoRecv(sd, chunk, sizeof(chunk), &fd)) < 2 || chunk[0] != HO_QUEUE || got + n - 1 > c->queueLen)
+            goto fail;
+          memcpy(st->queue + got, chunk + 1, n - 1);
+        }
+        break;
+      }
+      case HO_SESSION: {
+        hoSession *hs = (hoSession*)rec;
+        if ((size_t)n != sizeof(hoSession))
+          goto fail;
+        sessionRestore(&hs->s);
+        if (hs->s.held) {
+          nameInsert(hs->s.name, NULL, -1);
+          session *grown = realloc(stagedHeld, (numHeld + 1) * sizeof(session));
+          if (grown == NULL)
+            goto fail;
+          stagedHeld = grown;
+          stagedHeld[numHeld++] = hs->s;
+        }
+        break;
+      }
+      case HO_LISTEN:
+        if (fd < 0)
+          goto fail;
+        if (numListen < max)
+          Psd[numListen++] = fd;
+        else
+          close(fd);
+        break;
+      case HO_END: {
+        hoEnd *e = (hoEnd*)rec;
+        if ((size_t)n != sizeof(hoEnd) || e->status != 0) {
+          fprintf(stderr, "Error: the running server can not hand over (%s)\n",
+                  (size_t)n == sizeof(hoEnd) && e->status == HOREFUSE_URING ? "io_uring" : "different version");
+          exit(EXIT_FAILURE);
+        }
+        nextUserId = e->nextUserId;
+        historyContinue(e->lastSeq);
+        uint8_t ack = HO_ACK;
+        hoSend(sd, &ack, sizeof(ack), -1);
+        //the old process lets go of its ports when it exits, wait for that
+        hoRecv(sd, &ack, sizeof(ack), &fd);
+        close(sd);
+        LOG(LOG_INFO, "took over %d clients and %d listeners", numStaged, numListen);
+        return numListen;
+      }
+      default:
+        goto fail;
+    }
+  }
+fail:
+  //the old process is past the point of no return, so are we
+  fprintf(stderr, "Error: hot restart failed part way\n");
+  exit(EXIT_FAILURE);
+}
+
+/*
+ * Function: handoverServe
+ * -------------------
+ * listen for the next process to hand over to
+ *
+ * path:  the handover socket, replaced if it is left over
+ */
+void handoverServe(const char *path) {
+  struct sockaddr_un sun;
+  pthread_t thread;
+  int sd;
+  if (hoAddress(path, &sun) < 0 || (sd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0) {
+    fprintf(stderr, "Error: bad handover socket %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+  unlink(path);
+  if (bind(sd, (struct sockaddr*)&sun, sizeof(sun)) < 0 || listen(sd, 1) < 0) {
+    perror("handover socket");
+    exit(EXIT_FAILURE);
+  }
+  if (pthread_create(&thread, NULL, handoverMain, (void*)(intptr_t)sd) != 0) {
+    perror("pthread_create()");
+    exit(EXIT_FAILURE);
+  }
+  pthread_detach(thread);
+}
+
+/*
+ * Function: sendSession
+ * -------------------
+ * sessionEach callback: pass one session on
+ *
+ * *s:  the session
+ */
+static void sendSession(const session *s) {
+  hoSession hs;
+  memset(&hs, 0, sizeof(hs));
+  hs.type = HO_SESSION;
+  hs.s = *s;
+  hs.s.next = NULL;
+  hoSend(hoSock, &hs, sizeof(hs), -1);
+}
+
+/*
+ * Function: handoverMain
+ * -------------------
+ * waits for a new process, stops the shards, sends what they do not
+ * own themselves and exits once the new process has everything
+ *
+ * arg:  the listening handover socket
+ */
+static void* handoverMain(void *arg) {
+  int ls = (int)(intptr_t)arg;
+  myShard = -1;
+  while (1) {
+    hoHello hello;
+    uint64_t helloBuf[8];
+    uint8_t ack;
+    int fd;
+    ssize_t n;
+    int sd = accept(ls, NULL, NULL);
+    if (sd < 0)
+      continue;
+    //an older hello is a single byte, a newer one may be longer
+    memset(helloBuf, 0, sizeof(helloBuf));
+    if ((n = hoRecv(sd, helloBuf, sizeof(helloBuf), &fd)) < 1 || ((uint8_t*)helloBuf)[0] != HO_HELLO) {
+      close(sd);
+      continue;
+    }
+    memcpy(&hello, helloBuf, sizeof(hello));
+    //records are copied as they are, both sides must lay them out alike
+    if (n != sizeof(hello) || hello.version != HOVERSION ||
+        hello.clientSize != sizeof(hoClient) || hello.sessionSize != sizeof(session)) {
+      hoEnd e = {HO_END, HOREFUSE_VERSION, 0, 0};
+      LOG(LOG_WARN, "refused a hot restart from handover version %d, this is %d", hello.version, HOVERSION);
+      hoSend(sd, &e, sizeof(e), -1);
+      close(sd);
+      continue;
+    }
+    //sockets the kernel is reading into can not change hands
+    if (useUring) {
+      hoEnd e = {HO_END, HOREFUSE_URING, 0, 0};
+      LOG(LOG_WARN, "refused a hot restart, io_uring can not hand over");
+      hoSend(sd, &e, sizeof(e), -1);
+      close(sd);
+      continue;
+    }
+    LOG(LOG_INFO, "handing over to a new process");
+    hoSock = sd;
+    pthread_barrier_init(&hoBarrier, NULL, numShards);
+    for (int i = 0; i < numShards; i++)
+      postMail(i, MAIL_HANDOVER, NULL, NULL);
+    pthread_mutex_lock(&hoLock);
+    while (shardsDone < numShards)
+      pthread_cond_wait(&hoCond, &hoLock);
+    pthread_mutex_unlock(&hoLock);
+    //the shards are parked, what is left is shared state
+    sessionEach(sendSession);
+    for (int i = 0; i < numShards; i++)
+      hoSend(sd, (uint8_t[]){HO_LISTEN}, 1, shards[i].listener);
+    hoEnd e = {HO_END, 0, nextUserId, historyLastSeq()};
+    hoSend(sd, &e, sizeof(e), -1);
+    hoRecv(sd, &ack, sizeof(ack), &fd);
+    //the shards wrote out their trace buffers before parking,
+    //what they and we logged is still in the rings
+    LOG(LOG_INFO, "handed over, exiting");
+    logFlush();
+    //the socket file is the new process's now, leave it alone
+    exit(EXIT_SUCCESS);
+  }
+  return NULL;
+}
+
+/*
+ * Function: handoverBarrier
+ * -------------------
+ * a shard got MAIL_HANDOVER and stopped reading:
+ * wait for the rest, after this nobody sends anybody mail
+ */
+void handoverBarrier() {
+  pthread_barrier_wait(&hoBarrier);
+}
+
+/*
+ * Function: handoverSend
+ * -------------------
+ * send one client and its queue stream to the new process
+ *
+ * *c:       the client's record, inbuf included
+ * len:      length of the record
+ * fd:       its socket
+ * queue:    its queue stream
+ * queueLen: length of the stream
+ */
+void handoverSend(hoClient *c, size_t len, int fd, const char *queue, uint32_t queueLen) {
+  char chunk[1 + HOCHUNK];
+  c->type = HO_CLIENT;
+  c->queueLen = queueLen;
+  //a client's records must not interleave with another shard's
+  pthread_mutex_lock(&hoLock);
+  hoSend(hoSock, c, len, fd);
+  chunk[0] = HO_QUEUE;
+  for (uint32_t pos = 0; pos < queueLen; pos += HOCHUNK) {
+    uint32_t n = queueLen - pos < HOCHUNK ? queueLen - pos : HOCHUNK;
+    memcpy(chunk + 1, queue + pos, n);
+    hoSend(hoSock, chunk, 1 + n, -1);
+  }
+  pthread_mutex_unlock(&hoLock);
+}
+
+/*
+ * Function: handoverDone
+ * -------------------
+ * a shard has sent all its clients, it never runs again
+ */
+void handoverDone() {
+  pthread_mutex_lock(&hoLock);
+  shardsDone++;
+  pthread_cond_signal(&hoCond);
+  pthread_mutex_unlock(&hoLock);
+  while (1)
+    pause();
+}
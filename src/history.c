@@ -0,0 +1,576 @@
+/* history.c - append-only chat history in memory mapped segment files
+ *
+ * every shard appends under one mutex, an append is a memcpy into the
+ * mapping: no syscalls on the event loops, the kernel writes the pages
+ * back on its own. a helper thread creates the next segments ahead of
+ * time and deletes old ones once no queued replay still points into them
+ *
+ * each record holds the seq of its room's previous record, and a sparse
+ * index turns a seq into a place, so replaying N messages costs N lookups
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../inc/server.h"
+
+//most index entries a segment can need, records are at least a header long
+#define IDXMAX (HISTSEGBYTES / sizeof(histRec) / HISTINDEX + 1)
+#define RECSIZE(len) ((sizeof(histRec) + (len) + 7) & ~(size_t)7)
+
+int historyDepth = HISTREPLAY;              //messages replayed on join
+
+static const char *histDir = NULL;          //where segments go, NULL while off
+static histSeg *segs[HISTSEGS];             //live segments, oldest first
+static int numSegs = 0;                     //entries in segs
+static histSeg *spares[HISTSPARES];         //next segments, made ahead of time
+static int numSpares = 0;                   //entries in spares
+static uint64_t dropped = 0;                //appends lost while no spare was ready
+static histSeg *retired = NULL;             //dropped segments still mapped
+static uint32_t nextFile = 0;               //number of the next segment file
+static uint64_t nextSeq = 1;                //seq of the next record
+static histHead heads[HISTHEADS];           //newest message of every room
+static pthread_mutex_t histLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t histWake = PTHREAD_COND_INITIALIZER;
+
+static histSeg* makeSeg(uint32_t);
+static histSeg* loadSeg(uint32_t);
+static void dropSeg(histSeg*);
+static histHead* headSlot(const char*);
+static void* historyMain(void*);
+
+/*
+ * Function: wallMs
+ * -------------------
+ * returns the wall clock time in ms
+ */
+static int64_t wallMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Function: segFile
+ * -------------------
+ * scandir filter, picks out the segment files
+ *
+ * *e:  directory entry
+ *
+ * returns nonzero for a segment file
+ */
+static int segFile(const struct dirent *e) {
+  size_t len = strlen(e->d_name);
+  return strncmp(e->d_name, "hist-", 5) == 0 && len > 4 && strcmp(e->d_name + len - 4, ".seg") == 0;
+}
+
+/*
+ * Function: historyStart
+ * -------------------
+ * turn the history on, clearing out segments of an earlier run,
+ * or after a hot restart carrying on with the previous process's
+ *
+ * dir:   directory for the segment files
+ * keep:  nonzero to reopen the segments left in dir
+ *
+ * returns 0 on success, -1 if the first segment can not be made
+ */
+int historyStart(const char *dir, int keep) {
+  pthread_t thread;
+  struct dirent **list;
+  char path[4096];
+  uint32_t no;
+  int n;
+  if ((n = scandir(dir, &list, segFile, alphasort)) < 0) {
+    perror("scandir()");
+    return -1;
+  }
+  histDir = dir;
+  //the numbers are zero padded, oldest first
+  for (int i = 0; i < n; i++) {
+    histSeg *s = NULL;
+    if (keep && sscanf(list[i]->d_name, "hist-%u.seg", &no) == 1) {
+      if (no >= nextFile)
+        nextFile = no + 1;
+      s = loadSeg(no);
+    }
+    //empty spares and anything unreadable go, so do segments past HISTSEGS
+    if (s == NULL) {
+      snprintf(path, sizeof(path), "%s/%s", dir, list[i]->d_name);
+      unlink(path);
+    } else {
+      if (numSegs == HISTSEGS) {
+        dropSeg(segs[0]);
+        memmove(segs, segs + 1, (HISTSEGS - 1) * sizeof(histSeg*));
+        numSegs--;
+      }
+      segs[numSegs++] = s;
+    }
+    free(list[i]);
+  }
+  free(list);
+  //room chains pick up where they left off, appends go on in the newest
+  for (int i = 0; i < numSegs; i++) {
+    for (uint32_t off = 0; off < segs[i]->used;) {
+      histRec *r = (histRec*)(segs[i]->base + off);
+      histHead *h = headSlot(r->room);
+      if (h != NULL) {
+        strcpy(h->room, r->room);
+        h->last = r->seq;
+      }
+      nextSeq = r->seq + 1;
+      off += RECSIZE(r->frameLen + r->altLen);
+    }
+  }
+  if (numSegs == 0) {
+    if ((segs[0] = makeSeg(nextFile++)) == NULL) {
+      histDir = NULL;
+      return -1;
+    }
+    numSegs = 1;
+  } else {
+    LOG(LOG_INFO, "history: kept %d segments, up to message %llu", numSegs, (unsigned long long)(nextSeq - 1));
+  }
+  if (pthread_create(&thread, NULL, historyMain, NULL) != 0) {
+    perror("pthread_create()");
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+/*
+ * Function: makeSeg
+ * -------------------
+ * create, size and map a segment file
+ * the pages are populated up front so appends never fault to disk
+ *
+ * no:  file number
+ *
+ * returns the segment, NULL on failure
+ */
+static histSeg* makeSeg(uint32_t no) {
+  char path[4096];
+  int fd;
+  histSeg *s = calloc(1, sizeof(histSeg) + IDXMAX * sizeof(histIdx));
+  if (s == NULL)
+    return NULL;
+  snprintf(path, sizeof(path), "%s/hist-%08u.seg", histDir, no);
+  if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0 ||
+      ftruncate(fd, HISTSEGBYTES) < 0) {
+    LOG(LOG_ERROR, "history: can not create %s", path);
+    if (fd >= 0)
+      close(fd);
+    free(s);
+    return NULL;
+  }
+  s->base = mmap(NULL, HISTSEGBYTES, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+  close(fd);
+  if (s->base == MAP_FAILED || (s->anchor = allocMessage(0)) == NULL) {
+    LOG(LOG_ERROR, "history: can not map %s", path);
+    if (s->base != MAP_FAILED)
+      munmap(s->base, HISTSEGBYTES);
+    unlink(path);
+    free(s);
+    return NULL;
+  }
+  s->no = no;
+  return s;
+}
+
+/*
+ * Function: loadSeg
+ * -------------------
+ * map a segment a previous process left and find its records again,
+ * they run up to the zeros the file was created with
+ *
+ * no:  file number
+ *
+ * returns the segment, NULL if it can not be mapped or holds no records
+ */
+static histSeg* loadSeg(uint32_t no) {
+  char path[4096];
+  struct stat st;
+  int fd;
+  histSeg *s = calloc(1, sizeof(histSeg) + IDXMAX * sizeof(histIdx));
+  if (s == NULL)
+    return NULL;
+  snprintf(path, sizeof(path), "%s/hist-%08u.seg", histDir, no);
+  if ((fd = open(path, O_RDWR | O_CLOEXEC)) < 0 || fstat(fd, &st) < 0 || st.st_size != HISTSEGBYTES) {
+    if (fd >= 0)
+      close(fd);
+    free(s);
+    return NULL;
+  }
+  s->base = mmap(NULL, HISTSEGBYTES, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+  close(fd);
+  if (s->base == MAP_FAILED || (s->anchor = allocMessage(0)) == NULL) {
+    LOG(LOG_ERROR, "history: can not map %s", path);
+    if (s->base != MAP_FAILED)
+      munmap(s->base, HISTSEGBYTES);
+    free(s);
+    return NULL;
+  }
+  s->no = no;
+  while (s->used + sizeof(histRec) <= HISTSEGBYTES) {
+    histRec *r = (histRec*)(s->base + s->used);
+    size_t size = RECSIZE(r->frameLen + r->altLen);
+    //seqs only go up, anything else is past the end
+    if (r->seq == 0 || r->seq <= s->lastSeq || s->used + size > HISTSEGBYTES)
+      break;
+    if (s->firstSeq == 0)
+      s->firstSeq = r->seq;
+    if ((r->seq - s->firstSeq) % HISTINDEX == 0) {
+      s->index[s->numIdx].seq = r->seq;
+      s->index[s->numIdx].ms = r->ms;
+      s->index[s->numIdx++].off = s->used;
+    }
+    s->lastSeq = r->seq;
+    s->lastMs = r->ms;
+    s->used += size;
+  }
+  if (s->firstSeq == 0) {
+    munmap(s->base, HISTSEGBYTES);
+    releaseMessage(s->anchor);
+    free(s);
+    return NULL;
+  }
+  return s;
+}
+
+/*
+ * Function: dropSeg
+ * -------------------
+ * unmap and delete a segment nobody points into any more
+ *
+ * *s:  segment to drop
+ */
+static void dropSeg(histSeg *s) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/hist-%08u.seg", histDir, s->no);
+  unlink(path);
+  munmap(s->base, HISTSEGBYTES);
+  releaseMessage(s->anchor);
+  free(s);
+}
+
+/*
+ * Function: historyMain
+ * -------------------
+ * helper thread: keeps HISTSPARES segments ready and drops retired
+ * segments once the last replay holding them has been sent
+ *
+ * *arg:  unused
+ */
+static void* historyMain(void *arg) {
+  struct timespec until;
+  //not a shard, keeps its pools apart from shard 0's in the metrics
+  myShard = -1;
+  pthread_mutex_lock(&histLock);
+  while (1) {
+    while (numSpares < HISTSPARES) {
+      uint32_t no = nextFile++;
+      pthread_mutex_unlock(&histLock);
+      histSeg *s = makeSeg(no);
+      pthread_mutex_lock(&histLock);
+      if (s == NULL)
+        break;
+      spares[numSpares++] = s;
+    }
+    for (histSeg **ps = &retired; *ps != NULL;) {
+      histSeg *s = *ps;
+      //queued replays hold the anchor, we hold the last reference
+      if (__atomic_load_n(&s->anchor->refs, __ATOMIC_ACQUIRE) == 1) {
+        *ps = s->next;
+        dropSeg(s);
+      } else {
+        ps = &s->next;
+      }
+    }
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec++;
+    pthread_cond_timedwait(&histWake, &histLock, &until);
+  }
+  return NULL;
+}
+
+/*
+ * Function: rotate
+ * -------------------
+ * start a new segment, retiring the oldest once HISTSEGS are live
+ * the segment is always one the helper made, creating a file here
+ * would stall the calling shard's loop with the lock held
+ * called with histLock held
+ *
+ * returns the new segment, NULL if no spare is ready
+ */
+static histSeg* rotate() {
+  //the helper fell behind, the append is lost until it catches up
+  if (numSpares == 0) {
+    __atomic_store_n(&dropped, dropped + 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&histWake);
+    return NULL;
+  }
+  histSeg *s = spares[0];
+  memmove(spares, spares + 1, --numSpares * sizeof(histSeg*));
+  if (numSegs == HISTSEGS) {
+    segs[0]->next = retired;
+    retired = segs[0];
+    memmove(segs, segs + 1, (HISTSEGS - 1) * sizeof(histSeg*));
+    numSegs--;
+  }
+  segs[numSegs++] = s;
+  pthread_cond_signal(&histWake);
+  return s;
+}
+
+/*
+ * Function: headSlot
+ * -------------------
+ * find the head of a room's chain, or the slot to start one in
+ * slots whose messages have all been deleted are reused
+ * called with histLock held
+ *
+ * room:  room name
+ *
+ * returns the slot, NULL if the table is full
+ */
+static histHead* headSlot(const char *room) {
+  uint32_t h = 2166136261u;
+  for (const char *c = room; *c; c++) {
+    h ^= (uint8_t)*c;
+    h *= 16777619u;
+  }
+  histHead *stale = NULL;
+  for (uint32_t n = 0, i = h & (HISTHEADS - 1); n < HISTHEADS; n++, i = (i + 1) & (HISTHEADS - 1)) {
+    if (heads[i].room[0] == 0)
+      return stale ? stale : &heads[i];
+    if (strcmp(heads[i].room, room) == 0)
+      return &heads[i];
+    if (stale == NULL && heads[i].last < segs[0]->firstSeq)
+      stale = &heads[i];
+  }
+  return stale;
+}
+
+/*
+ * Function: seekSeq
+ * -------------------
+ * find a record by seq through the sparse index
+ * called with histLock held
+ *
+ * seq:   record to find
+ * **in:  set to the segment holding it
+ *
+ * returns the record, NULL if it has been deleted
+ */
+static histRec* seekSeq(uint64_t seq, histSeg **in) {
+  histSeg *s = NULL;
+  for (int i = numSegs - 1; i >= 0; i--) {
+    if (segs[i]->firstSeq != 0 && segs[i]->firstSeq <= seq && seq <= segs[i]->lastSeq) {
+      s = segs[i];
+      break;
+    }
+  }
+  if (s == NULL)
+    return NULL;
+  //last index entry at or before seq, then walk the records
+  int lo = 0, hi = s->numIdx - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (s->index[mid].seq <= seq)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  uint32_t off = s->index[lo].off;
+  histRec *r = (histRec*)(s->base + off);
+  while (r->seq < seq) {
+    off += RECSIZE(r->frameLen + r->altLen);
+    r = (histRec*)(s->base + off);
+  }
+  *in = s;
+  return r;
+}
+
+/*
+ * Function: seqSince
+ * -------------------
+ * the first seq said at or after a time, through the sparse index
+ * called with histLock held
+ *
+ * ms:  wall clock time
+ *
+ * returns the seq, nextSeq if nothing that recent was said
+ */
+static uint64_t seqSince(int64_t ms) {
+  for (int i = 0; i < numSegs; i++) {
+    histSeg *s = segs[i];
+    if (s->firstSeq == 0 || s->lastMs < ms)
+      continue;
+    //first index entry at or after ms, the record before it may be too
+    int lo = 0, hi = s->numIdx - 1;
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (s->index[mid].ms >= ms)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+    if (lo > 0)
+      lo--;
+    uint32_t off = s->index[lo].off;
+    histRec *r = (histRec*)(s->base + off);
+    while (r->ms < ms) {
+      off += RECSIZE(r->frameLen + r->altLen);
+      r = (histRec*)(s->base + off);
+    }
+    return r->seq;
+  }
+  return nextSeq;
+}
+
+/*
+ * Function: historyAppend
+ * -------------------
+ * add a chat frame and its v2 form to the history of a room,
+ * the v2 form gets the record's seq written into it
+ *
+ * room:  room it was said in
+ * *m:    the framed message, copied as it goes on the wire
+ */
+void historyAppend(const char *room, msgbuf *m) {
+  if (m == NULL)
+    return;
+  //without a history the v2 form still gets its number
+  if (histDir == NULL) {
+    stampMessage(m->alt, __atomic_fetch_add(&nextSeq, 1, __ATOMIC_RELAXED));
+    return;
+  }
+  uint16_t altLen = m->alt != NULL ? m->alt->len : 0;
+  size_t size = RECSIZE(m->len + altLen);
+  pthread_mutex_lock(&histLock);
+  histSeg *s = segs[numSegs - 1];
+  if (s->used + size > HISTSEGBYTES && (s = rotate()) == NULL) {
+    pthread_mutex_unlock(&histLock);
+    return;
+  }
+  histRec *r = (histRec*)(s->base + s->used);
+  histHead *h = headSlot(room);
+  r->seq = nextSeq++;
+  r->ms = wallMs();
+  r->prev = h != NULL && strcmp(h->room, room) == 0 ? h->last : 0;
+  strncpy(r->room, room, NAMELENGTH);
+  r->room[NAMELENGTH] = 0;
+  r->frameLen = m->len;
+  r->altLen = altLen;
+  memcpy(r + 1, m->data, m->len);
+  //not shared yet, its number can still be written in
+  stampMessage(m->alt, r->seq);
+  if (altLen > 0)
+    memcpy((char*)(r + 1) + m->len, m->alt->data, altLen);
+  if (s->firstSeq == 0)
+    s->firstSeq = r->seq;
+  if ((r->seq - s->firstSeq) % HISTINDEX == 0) {
+    s->index[s->numIdx].seq = r->seq;
+    s->index[s->numIdx].ms = r->ms;
+    s->index[s->numIdx++].off = s->used;
+  }
+  s->lastSeq = r->seq;
+  s->lastMs = r->ms;
+  s->used += size;
+  if (h != NULL) {
+    strcpy(h->room, r->room);
+    h->last = r->seq;
+  }
+  pthread_mutex_unlock(&histLock);
+}
+
+/*
+ * Function: historyDropped
+ * -------------------
+ * returns appends lost so far because no spare segment was ready
+ */
+uint64_t historyDropped() {
+  return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+/*
+ * Function: historyReplay
+ * -------------------
+ * queue the last historyDepth messages of a room for a client,
+ * or on a resume every message it missed, up to HISTCATCHUP
+ * the frames are sent straight from the mapped segments
+ *
+ * *user:  client that just joined the room
+ * room:   the room
+ * after:  last seq the client saw, 0 when it just joined
+ */
+void historyReplay(client *user, const char *room, uint64_t after) {
+  int max = after ? HISTCATCHUP : historyDepth;
+  histRec *recs[max > 0 ? max : 1];
+  histSeg *in[max > 0 ? max : 1];
+  int n = 0;
+  if (histDir == NULL || max <= 0)
+    return;
+  pthread_mutex_lock(&histLock);
+  histHead *h = headSlot(room);
+  if (h != NULL && strcmp(h->room, room) == 0) {
+    uint64_t oldest = seqSince(wallMs() - HISTAGE);
+    if (oldest <= after)
+      oldest = after + 1;
+    for (uint64_t seq = h->last; seq >= oldest && seq != 0 && n < max; seq = recs[n++]->prev) {
+      if ((recs[n] = seekSeq(seq, &in[n])) == NULL)
+        break;
+      holdMessage(in[n]->anchor);
+    }
+  }
+  pthread_mutex_unlock(&histLock);
+  //oldest first, every entry keeps its segment mapped until sent
+  while (n-- > 0) {
+    char *frame = (char*)(recs[n] + 1);
+    if (user->proto == PROTO_V2 && recs[n]->altLen > 0)
+      queueSpan(user, in[n]->anchor, frame + recs[n]->frameLen, recs[n]->altLen, 1);
+    //a record without its v2 form is skipped for v2 clients
+    else if (user->proto != PROTO_V2)
+      queueSpan(user, in[n]->anchor, frame, recs[n]->frameLen, 0);
+    releaseMessage(in[n]->anchor);
+  }
+}
+
+/*
+ * Function: historyLastSeq
+ * -------------------
+ * returns the seq of the newest message, 0 before the first one
+ */
+uint64_t historyLastSeq() {
+  uint64_t seq;
+  if (histDir == NULL)
+    return __atomic_load_n(&nextSeq, __ATOMIC_RELAXED) - 1;
+  pthread_mutex_lock(&histLock);
+  seq = nextSeq - 1;
+  pthread_mutex_unlock(&histLock);
+  return seq;
+}
+
+/*
+ * Function: historyContinue
+ * -------------------
+ * number new messages on from a previous process's, so resume
+ * tokens it handed out keep meaning the same message
+ *
+ * lastSeq:  seq of its newest message
+ */
+void historyContinue(uint64_t lastSeq) {
+  pthread_mutex_lock(&histLock);
+  if (lastSeq + 1 > nextSeq)
+    __atomic_store_n(&nextSeq, lastSeq + 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&histLock);
+}
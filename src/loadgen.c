@@ -0,0 +1,450 @@
+/* loadgen.c - headless load generator and fan-out latency benchmark */
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "../inc/clientnet.h"
+#include "../inc/timer.h"
+
+#define NAMELENGTH 10
+#define MSGLENGTH 1001     /* the server drops clients sending this or more */
+#define MINSIZE 32         /* room for the marker, size and timestamp */
+#define MAXSIZES 16        /* entries in the -s size mix */
+#define INBUF 4096         /* per-connection receive buffer */
+#define MAXEVENTS 256
+#define LATBUCKET 10       /* microseconds per latency histogram bucket */
+#define LATBUCKETS 100000  /* one second, anything slower lands in the last */
+#define MARKER "LG "       /* starts every generated message body */
+
+/*
+*****************************************************************************
+** syntax:  ./loadgen [-c conns] [-r msgs_per_sec] [-s size,size,...]      **
+**                    [-d seconds] [-w drain_seconds] [-n prefix]          **
+**                    <host> <port>                                        **
+*****************************************************************************
+*/
+
+//one headless connection
+typedef struct conn {
+  int sd;                  //socket, -1 once closed
+  uint32_t skip;           //bytes left of a frame too big for inbuf
+  uint32_t inLen;          //bytes in inbuf
+  uint16_t outLen;         //bytes of a partly sent frame in out
+  uint16_t outSent;        //bytes of out already written
+  char inbuf[INBUF];
+  char out[sizeof(uint16_t) + MSGLENGTH];
+}conn;
+
+int connectAll(char*, int, int, char*);
+void drain(int);
+void readConn(conn*);
+void takeFrame(char*, uint16_t);
+void sendOne(conn*);
+void flushOut(conn*);
+void dropConn(conn*);
+uint64_t percentile(double);
+void report(double, double);
+
+conn *conns = NULL;        /* every connection that finished the handshake */
+int numConns = 0;          /* entries in conns */
+int liveConns = 0;         /* connections still open */
+int epfd = -1;
+int sizes[MAXSIZES] = {128}; /* message sizes picked round robin */
+int numSizes = 1;
+uint64_t rejected = 0;     /* connections the server turned away */
+uint64_t sent = 0;         /* messages written */
+uint64_t deferred = 0;     /* sends skipped while a connection was backed up */
+uint64_t expected = 0;     /* deliveries owed, one per live connection per message */
+uint64_t delivered = 0;    /* generated messages received back */
+uint64_t misframed = 0;    /* frames whose length disagrees with their body */
+uint64_t latMax = 0;
+uint64_t *latency = NULL;  /* histogram of fan-out latency */
+
+int main(int argc, char *argv[]) {
+  int want = 100;          /* connections to open */
+  int rate = 1000;         /* messages per second across all connections */
+  int duration = 10;       /* seconds to send for */
+  int drainTime = 2;       /* seconds to wait for stragglers */
+  char *prefix = "lg";     /* usernames are prefix + index */
+  uint64_t start, now, end, lastReport;
+  double sendSecs;
+  uint64_t sentMark = 0, deliveredMark = 0;
+  int rr = 0;
+  int opt;
+  struct rlimit rl;
+
+  while ((opt = getopt(argc, argv, "c:r:s:d:w:n:")) != -1) {
+    switch (opt) {
+      case 'c':
+        want = atoi(optarg);
+        break;
+      case 'r':
+        rate = atoi(optarg);
+        break;
+      case 's':
+        numSizes = 0;
+        for (char *tok = strtok(optarg, ","); tok != NULL && numSizes < MAXSIZES; tok = strtok(NULL, ","))
+          sizes[numSizes++] = atoi(tok);
+        break;
+      case 'd':
+        duration = atoi(optarg);
+        break;
+      case 'w':
+        drainTime = atoi(optarg);
+        break;
+      case 'n':
+        prefix = optarg;
+        break;
+      default:
+        argc = 0;
+    }
+  }
+  for (int i = 0; i < numSizes; i++)
+    if (sizes[i] < MINSIZE || sizes[i] >= MSGLENGTH)
+      argc = 0;
+  if (argc - optind != 2 || want < 1 || rate < 1 || duration < 1 || numSizes == 0 || strlen(prefix) > 2) {
+    fprintf(stderr,"Error: Wrong number of arguments\n");
+    fprintf(stderr,"usage:\n");
+    fprintf(stderr,"%s [-c conns] [-r msgs_per_sec] [-s size,...] [-d seconds] [-w drain_seconds] [-n prefix] host port\n", argv[0]);
+    fprintf(stderr,"sizes are %d to %d bytes, the prefix is at most 2 characters\n", MINSIZE, MSGLENGTH - 1);
+    exit(EXIT_FAILURE);
+  }
+  //thousands of sockets need more than the default descriptor limit
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+  if ((conns = calloc(want, sizeof(conn))) == NULL || (latency = calloc(LATBUCKETS, sizeof(uint64_t))) == NULL) {
+    fprintf(stderr, "Error: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  if ((epfd = epoll_create1(0)) < 0) {
+    perror("epoll_create1()");
+    exit(EXIT_FAILURE);
+  }
+
+  start = nowUs();
+  connectAll(argv[optind], atoi(argv[optind + 1]), want, prefix);
+  now = nowUs();
+  printf("connections: %d up, %lu rejected, %.0f connects/s\n", numConns, (unsigned long)rejected,
+         numConns / ((now - start) / 1e6));
+  if (numConns == 0)
+    exit(EXIT_FAILURE);
+  //let the join and roster traffic settle before timing anything
+  drain(500);
+
+  start = lastReport = nowUs();
+  end = start + (uint64_t)duration * 1000000;
+  while ((now = nowUs()) < end && liveConns > 0) {
+    uint64_t due = (now - start) * rate / 1000000;
+    while (sent + deferred < due && liveConns > 0) {
+      conn *c = &conns[rr++ % numConns];
+      if (c->sd < 0)
+        continue;
+      if (c->outLen > 0)
+        deferred++;
+      else
+        sendOne(c);
+    }
+    drain(1);
+    if (now - lastReport >= 1000000) {
+      printf("%3lus  sent %lu/s  delivered %lu/s\n", (unsigned long)((now - start) / 1000000),
+             (unsigned long)(sent - sentMark), (unsigned long)(delivered - deliveredMark));
+      sentMark = sent;
+      deliveredMark = delivered;
+      lastReport = now;
+    }
+  }
+  sendSecs = (nowUs() - start) / 1e6;
+  //everything sent by now should arrive within the drain time
+  end = nowUs() + (uint64_t)drainTime * 1000000;
+  while (nowUs() < end && delivered < expected)
+    drain(10);
+  report(sendSecs, (nowUs() - start) / 1e6);
+  return 0;
+}
+
+/*
+ * Function: connectAll
+ * -------------------
+ * opens the connections and logs each one in, reading what earlier
+ * connections are sent along the way so the server never backs up
+ *
+ * *host:    address of the server
+ * port:     port of the server
+ * want:     connections to open
+ * *prefix:  start of every username
+ *
+ * returns connections that finished the handshake
+ */
+int connectAll(char *host, int port, int want, char *prefix) {
+  struct epoll_event ev;
+  char name[NAMELENGTH + 1];
+  char valid;
+  for (int i = 0; i < want; i++) {
+    int sd = openSocket(host, port);
+    valid = 0;
+    if (recv(sd, &valid, sizeof(valid), MSG_WAITALL) != sizeof(valid) || valid != 'Y') {
+      rejected++;
+      close(sd);
+      continue;
+    }
+    snprintf(name, sizeof(name), "%s%d", prefix, i);
+    if (sendName(sd, name, strlen(name)) != 'Y') {
+      rejected++;
+      close(sd);
+      continue;
+    }
+    fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK);
+    //Nagle would hold small messages back and skew the latency
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+    conn *c = &conns[numConns];
+    c->sd = sd;
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sd, &ev) < 0) {
+      perror("epoll_ctl()");
+      exit(EXIT_FAILURE);
+    }
+    numConns++;
+    liveConns++;
+    drain(0);
+  }
+  return numConns;
+}
+
+/*
+ * Function: drain
+ * -------------------
+ * handles whatever the sockets are ready for
+ *
+ * waitms:  how long epoll_wait may block
+ */
+void drain(int waitms) {
+  struct epoll_event evs[MAXEVENTS];
+  int n = epoll_wait(epfd, evs, MAXEVENTS, waitms);
+  for (int i = 0; i < n; i++) {
+    conn *c = evs[i].data.ptr;
+    if (c->sd >= 0 && (evs[i].events & EPOLLOUT))
+      flushOut(c);
+    if (c->sd >= 0 && (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+      readConn(c);
+  }
+}
+
+/*
+ * Function: readConn
+ * -------------------
+ * reads from a connection and hands every complete frame to takeFrame,
+ * frames too big for the buffer are skipped
+ *
+ * *c:  connection that is readable
+ */
+void readConn(conn *c) {
+  int n = recv(c->sd, c->inbuf + c->inLen, INBUF - c->inLen, 0);
+  uint32_t pos = 0;
+  if (n < 0 && (errno == EAGAIN || errno == EINTR))
+    return;
+  if (n <= 0) {
+    dropConn(c);
+    return;
+  }
+  c->inLen += n;
+  while (pos < c->inLen) {
+    uint16_t len;
+    if (c->skip > 0) {
+      uint32_t k = c->inLen - pos < c->skip ? c->inLen - pos : c->skip;
+      c->skip -= k;
+      pos += k;
+      continue;
+    }
+    if (c->inLen - pos < sizeof(uint16_t))
+      break;
+    memcpy(&len, c->inbuf + pos, sizeof(uint16_t));
+    len = ntohs(len);
+    if (len + sizeof(uint16_t) > INBUF) {
+      //roster snapshots can outgrow the buffer, they carry no samples
+      c->skip = len;
+      pos += sizeof(uint16_t);
+      continue;
+    }
+    if (c->inLen - pos < sizeof(uint16_t) + len)
+      break;
+    takeFrame(c->inbuf + pos + sizeof(uint16_t), len);
+    pos += sizeof(uint16_t) + len;
+  }
+  c->inLen -= pos;
+  memmove(c->inbuf, c->inbuf + pos, c->inLen);
+}
+
+/*
+ * Function: takeFrame
+ * -------------------
+ * records the latency of a generated message and checks that the
+ * frame length matches the size written into the body
+ *
+ * *frame:  frame body, not terminated
+ * len:     length of the body
+ */
+void takeFrame(char *frame, uint16_t len) {
+  char *mark;
+  unsigned long size;
+  uint64_t stamp, lat;
+  char *end;
+  if (len == 0) {
+    misframed++;
+    return;
+  }
+  //only broadcasts carry the marker, the body follows "name: "
+  if (frame[0] != '>' || (mark = memchr(frame, ':', len)) == NULL)
+    return;
+  mark += 2;
+  if (frame + len - mark < (long)strlen(MARKER) || memcmp(mark, MARKER, strlen(MARKER)) != 0)
+    return;
+  //the body is terminated by the frame length, never by a zero byte
+  char tmp[48];
+  size_t tlen = frame + len - mark < (long)sizeof(tmp) - 1 ? frame + len - mark : sizeof(tmp) - 1;
+  memcpy(tmp, mark, tlen);
+  tmp[tlen] = 0;
+  size = strtoul(tmp + strlen(MARKER), &end, 10);
+  stamp = strtoull(end, NULL, 10);
+  if (size != (unsigned long)(frame + len - mark)) {
+    misframed++;
+    return;
+  }
+  delivered++;
+  lat = nowUs() - stamp;
+  if (lat > latMax)
+    latMax = lat;
+  lat /= LATBUCKET;
+  latency[lat < LATBUCKETS ? lat : LATBUCKETS - 1]++;
+}
+
+/*
+ * Function: sendOne
+ * -------------------
+ * sends one generated message, keeping whatever the socket
+ * would not take for flushOut
+ *
+ * *c:  connection to send on
+ */
+void sendOne(conn *c) {
+  char body[MSGLENGTH];
+  int size = sizes[sent % numSizes];
+  int n = snprintf(body, sizeof(body), "%s%d %lu ", MARKER, size, (unsigned long)nowUs());
+  memset(body + n, 'x', size - n);
+  n = sendFrame(c->sd, body, size, MSG_DONTWAIT);
+  if (n < 0 && errno != EAGAIN) {
+    dropConn(c);
+    return;
+  }
+  if (n < 0) {
+    deferred++;
+    return;
+  }
+  sent++;
+  expected += liveConns;
+  if (n < size + (int)sizeof(uint16_t)) {
+    uint16_t netLen = htons(size);
+    struct epoll_event ev;
+    memcpy(c->out, &netLen, sizeof(uint16_t));
+    memcpy(c->out + sizeof(uint16_t), body, size);
+    c->outLen = size + sizeof(uint16_t);
+    c->outSent = n;
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = c;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->sd, &ev);
+  }
+}
+
+/*
+ * Function: flushOut
+ * -------------------
+ * writes the rest of a partly sent frame
+ *
+ * *c:  connection that is writable
+ */
+void flushOut(conn *c) {
+  struct epoll_event ev;
+  int n;
+  if (c->outLen == 0)
+    return;
+  n = send(c->sd, c->out + c->outSent, c->outLen - c->outSent, MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (n < 0 && errno != EAGAIN) {
+    dropConn(c);
+    return;
+  }
+  if (n > 0)
+    c->outSent += n;
+  if (c->outSent < c->outLen)
+    return;
+  c->outLen = c->outSent = 0;
+  ev.events = EPOLLIN;
+  ev.data.ptr = c;
+  epoll_ctl(epfd, EPOLL_CTL_MOD, c->sd, &ev);
+}
+
+/*
+ * Function: dropConn
+ * -------------------
+ * closes a connection the server hung up on
+ *
+ * *c:  connection to close
+ */
+void dropConn(conn *c) {
+  epoll_ctl(epfd, EPOLL_CTL_DEL, c->sd, NULL);
+  close(c->sd);
+  c->sd = -1;
+  liveConns--;
+}
+
+/*
+ * Function: percentile
+ * -------------------
+ * reads a percentile off the latency histogram
+ *
+ * p:  fraction of samples at or below the answer
+ *
+ * returns latency in microseconds
+ */
+uint64_t percentile(double p) {
+  uint64_t total = 0, seen = 0;
+  for (int i = 0; i < LATBUCKETS; i++)
+    total += latency[i];
+  for (int i = 0; i < LATBUCKETS; i++) {
+    seen += latency[i];
+    if (seen > 0 && seen >= p * total)
+      return (uint64_t)(i + 1) * LATBUCKET;
+  }
+  return 0;
+}
+
+/*
+ * Function: report
+ * -------------------
+ * prints the results, the RESULT line is meant for comparing runs
+ *
+ * sendSecs:  how long messages were sent for
+ * secs:      length of the timed run including the drain
+ */
+void report(double sendSecs, double secs) {
+  uint64_t dropped = expected > delivered ? expected - delivered : 0;
+  printf("sent:        %lu msgs, %.0f msgs/s, %lu deferred\n", (unsigned long)sent, sent / sendSecs, (unsigned long)deferred);
+  printf("delivered:   %lu msgs, %.0f msgs/s\n", (unsigned long)delivered, delivered / secs);
+  printf("latency us:  p50 %lu  p99 %lu  p999 %lu  max %lu\n", (unsigned long)percentile(0.50),
+         (unsigned long)percentile(0.99), (unsigned long)percentile(0.999), (unsigned long)latMax);
+  printf("dropped:     %lu, misframed %lu, disconnected %d\n", (unsigned long)dropped, (unsigned long)misframed, numConns - liveConns);
+  printf("RESULT conns=%d sent_per_s=%.0f delivered_per_s=%.0f p50_us=%lu p99_us=%lu p999_us=%lu dropped=%lu misframed=%lu\n",
+         numConns, sent / sendSecs, delivered / secs, (unsigned long)percentile(0.50), (unsigned long)percentile(0.99),
+         (unsigned long)percentile(0.999), (unsigned long)dropped, (unsigned long)misframed);
+}
@@ -0,0 +1,457 @@
+/* log.c - leveled logging through per-thread rings and a writer thread */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "../inc/log.h"
+
+//what one conversion in a format string needs
+typedef struct logSpec {
+  uint8_t starWidth;       //width comes from an int argument
+  uint8_t starPrec;        //precision comes from an int argument
+  uint8_t size;            //0 int, 1 long, 2 long long, 3 size_t
+  char conv;               //conversion character, 0 for %%
+}logSpec;
+
+//start of every record, the encoded arguments follow
+typedef struct logRec {
+  uint32_t size;           //bytes in the record including this header
+  uint32_t level;          //LOG_*
+  const char *fmt;         //format string, always a literal
+  struct timespec when;    //wall clock time of the call
+}logRec;
+
+//single producer, single consumer byte ring owned by one thread
+typedef struct logRing {
+  char *buf;               //LOGRING bytes
+  uint64_t head;           //bytes ever written, only the owner moves it
+  uint64_t tail;           //bytes ever consumed, only the writer thread moves it
+  uint64_t dropped;        //records lost because the ring was full
+}logRing;
+
+int logLevel = LOG_INFO;
+
+static logRing *rings[LOGRINGS];  //every thread that has logged
+static int numRings = 0;          //slots of rings handed out
+static _Thread_local logRing *myRing = NULL;
+static int wakeFd = -1;           //eventfd the writer blocks on while every ring is empty
+static int writerAsleep = 0;      //the writer is blocked, or about to be, on wakeFd
+
+static const char* parseSpec(const char*, logSpec*);
+static logRing* ringJoin();
+static void copyIn(logRing*, uint64_t, const void*, uint32_t);
+static void copyOut(logRing*, uint64_t, void*, uint32_t);
+static int ringsEmpty();
+static void* logMain(void*);
+static void logFormat(FILE*, char*, uint32_t);
+
+/*
+ * Function: logParseLevel
+ * -------------------
+ * turn a level name from the command line into a level
+ *
+ * *name:  error, warn, info or debug
+ *
+ * returns the level, -1 if the name is unknown
+ */
+int logParseLevel(const char *name) {
+  static const char *names[] = {"error", "warn", "info", "debug"};
+  for (int i = 0; i <= LOG_DEBUG; i++)
+    if (strcmp(name, names[i]) == 0)
+      return i;
+  return -1;
+}
+
+/*
+ * Function: logStart
+ * -------------------
+ * start the thread that formats and writes records
+ */
+void logStart() {
+  pthread_t thread;
+  if ((wakeFd = eventfd(0, EFD_CLOEXEC)) < 0) {
+    perror("eventfd()");
+    exit(EXIT_FAILURE);
+  }
+  if (pthread_create(&thread, NULL, logMain, NULL) != 0) {
+    perror("pthread_create()");
+    exit(EXIT_FAILURE);
+  }
+  pthread_detach(thread);
+}
+
+/*
+ * Function: logWrite
+ * -------------------
+ * copy a format and its arguments into the calling thread's ring,
+ * never blocks, a record that does not fit is counted and dropped
+ *
+ * level:  LOG_* of the record
+ * *fmt:   printf format, must outlive the program (a literal)
+ */
+void logWrite(int level, const char *fmt, ...) {
+  char rec[LOGMAXREC];
+  logRec *hdr = (logRec*)rec;
+  char *out = rec + sizeof(logRec);
+  char *end = rec + sizeof(rec);
+  logRing *r = myRing != NULL ? myRing : ringJoin();
+  logSpec s;
+  va_list ap;
+  if (r == NULL)
+    return;
+  hdr->level = level;
+  hdr->fmt = fmt;
+  clock_gettime(CLOCK_REALTIME, &hdr->when);
+  va_start(ap, fmt);
+  //every argument is widened to 8 bytes, strings are copied
+  for (const char *p = fmt; (p = strchr(p, '%')) != NULL; ) {
+    p = parseSpec(p, &s);
+    if (s.conv == 0)
+      continue;
+    if (end - out < 8 * (s.starWidth + s.starPrec) + 8)
+      break;
+    if (s.starWidth) {
+      int64_t v = va_arg(ap, int);
+      memcpy(out, &v, 8);
+      out += 8;
+    }
+    if (s.starPrec) {
+      int64_t v = va_arg(ap, int);
+      memcpy(out, &v, 8);
+      out += 8;
+    }
+    if (s.conv == 's') {
+      const char *str = va_arg(ap, const char*);
+      size_t n;
+      if (str == NULL)
+        str = "(null)";
+      n = strnlen(str, LOGMAXSTR);
+      if (n > (size_t)(end - out) - 1)
+        n = end - out - 1;
+      memcpy(out, str, n);
+      out[n] = 0;
+      out += n + 1;
+    } else if (strchr("feEgGaAF", s.conv) != NULL) {
+      double v = va_arg(ap, double);
+      memcpy(out, &v, 8);
+      out += 8;
+    } else if (s.conv == 'p') {
+      uint64_t v = (uintptr_t)va_arg(ap, void*);
+      memcpy(out, &v, 8);
+      out += 8;
+    } else {
+      int64_t v = s.size == 1 ? va_arg(ap, long) :
+                  s.size == 2 ? va_arg(ap, long long) :
+                  s.size == 3 ? (int64_t)va_arg(ap, size_t) : va_arg(ap, int);
+      memcpy(out, &v, 8);
+      out += 8;
+    }
+  }
+  va_end(ap);
+  hdr->size = (out - rec + 7) & ~7;
+  uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+  if (LOGRING - (r->head - tail) < hdr->size) {
+    __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+    return;
+  }
+  copyIn(r, r->head, rec, hdr->size);
+  __atomic_store_n(&r->head, r->head + hdr->size, __ATOMIC_RELEASE);
+  //pairs with the fence in logMain, either it sees the record or we see it asleep
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&writerAsleep, __ATOMIC_RELAXED) && __atomic_exchange_n(&writerAsleep, 0, __ATOMIC_ACQ_REL))
+    eventfd_write(wakeFd, 1);
+}
+
+/*
+ * Function: logDropped
+ * -------------------
+ * returns records dropped so far across all threads
+ */
+uint64_t logDropped() {
+  uint64_t total = 0;
+  int n = __atomic_load_n(&numRings, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < n && i < LOGRINGS; i++) {
+    logRing *r = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+    if (r != NULL)
+      total += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+  }
+  return total;
+}
+
+/*
+ * Function: logFlush
+ * -------------------
+ * wait, up to LOGFLUSHMS, until the writer has printed every record
+ * and is going back to sleep, for a process about to exit
+ */
+void logFlush() {
+  //it only sleeps after a pass that found nothing, which follows its fflush
+  for (int i = 0; i < LOGFLUSHMS; i++) {
+    if (ringsEmpty() && __atomic_load_n(&writerAsleep, __ATOMIC_ACQUIRE))
+      return;
+    usleep(1000);
+  }
+}
+
+/*
+ * Function: parseSpec
+ * -------------------
+ * read one conversion of a format string
+ *
+ * *p:  the '%' that starts it
+ * *s:  filled in with what the conversion takes
+ *
+ * returns the character after the conversion
+ */
+static const char* parseSpec(const char *p, logSpec *s) {
+  memset(s, 0, sizeof(*s));
+  p++;
+  if (*p == '%')
+    return p + 1;
+  while (*p != 0 && strchr("-+ #0", *p) != NULL)
+    p++;
+  if (*p == '*') {
+    s->starWidth = 1;
+    p++;
+  }
+  while (isdigit((unsigned char)*p))
+    p++;
+  if (*p == '.') {
+    p++;
+    if (*p == '*') {
+      s->starPrec = 1;
+      p++;
+    }
+    while (isdigit((unsigned char)*p))
+      p++;
+  }
+  if (*p == 'h') {
+    while (*p == 'h')
+      p++;
+  } else if (*p == 'l') {
+    s->size = p[1] == 'l' ? 2 : 1;
+    p += s->size;
+  } else if (*p == 'z') {
+    s->size = 3;
+    p++;
+  }
+  if (*p == 0)
+    return p;
+  s->conv = *p;
+  return p + 1;
+}
+
+/*
+ * Function: ringJoin
+ * -------------------
+ * give the calling thread its ring the first time it logs
+ *
+ * returns the ring, NULL if every slot is taken
+ */
+static logRing* ringJoin() {
+  int idx = __atomic_fetch_add(&numRings, 1, __ATOMIC_ACQ_REL);
+  logRing *r;
+  if (idx >= LOGRINGS)
+    return NULL;
+  r = calloc(1, sizeof(logRing));
+  if (r == NULL || (r->buf = malloc(LOGRING)) == NULL) {
+    free(r);
+    return NULL;
+  }
+  __atomic_store_n(&rings[idx], r, __ATOMIC_RELEASE);
+  myRing = r;
+  return r;
+}
+
+/*
+ * Function: copyIn
+ * -------------------
+ * copy bytes into a ring at a position, wrapping at the end
+ *
+ * *r:    ring to copy into
+ * pos:   byte position, taken modulo LOGRING
+ * *src:  bytes to copy
+ * len:   number of bytes
+ */
+static void copyIn(logRing *r, uint64_t pos, const void *src, uint32_t len) {
+  uint32_t off = pos & (LOGRING - 1);
+  uint32_t first = len < LOGRING - off ? len : LOGRING - off;
+  memcpy(r->buf + off, src, first);
+  memcpy(r->buf, (const char*)src + first, len - first);
+}
+
+/*
+ * Function: copyOut
+ * -------------------
+ * copy bytes out of a ring at a position, wrapping at the end
+ *
+ * *r:    ring to copy from
+ * pos:   byte position, taken modulo LOGRING
+ * *dst:  where to copy to
+ * len:   number of bytes
+ */
+static void copyOut(logRing *r, uint64_t pos, void *dst, uint32_t len) {
+  uint32_t off = pos & (LOGRING - 1);
+  uint32_t first = len < LOGRING - off ? len : LOGRING - off;
+  memcpy(dst, r->buf + off, first);
+  memcpy((char*)dst + first, r->buf, len - first);
+}
+
+/*
+ * Function: ringsEmpty
+ * -------------------
+ * returns 1 if no ring holds a record the writer has not taken
+ */
+static int ringsEmpty() {
+  int n = __atomic_load_n(&numRings, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < n && i < LOGRINGS; i++) {
+    logRing *r = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+    if (r != NULL && __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != r->tail)
+      return 0;
+  }
+  return 1;
+}
+
+/*
+ * Function: logMain
+ * -------------------
+ * writer thread, drains every ring to stdout and blocks on
+ * wakeFd while they are all empty, the next record wakes it
+ *
+ * arg:  unused
+ */
+static void* logMain(void *arg) {
+  char rec[LOGMAXREC];
+  uint64_t reported = 0;
+  eventfd_t wakes;
+  while (1) {
+    int busy = 0;
+    int n = __atomic_load_n(&numRings, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n && i < LOGRINGS; i++) {
+      logRing *r = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+      if (r == NULL)
+        continue;
+      uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+      while (r->tail < head) {
+        uint32_t size;
+        copyOut(r, r->tail, &size, sizeof(size));
+        copyOut(r, r->tail, rec, size);
+        logFormat(stdout, rec, size);
+        __atomic_store_n(&r->tail, r->tail + size, __ATOMIC_RELEASE);
+        busy = 1;
+      }
+    }
+    uint64_t dropped = logDropped();
+    if (dropped != reported) {
+      fprintf(stdout, "W logger dropped %lu records\n", (unsigned long)(dropped - reported));
+      reported = dropped;
+      busy = 1;
+    }
+    if (busy) {
+      fflush(stdout);
+      continue;
+    }
+    //say we sleep before the last look, a record written after it wakes us
+    __atomic_store_n(&writerAsleep, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (ringsEmpty())
+      eventfd_read(wakeFd, &wakes);
+    __atomic_store_n(&writerAsleep, 0, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+/*
+ * Function: logFormat
+ * -------------------
+ * print one record, one conversion of its format at a time
+ *
+ * *out:  stream to write to
+ * *rec:  the record
+ * size:  bytes in the record
+ */
+static void logFormat(FILE *out, char *rec, uint32_t size) {
+  logRec *hdr = (logRec*)rec;
+  char *in = rec + sizeof(logRec);
+  char *end = rec + size;
+  const char *p = hdr->fmt;
+  char spec[32];
+  char stamp[16];
+  struct tm tm;
+  logSpec s;
+  int last = '\n';
+  localtime_r(&hdr->when.tv_sec, &tm);
+  strftime(stamp, sizeof(stamp), "%H:%M:%S", &tm);
+  fprintf(out, "%s.%03ld %c ", stamp, hdr->when.tv_nsec / 1000000, "EWID"[hdr->level & 3]);
+  while (*p != 0) {
+    const char *pct = strchr(p, '%');
+    const char *next;
+    int64_t v;
+    int n;
+    if (pct == NULL) {
+      fputs(p, out);
+      last = p[strlen(p) - 1];
+      break;
+    }
+    fwrite(p, 1, pct - p, out);
+    next = parseSpec(pct, &s);
+    if (s.conv == 0) {
+      fwrite(pct, 1, next - pct - 1, out);
+      p = next;
+      continue;
+    }
+    //a record cut short prints the rest of the format as is
+    if (end - in < 8 * (s.starWidth + s.starPrec) + (s.conv == 's' ? 1 : 8)) {
+      fputs(pct, out);
+      last = pct[strlen(pct) - 1];
+      break;
+    }
+    //put star arguments into the spec so every conversion takes one value
+    n = 0;
+    for (const char *q = pct; q < next && n < (int)sizeof(spec) - 12; q++) {
+      if (*q == '*') {
+        memcpy(&v, in, 8);
+        in += 8;
+        n += snprintf(spec + n, sizeof(spec) - n, "%d", (int)v);
+      } else {
+        spec[n++] = *q;
+      }
+    }
+    spec[n] = 0;
+    if (s.conv == 's') {
+      fprintf(out, spec, in);
+      in += strlen(in) + 1;
+      last = 0;
+      p = next;
+      continue;
+    }
+    memcpy(&v, in, 8);
+    in += 8;
+    if (strchr("feEgGaAF", s.conv) != NULL) {
+      double d;
+      memcpy(&d, &v, 8);
+      fprintf(out, spec, d);
+    } else if (s.conv == 'p') {
+      fprintf(out, spec, (void*)(uintptr_t)v);
+    } else if (s.size == 1) {
+      fprintf(out, spec, (long)v);
+    } else if (s.size == 2) {
+      fprintf(out, spec, (long long)v);
+    } else if (s.size == 3) {
+      fprintf(out, spec, (size_t)v);
+    } else {
+      fprintf(out, spec, (int)v);
+    }
+    last = 0;
+    p = next;
+  }
+  if (last != '\n')
+    fputc('\n', out);
+}
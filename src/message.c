@@ -0,0 +1,174 @@
+/* message.c - shared, reference counted outbound frames */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#include "../inc/server.h"
+
+/*
+ * Function: allocMessage
+ * -------------------
+ * allocate a frame with room for a body of up to bodyLen bytes
+ * the caller writes the body at data + FRAMEHDR and then seals it
+ *
+ * bodyLen:  largest body the frame will hold
+ *
+ * returns the frame with one reference held by the caller
+ */
+msgbuf* allocMessage(uint16_t bodyLen) {
+  msgbuf *m = sizedGet(sizeof(msgbuf) + FRAMEHDR + bodyLen + 1);
+  if (m == NULL)
+    return NULL;
+  m->refs = 1;
+  m->len = FRAMEHDR;
+  m->typed = 0;
+  m->v1only = 0;
+  m->alt = NULL;
+  return m;
+}
+
+/*
+ * Function: sealMessage
+ * -------------------
+ * write the length prefix once the body is in place
+ *
+ * *m:       frame to finish
+ * bodyLen:  actual length of the body
+ */
+void sealMessage(msgbuf *m, uint16_t bodyLen) {
+  uint16_t netlen = htons(bodyLen);
+  memcpy(m->data, &netlen, FRAMEHDR);
+  m->len = FRAMEHDR + bodyLen;
+}
+
+/*
+ * Function: newMessage
+ * -------------------
+ * format a chat message straight into a sealed frame
+ *
+ * fmt:  printf style format for the body
+ *
+ * returns the frame with one reference held by the caller
+ */
+msgbuf* newMessage(const char *fmt, ...) {
+  va_list ap;
+  int len;
+  msgbuf *m;
+  //measure first so the frame comes from the smallest size class
+  va_start(ap, fmt);
+  len = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+  if (len < 0)
+    len = 0;
+  if (len > MSGLENGTH + 19)
+    len = MSGLENGTH + 19;
+  if ((m = allocMessage(len)) == NULL)
+    return NULL;
+  va_start(ap, fmt);
+  vsnprintf(m->data + FRAMEHDR, len + 1, fmt, ap);
+  va_end(ap);
+  sealMessage(m, len);
+  return m;
+}
+
+/*
+ * Function: rawMessage
+ * -------------------
+ * wrap bytes that go on the wire without a length prefix
+ * (the single byte handshake replies)
+ *
+ * data:  bytes to send
+ * len:   number of bytes
+ *
+ * returns the frame with one reference held by the caller
+ */
+msgbuf* rawMessage(const char *data, uint16_t len) {
+  msgbuf *m = allocMessage(len);
+  if (m == NULL)
+    return NULL;
+  memcpy(m->data, data, len);
+  m->len = len;
+  return m;
+}
+
+/*
+ * Function: typedMessage
+ * -------------------
+ * build a v2 message, it has no length prefix of its own:
+ * the container it is sent in says how long the run is
+ *
+ * op:       OP_*
+ * sender:   id of the user it is from, 0 for the server
+ * name:     user it is from or about, may be empty
+ * body:     the body
+ * bodyLen:  length of the body
+ *
+ * returns the message with one reference held by the caller
+ */
+msgbuf* typedMessage(uint8_t op, uint32_t sender, const char *name, const char *body, uint16_t bodyLen) {
+  typedHdr h;
+  uint8_t nameLen = strlen(name);
+  uint32_t len = sizeof(typedHdr) + nameLen + bodyLen;
+  if (len > UINT16_MAX)
+    return NULL;
+  msgbuf *m = allocMessage(len);
+  if (m == NULL)
+    return NULL;
+  h.op = op;
+  h.nameLen = nameLen;
+  h.bodyLen = htons(bodyLen);
+  h.sender = htonl(sender);
+  h.seq = 0;
+  memcpy(m->data, &h, sizeof(typedHdr));
+  memcpy(m->data + sizeof(typedHdr), name, nameLen);
+  memcpy(m->data + sizeof(typedHdr) + nameLen, body, bodyLen);
+  m->len = len;
+  m->typed = 1;
+  return m;
+}
+
+/*
+ * Function: stampMessage
+ * -------------------
+ * write the sequence number into a v2 message before it is shared
+ *
+ * *m:   v2 message, may be NULL
+ * seq:  its room message number
+ */
+void stampMessage(msgbuf *m, uint64_t seq) {
+  uint64_t netSeq = htobe64(seq);
+  if (m != NULL && m->typed)
+    memcpy(m->data + offsetof(typedHdr, seq), &netSeq, sizeof(netSeq));
+}
+
+/*
+ * Function: holdMessage
+ * -------------------
+ * take another reference to a frame
+ *
+ * *m:  frame to hold
+ *
+ * returns m
+ */
+msgbuf* holdMessage(msgbuf *m) {
+  __atomic_add_fetch(&m->refs, 1, __ATOMIC_RELAXED);
+  return m;
+}
+
+/*
+ * Function: releaseMessage
+ * -------------------
+ * drop a reference, freeing the frame (and its v2 form) when it was
+ * the last one, references are atomic since frames cross shards
+ *
+ * *m:  frame to release
+ */
+void releaseMessage(msgbuf *m) {
+  if (m != NULL && __atomic_sub_fetch(&m->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    releaseMessage(m->alt);
+    poolPut(m);
+  }
+}
@@ -0,0 +1,407 @@
+/* names.c - hash indexed directory of joined usernames
+ *
+ * the directory is shared by every shard. changes take a mutex and
+ * bump a sequence count around what they write, lookups take no lock:
+ * they read and retry if the count moved, so the shards routing
+ * private messages never wait on each other.
+ * with federation it also holds the users of the peer servers,
+ * marked with the link they live behind
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "../inc/server.h"
+
+static nameEntry *table = NULL;  //open addressed slots, linear probing
+static uint32_t tableSize = 0;   //number of slots, always a power of two
+static uint32_t tableUsed = 0;   //occupied slots
+static uint32_t tableSeq = 0;    //odd while a change is being written
+static nameEntry *retired[32];   //tables outgrown, a lookup may still be reading one
+static int numRetired = 0;       //entries in retired
+static pthread_mutex_t tableLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Function: writeBegin
+ * -------------------
+ * lock the directory and mark it as changing
+ */
+static void writeBegin() {
+  pthread_mutex_lock(&tableLock);
+  __atomic_store_n(&tableSeq, tableSeq + 1, __ATOMIC_RELAXED);
+  //the count goes odd before any slot changes
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/*
+ * Function: writeEnd
+ * -------------------
+ * mark the change as done and unlock the directory
+ */
+static void writeEnd() {
+  __atomic_store_n(&tableSeq, tableSeq + 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&tableLock);
+}
+
+/*
+ * Function: nameHash
+ * -------------------
+ * FNV-1a hash of a username
+ *
+ * name:  username to hash
+ *
+ * returns the hash
+ */
+static uint32_t nameHash(const char *name) {
+  uint32_t h = 2166136261u;
+  while (*name) {
+    h ^= (uint8_t)*name++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/*
+ * Function: nameSlot
+ * -------------------
+ * find the slot holding a name, or the empty slot that ends its probe
+ *
+ * name:  username to look for
+ *
+ * returns index into table
+ */
+static uint32_t nameSlot(const char *name) {
+  uint32_t mask = tableSize - 1;
+  uint32_t i = nameHash(name) & mask;
+  while (table[i].name[0] != 0 && strcmp(table[i].name, name) != 0)
+    i = (i + 1) & mask;
+  return i;
+}
+
+/*
+ * Function: nameGrow
+ * -------------------
+ * double the table (or create it) and rehash every entry
+ *
+ * returns 0 on success, -1 if out of memory
+ */
+static int nameGrow() {
+  nameEntry *old = table;
+  uint32_t oldSize = tableSize;
+  uint32_t size = oldSize ? oldSize * 2 : NAMETABLE;
+  nameEntry *fresh = calloc(size, sizeof(nameEntry));
+  if (fresh == NULL)
+    return -1;
+  for (uint32_t i = 0; i < oldSize; i++) {
+    if (old[i].name[0] != 0) {
+      uint32_t j = nameHash(old[i].name) & (size - 1);
+      while (fresh[j].name[0] != 0)
+        j = (j + 1) & (size - 1);
+      fresh[j] = old[i];
+    }
+  }
+  //a lookup that sees the new size sees the new table
+  __atomic_store_n(&table, fresh, __ATOMIC_RELEASE);
+  __atomic_store_n(&tableSize, size, __ATOMIC_RELEASE);
+  //the old one is kept for lookups still in it, together they take
+  //less room than the table in use
+  if (old != NULL)
+    retired[numRetired++] = old;
+  return 0;
+}
+
+/*
+ * Function: nameRead
+ * -------------------
+ * copy a username's entry without taking the lock, reading again
+ * if a change was written meanwhile
+ *
+ * name:  username to look for
+ * *out:  set to the entry when found
+ *
+ * returns 1 if found, 0 if nobody has the name
+ */
+static int nameRead(const char *name, nameEntry *out) {
+  uint32_t seq;
+  int found;
+  do {
+    seq = __atomic_load_n(&tableSeq, __ATOMIC_ACQUIRE);
+    //a change is being written, wait for it on the lock it holds
+    if (seq & 1) {
+      pthread_mutex_lock(&tableLock);
+      pthread_mutex_unlock(&tableLock);
+      continue;
+    }
+    uint32_t size = __atomic_load_n(&tableSize, __ATOMIC_ACQUIRE);
+    nameEntry *t = __atomic_load_n(&table, __ATOMIC_ACQUIRE);
+    found = 0;
+    //slots can change under us, the probe is bounded, names stay terminated
+    for (uint32_t n = 0, i = size ? nameHash(name) & (size - 1) : 0; n < size && t[i].name[0] != 0;
+         n++, i = (i + 1) & (size - 1)) {
+      if (strcmp(t[i].name, name) == 0) {
+        *out = t[i];
+        found = 1;
+        break;
+      }
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while ((seq & 1) || __atomic_load_n(&tableSeq, __ATOMIC_RELAXED) != seq);
+  return found;
+}
+
+/*
+ * Function: nameFind
+ * -------------------
+ * look up the client that holds a username, without locking
+ *
+ * name:    username to look for
+ * *shard:  set to the owner's shard when found, may be NULL
+ *
+ * returns the client, NULL if nobody has the name
+ * the client may only be touched by the shard it lives on
+ */
+struct client* nameFind(const char *name, int *shard) {
+  nameEntry e;
+  if (!nameRead(name, &e) || e.owner == NULL)
+    return NULL;
+  if (shard != NULL)
+    *shard = e.shard;
+  return e.owner;
+}
+
+/*
+ * Function: nameInsert
+ * -------------------
+ * claim a username for a client
+ * the table is kept at most half full so probes stay short
+ *
+ * name:    username, at most NAMELENGTH characters
+ * *owner:  client taking the name
+ * shard:   shard the client lives on
+ *
+ * returns 0 on success, -1 if the name is taken or out of memory
+ */
+int nameInsert(const char *name, struct client *owner, int shard) {
+  int ret = -1;
+  writeBegin();
+  if ((tableUsed + 1) * 2 <= tableSize || nameGrow() == 0) {
+    uint32_t i = nameSlot(name);
+    if (table[i].name[0] == 0) {
+      strncpy(table[i].name, name, NAMELENGTH);
+      table[i].name[NAMELENGTH] = 0;
+      table[i].owner = owner;
+      table[i].shard = shard;
+      table[i].node = 0;
+      tableUsed++;
+      ret = 0;
+    }
+  }
+  writeEnd();
+  return ret;
+}
+
+/*
+ * Function: nameHold
+ * -------------------
+ * keep a username claimed while its owner has no connection,
+ * nameFind reports nobody until nameClaim hands it out again
+ *
+ * name:  username to hold
+ */
+void nameHold(const char *name) {
+  writeBegin();
+  if (tableUsed > 0) {
+    nameEntry *e = &table[nameSlot(name)];
+    if (e->name[0] != 0)
+      e->owner = NULL;
+  }
+  writeEnd();
+}
+
+/*
+ * Function: nameClaim
+ * -------------------
+ * give a held username to the client resuming its session
+ *
+ * name:    username, held by nameHold
+ * *owner:  client taking the name
+ * shard:   shard the client lives on
+ *
+ * returns 0 on success, -1 if the name is not held
+ */
+int nameClaim(const char *name, struct client *owner, int shard) {
+  int ret = -1;
+  writeBegin();
+  if (tableUsed > 0) {
+    nameEntry *e = &table[nameSlot(name)];
+    if (e->name[0] != 0 && e->owner == NULL && e->node == 0) {
+      e->owner = owner;
+      e->shard = shard;
+      ret = 0;
+    }
+  }
+  writeEnd();
+  return ret;
+}
+
+/*
+ * Function: nameRemove
+ * -------------------
+ * release a username of this server
+ *
+ * name:  username to release
+ */
+void nameRemove(const char *name) {
+  nameRemoveNode(name, 0);
+}
+
+/*
+ * Function: nameRemoveNode
+ * -------------------
+ * release a username if the node it lives on is the one that says so,
+ * a name another node took over in the meantime is left be
+ * later entries of the probe run are shifted back so no tombstones
+ * are needed
+ *
+ * name:  username to release
+ * node:  peer link it lives behind, 0 for this server
+ *
+ * returns 0 if it was released, -1 if it was not there
+ */
+int nameRemoveNode(const char *name, int node) {
+  writeBegin();
+  if (tableUsed == 0) {
+    writeEnd();
+    return -1;
+  }
+  uint32_t mask = tableSize - 1;
+  uint32_t hole = nameSlot(name);
+  if (table[hole].name[0] == 0 || table[hole].node != node) {
+    writeEnd();
+    return -1;
+  }
+  tableUsed--;
+  for (uint32_t i = (hole + 1) & mask; table[i].name[0] != 0; i = (i + 1) & mask) {
+    uint32_t home = nameHash(table[i].name) & mask;
+    //move the entry back if the hole sits between its home and its slot
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      table[hole] = table[i];
+      hole = i;
+    }
+  }
+  table[hole].name[0] = 0;
+  table[hole].owner = NULL;
+  writeEnd();
+  return 0;
+}
+
+/*
+ * Function: nameNode
+ * -------------------
+ * find out where a username lives, without locking
+ *
+ * name:  username to look for
+ *
+ * returns the peer link it lives behind, 0 for this server (held
+ * or not), -1 if nobody has it
+ */
+int nameNode(const char *name) {
+  nameEntry e;
+  return nameRead(name, &e) ? e.node : -1;
+}
+
+/*
+ * Function: nameMove
+ * -------------------
+ * give a username to a user of another node, whoever had it before
+ *
+ * name:    username
+ * node:    peer link the new owner lives behind
+ * *shard:  set to the shard of the local owner it was taken from
+ *
+ * returns the node that had it, -1 if nobody did
+ */
+int nameMove(const char *name, int node, int *shard) {
+  int prev = -1;
+  writeBegin();
+  if ((tableUsed + 1) * 2 <= tableSize || nameGrow() == 0) {
+    nameEntry *e = &table[nameSlot(name)];
+    if (e->name[0] == 0) {
+      strncpy(e->name, name, NAMELENGTH);
+      e->name[NAMELENGTH] = 0;
+      tableUsed++;
+    } else {
+      prev = e->node;
+      *shard = e->shard;
+    }
+    e->owner = NULL;
+    e->shard = -1;
+    e->node = node;
+  }
+  writeEnd();
+  return prev;
+}
+
+/*
+ * Function: nameEach
+ * -------------------
+ * call fn on every username that lives on one node, with the
+ * directory locked
+ *
+ * node:  peer link, 0 for this server
+ * fn:    callback, gets the name and arg, must not touch the directory
+ * arg:   passed along to fn
+ */
+void nameEach(int node, void (*fn)(const char*, void*), void *arg) {
+  pthread_mutex_lock(&tableLock);
+  for (uint32_t i = 0; i < tableSize; i++) {
+    if (table[i].name[0] != 0 && table[i].node == node)
+      fn(table[i].name, arg);
+  }
+  pthread_mutex_unlock(&tableLock);
+}
+
+/*
+ * Function: nameCount
+ * -------------------
+ * returns the number of joined usernames
+ */
+uint32_t nameCount() {
+  pthread_mutex_lock(&tableLock);
+  uint32_t used = tableUsed;
+  pthread_mutex_unlock(&tableLock);
+  return used;
+}
+
+/*
+ * Function: nameSnapshot
+ * -------------------
+ * list every joined username as " name\n", the roster format
+ *
+ * *len:  set to the length of the list
+ *
+ * returns the list, for the caller to free, NULL if out of memory
+ */
+char* nameSnapshot(uint32_t *len) {
+  uint32_t pos = 0;
+  pthread_mutex_lock(&tableLock);
+  //sized under the lock, every name fits
+  char *out = malloc(tableUsed * (NAMELENGTH + 2) + 1);
+  if (out == NULL) {
+    pthread_mutex_unlock(&tableLock);
+    return NULL;
+  }
+  for (uint32_t i = 0; i < tableSize; i++) {
+    if (table[i].name[0] == 0)
+      continue;
+    int len = strlen(table[i].name);
+    out[pos++] = ' ';
+    memcpy(out + pos, table[i].name, len);
+    pos += len;
+    out[pos++] = '\n';
+  }
+  pthread_mutex_unlock(&tableLock);
+  *len = pos;
+  return out;
+}
@@ -0,0 +1,730 @@
+/* peer.c - federation: several servers share one set of users and rooms
+ *
+ * every server keeps a TCP link to every other one (a full mesh) and
+ * one thread of its own runs them. shards mail it what the rest of
+ * the federation has to hear: room frames, private messages to users
+ * that live elsewhere and roster changes. what comes in is mailed to
+ * the shards as if another shard had sent it. nothing is passed on
+ * from one peer to another
+ *
+ * a link is only trusted once its HELLO carried the shared secret,
+ * and the listener is on loopback unless told otherwise
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <endian.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/random.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "../inc/server.h"
+
+#define TAG_LISTEN MAXPEERS      //epoll tag of the peer listener
+#define TAG_MAIL (MAXPEERS + 1)  //epoll tag of our mailbox
+
+int peerPort = 0;                //port other servers dial us on, 0 for none
+const char *peerBind = PEERBIND; //address other servers dial us on
+peerCounters peerStats;          //exposed on the metrics endpoint
+
+static peerLink links[MAXPEERS]; //links, up or being set up
+static peerAddr addrs[MAXPEERS]; //peers given with -P
+static int numAddrs = 0;         //entries in addrs
+static uint64_t myNode = 0;      //our node id, the lower one wins a name
+static int pfd = -1;             //epoll instance of the federation thread
+static int listener = -1;        //where other servers dial us, -1 for nowhere
+static int federated = 0;        //set once the federation thread runs
+static char secret[PEERSECRET];  //shared secret every HELLO has to carry
+static uint16_t secretLen = 0;   //bytes in secret, 0 until -K gave one
+
+static void* peerMain(void*);
+static void linkClose(int);
+
+/*
+ * Function: peerAdd
+ * -------------------
+ * remember a peer to keep a link to, from -P
+ *
+ * spec:  host:port
+ *
+ * returns 0, -1 if spec is bad or there are too many peers
+ */
+int peerAdd(const char *spec) {
+  const char *colon = strrchr(spec, ':');
+  peerAddr *a;
+  if (colon == NULL || colon == spec || (size_t)(colon - spec) >= sizeof(a->host) ||
+      strlen(colon + 1) == 0 || strlen(colon + 1) >= sizeof(a->port) || numAddrs == MAXPEERS)
+    return -1;
+  a = &addrs[numAddrs++];
+  memcpy(a->host, spec, colon - spec);
+  a->host[colon - spec] = 0;
+  strcpy(a->port, colon + 1);
+  a->link = -1;
+  a->retryMs = 0;
+  return 0;
+}
+
+/*
+ * Function: peerSecret
+ * -------------------
+ * read the federation's shared secret, from -K
+ * a trailing newline is not part of it
+ *
+ * path:  file holding the secret
+ *
+ * returns 0, -1 if it can not be read, is empty or too long
+ */
+int peerSecret(const char *path) {
+  char buf[PEERSECRET + 2];
+  FILE *f = fopen(path, "r");
+  if (f == NULL)
+    return -1;
+  size_t n = fread(buf, 1, sizeof(buf), f);
+  fclose(f);
+  while (n > 0 && (buf[n - 1] == '\n' || buf[n - 1] == '\r'))
+    n--;
+  if (n == 0 || n > PEERSECRET)
+    return -1;
+  memcpy(secret, buf, n);
+  secretLen = n;
+  return 0;
+}
+
+/*
+ * Function: goodSecret
+ * -------------------
+ * check the secret of a HELLO, taking as long whichever byte is wrong
+ *
+ * got:  the secret it carried
+ * len:  its length
+ *
+ * returns 1 if it is ours
+ */
+static int goodSecret(const char *got, uint16_t len) {
+  uint8_t diff = 0;
+  if (len != secretLen)
+    return 0;
+  for (uint16_t i = 0; i < len; i++)
+    diff |= secret[i] ^ got[i];
+  return diff == 0;
+}
+
+/*
+ * Function: peerStart
+ * -------------------
+ * start the federation thread if -F or -P asked for one
+ * the shards have to exist, it shares their mailboxes
+ */
+void peerStart() {
+  pthread_t thread;
+  struct epoll_event ev;
+  if (peerPort == 0 && numAddrs == 0)
+    return;
+  //anyone who can reach the port could otherwise speak for a server
+  if (secretLen == 0) {
+    fprintf(stderr, "Error: Federation needs a shared secret, give one with -K\n");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < MAXPEERS; i++)
+    links[i].sd = -1;
+  while (myNode == 0) {
+    if (getrandom(&myNode, sizeof(myNode), 0) != sizeof(myNode))
+      myNode = 0;
+  }
+  if ((pfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    perror("epoll_create1()");
+    exit(EXIT_FAILURE);
+  }
+  if (peerPort > 0) {
+    struct sockaddr_in sad;
+    int sd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    memset(&sad, 0, sizeof(sad));
+    sad.sin_family = AF_INET;
+    sad.sin_port = htons(peerPort);
+    if (inet_pton(AF_INET, peerBind, &sad.sin_addr) != 1) {
+      fprintf(stderr, "Error: Bad peer bind address %s\n", peerBind);
+      exit(EXIT_FAILURE);
+    }
+    setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
+    if (sd < 0 || bind(sd, (struct sockaddr*)&sad, sizeof(sad)) < 0 || listen(sd, MAXPEERS) < 0) {
+      fprintf(stderr, "Error: Peer bind failed\n");
+      exit(EXIT_FAILURE);
+    }
+    ev.events = EPOLLIN;
+    ev.data.u32 = TAG_LISTEN;
+    epoll_ctl(pfd, EPOLL_CTL_ADD, sd, &ev);
+    listener = sd;
+  }
+  ev.events = EPOLLIN;
+  ev.data.u32 = TAG_MAIL;
+  epoll_ctl(pfd, EPOLL_CTL_ADD, shards[numShards].box.efd, &ev);
+  __atomic_store_n(&federated, 1, __ATOMIC_RELEASE);
+  if (pthread_create(&thread, NULL, peerMain, NULL) != 0) {
+    perror("pthread_create()");
+    exit(EXIT_FAILURE);
+  }
+  pthread_detach(thread);
+}
+
+/*
+ * Function: peerPost
+ * -------------------
+ * hand the federation something the other servers have to hear,
+ * does nothing on a server of its own
+ *
+ * type:  MAIL_ROOM, MAIL_DIRECT or MAIL_ROSTER
+ * *buf:  the frame
+ * dest:  room, recipient or the user the roster change is about
+ */
+void peerPost(uint8_t type, msgbuf *buf, const char *dest) {
+  if (__atomic_load_n(&federated, __ATOMIC_ACQUIRE))
+    postMail(numShards, type, buf, dest);
+}
+
+/*
+ * Function: linkWatch
+ * -------------------
+ * register for writability while a link has bytes waiting, or a
+ * connect is under way, and only for reads otherwise
+ *
+ * i:  the link
+ */
+static void linkWatch(int i) {
+  peerLink *l = &links[i];
+  struct epoll_event ev;
+  ev.events = EPOLLIN | (l->outLen > 0 || l->connecting ? EPOLLOUT : 0);
+  ev.data.u32 = i;
+  if (ev.events != l->events) {
+    epoll_ctl(pfd, EPOLL_CTL_MOD, l->sd, &ev);
+    l->events = ev.events;
+  }
+}
+
+/*
+ * Function: linkFlush
+ * -------------------
+ * write as much of a link's queue as the socket takes
+ *
+ * i:  the link
+ */
+static void linkFlush(int i) {
+  peerLink *l = &links[i];
+  uint32_t done = 0;
+  while (done < l->outLen) {
+    ssize_t n = send(l->sd, l->out + done, l->outLen - done, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        linkClose(i);
+        return;
+      }
+      break;
+    }
+    done += n;
+  }
+  memmove(l->out, l->out + done, l->outLen - done);
+  l->outLen -= done;
+  linkWatch(i);
+}
+
+/*
+ * Function: linkQueue
+ * -------------------
+ * queue one record for a link, written at the end of the pass
+ * a link that falls too far behind is dropped and synced again once
+ * it is back
+ *
+ * i:       the link
+ * type:    PEER_*
+ * dest:    room or user name, may be empty
+ * frame:   v1 frame, or the body of a HELLO
+ * len:     its length
+ * alt:     v2 form of the frame, may be NULL
+ * altLen:  its length
+ */
+static void linkQueue(int i, uint8_t type, const char *dest, const char *frame, uint16_t len, const char *alt, uint16_t altLen) {
+  peerLink *l = &links[i];
+  peerHdr h = {type, strlen(dest), htons(len), htons(altLen)};
+  uint32_t size = sizeof(h) + h.destLen + len + altLen;
+  if (l->outLen + size > l->outCap) {
+    uint32_t cap = l->outCap ? l->outCap : 65536;
+    while (cap < l->outLen + size)
+      cap *= 2;
+    char *grown = cap <= PEERQUEUE ? realloc(l->out, cap) : NULL;
+    if (grown == NULL) {
+      LOG(LOG_WARN, "peer link %d fell behind, dropping it", i);
+      linkClose(i);
+      return;
+    }
+    l->out = grown;
+    l->outCap = cap;
+  }
+  char *p = l->out + l->outLen;
+  memcpy(p, &h, sizeof(h));
+  memcpy(p + sizeof(h), dest, h.destLen);
+  if (len > 0)
+    memcpy(p + sizeof(h) + h.destLen, frame, len);
+  if (altLen > 0)
+    memcpy(p + sizeof(h) + h.destLen + len, alt, altLen);
+  l->outLen += size;
+  __atomic_add_fetch(&peerStats.recordsOut, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Function: linkOpen
+ * -------------------
+ * take a new connection to a peer into a free slot and say HELLO
+ *
+ * sd:          the connected, or connecting, socket
+ * dial:        the peerAddr it was dialed for, -1 if accepted
+ * connecting:  the connect is still under way
+ *
+ * returns the link, -1 if every slot is taken
+ */
+static int linkOpen(int sd, int dial, int connecting) {
+  struct epoll_event ev;
+  uint64_t node = htobe64(myNode);
+  char hello[sizeof(node) + PEERSECRET];
+  int i = 0;
+  while (i < MAXPEERS && links[i].sd >= 0)
+    i++;
+  if (i == MAXPEERS || (links[i].in == NULL && (links[i].in = malloc(PEERBUF)) == NULL)) {
+    close(sd);
+    return -1;
+  }
+  peerLink *l = &links[i];
+  l->sd = sd;
+  l->dial = dial;
+  l->connecting = connecting;
+  l->ready = 0;
+  l->node = 0;
+  l->inLen = 0;
+  l->outLen = 0;
+  setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+  ev.events = l->events = EPOLLIN | (connecting ? EPOLLOUT : 0);
+  ev.data.u32 = i;
+  epoll_ctl(pfd, EPOLL_CTL_ADD, sd, &ev);
+  memcpy(hello, &node, sizeof(node));
+  memcpy(hello + sizeof(node), secret, secretLen);
+  linkQueue(i, PEER_HELLO, "", hello, sizeof(node) + secretLen, NULL, 0);
+  return i;
+}
+
+/*
+ * Function: announce
+ * -------------------
+ * tell every shard's clients that a user of another node joined or left
+ *
+ * op:    '+' or '-'
+ * name:  the user
+ */
+static void announce(char op, const char *name) {
+  msgbuf *m = newMessage("%%%c%s", op, name);
+  withTyped(m, op == '+' ? OP_ROSTERADD : OP_ROSTERDEL, 0, name, "", 0);
+  postAll(MAIL_ROSTER, m, name);
+  releaseMessage(m);
+}
+
+//names collected from the directory
+typedef struct nameList {
+  int count;               //names in names
+  int cap;                 //room in names
+  char (*names)[NAMELENGTH+1];
+}nameList;
+
+/*
+ * Function: collectName
+ * -------------------
+ * nameEach callback: copy a name into a growing list
+ *
+ * name:  the name
+ * arg:   the nameList
+ */
+
+static void collectName(const char *name, void *arg) {
+  nameList *list = arg;
+  if (list->count == list->cap) {
+    int cap = list->cap ? list->cap * 2 : 64;
+    char (*grown)[NAMELENGTH+1] = realloc(list->names, cap * sizeof(*grown));
+    if (grown == NULL)
+      return;
+    list->names = grown;
+    list->cap = cap;
+  }
+  strcpy(list->names[list->count++], name);
+}
+
+/*
+ * Function: linkClose
+ * -------------------
+ * drop a link, the users that lived behind it leave
+ *
+ * i:  the link
+ */
+static void linkClose(int i) {
+  peerLink *l = &links[i];
+  nameList gone = {0, 0, NULL};
+  if (l->sd < 0)
+    return;
+  epoll_ctl(pfd, EPOLL_CTL_DEL, l->sd, NULL);
+  close(l->sd);
+  l->sd = -1;
+  l->outLen = 0;
+  if (l->dial >= 0) {
+    addrs[l->dial].link = -1;
+    addrs[l->dial].retryMs = nowMs() + PEERRETRY;
+  }
+  if (!l->ready)
+    return;
+  LOG(LOG_WARN, "peer link %d to node %016llx down", i, (unsigned long long)l->node);
+  l->ready = 0;
+  __atomic_sub_fetch(&peerStats.links, 1, __ATOMIC_RELAXED);
+  //collect first, the directory is locked while nameEach runs
+  nameEach(i + 1, collectName, &gone);
+  for (int k = 0; k < gone.count; k++) {
+    if (nameRemoveNode(gone.names[k], i + 1) == 0)
+      announce('-', gone.names[k]);
+  }
+  free(gone.names);
+}
+
+/*
+ * Function: sendName
+ * -------------------
+ * nameEach callback: tell a new link about one of our users
+ *
+ * name:  the user
+ * arg:   the link
+ */
+static void sendName(const char *name, void *arg) {
+  linkQueue((int)(intptr_t)arg, PEER_ADD, name, NULL, 0, NULL, 0);
+}
+
+/*
+ * Function: gotHello
+ * -------------------
+ * a peer said who it is: keep one link per node, then sync names
+ *
+ * i:     the link
+ * node:  its node id
+ */
+static void gotHello(int i, uint64_t node) {
+  peerLink *l = &links[i];
+  if (node == myNode) {
+    //we dialed ourselves, never again
+    if (l->dial >= 0)
+      addrs[l->dial].retryMs = -1;
+    linkClose(i);
+    return;
+  }
+  l->node = node;
+  for (int k = 0; k < MAXPEERS; k++) {
+    if (k == i || links[k].sd < 0 || links[k].node != node)
+      continue;
+    //both ends dialed: keep the link the lower node id dialed
+    uint64_t ours = l->dial >= 0 ? myNode : node;
+    uint64_t theirs = links[k].dial >= 0 ? myNode : node;
+    if (ours > theirs || (ours == theirs && links[k].ready)) {
+      if (l->dial >= 0)
+        addrs[l->dial].retryMs = -1;
+      linkClose(i);
+      return;
+    }
+    if (links[k].dial >= 0)
+      addrs[links[k].dial].retryMs = -1;
+    linkClose(k);
+  }
+  l->ready = 1;
+  __atomic_add_fetch(&peerStats.links, 1, __ATOMIC_RELAXED);
+  LOG(LOG_INFO, "peer link %d up to node %016llx", i, (unsigned long long)node);
+  nameEach(0, sendName, (void*)(intptr_t)i);
+}
+
+/*
+ * Function: gotName
+ * -------------------
+ * a user joined on another node. a name claimed on two nodes at once
+ * goes to the node with the lower id, every node comes to the same
+ * answer without asking. a local loser is disconnected
+ *
+ * i:     the link
+ * name:  the user
+ */
+static void gotName(int i, const char *name) {
+  int have = nameNode(name);
+  int shard = -1;
+  if (have == i + 1)
+    return;
+  if (have >= 0) {
+    uint64_t holder = have == 0 ? myNode : links[have - 1].node;
+    __atomic_add_fetch(&peerStats.collisions, 1, __ATOMIC_RELAXED);
+    if (holder < links[i].node)
+      return;
+  }
+  switch (nameMove(name, i + 1, &shard)) {
+    case -1:
+      announce('+', name);
+      break;
+    case 0:
+      LOG(LOG_WARN, "%s was also taken on node %016llx, it keeps it", name, (unsigned long long)links[i].node);
+      if (shard >= 0 && shard < numShards)
+        postMail(shard, MAIL_KICK, NULL, name);
+      break;
+  }
+}
+
+/*
+ * Function: gotFrame
+ * -------------------
+ * rebuild a frame a peer sent, v2 form included
+ *
+ * frame:   the v1 frame
+ * len:     its length
+ * alt:     its v2 form
+ * altLen:  that length, 0 for none
+ *
+ * returns the frame with one reference held, NULL if it is bad
+ */
+static msgbuf* gotFrame(const char *frame, uint16_t len, const char *alt, uint16_t altLen) {
+  if (len < FRAMEHDR || (altLen > 0 && altLen < sizeof(typedHdr)))
+    return NULL;
+  msgbuf *m = rawMessage(frame, len);
+  if (m == NULL)
+    return NULL;
+  if (altLen > 0 && (m->alt = rawMessage(alt, altLen)) != NULL)
+    m->alt->typed = 1;
+  else
+    m->v1only = 1;
+  return m;
+}
+
+/*
+ * Function: linkRecord
+ * -------------------
+ * act on one record from a peer
+ *
+ * i:      the link
+ * *h:     its header, lengths in host order
+ * dest:   room or user name, null terminated
+ * frame:  the frame, then its v2 form
+ */
+static void linkRecord(int i, peerHdr *h, const char *dest, const char *frame) {
+  msgbuf *m;
+  int shard = -1;
+  __atomic_add_fetch(&peerStats.recordsIn, 1, __ATOMIC_RELAXED);
+  if (!links[i].ready && h->type != PEER_HELLO) {
+    linkClose(i);
+    return;
+  }
+  switch (h->type) {
+    case PEER_HELLO: {
+      uint64_t node;
+      if (h->len < sizeof(node) || links[i].ready) {
+        linkClose(i);
+        return;
+      }
+      if (!goodSecret(frame + sizeof(node), h->len - sizeof(node))) {
+        LOG(LOG_WARN, "peer link %d sent the wrong secret, dropping it", i);
+        linkClose(i);
+        return;
+      }
+      memcpy(&node, frame, sizeof(node));
+      gotHello(i, be64toh(node));
+      break;
+    }
+    case PEER_ROOM:
+      if ((m = gotFrame(frame, h->len, frame + h->len, h->altLen)) == NULL)
+        break;
+      //chat and actions go into our history too
+      if (m->alt != NULL && (m->alt->data[0] == OP_CHAT || m->alt->data[0] == OP_ACTION))
+        historyAppend(dest, m);
+      postAll(MAIL_ROOM, m, dest);
+      releaseMessage(m);
+      break;
+    case PEER_DIRECT:
+      if (nameFind(dest, &shard) == NULL || (m = gotFrame(frame, h->len, frame + h->len, h->altLen)) == NULL)
+        break;
+      postMail(shard, MAIL_DIRECT, m, dest);
+      releaseMessage(m);
+      break;
+    case PEER_ADD:
+      gotName(i, dest);
+      break;
+    case PEER_DEL:
+      if (nameRemoveNode(dest, i + 1) == 0)
+        announce('-', dest);
+      break;
+  }
+}
+
+/*
+ * Function: linkRead
+ * -------------------
+ * drain a link's socket and act on every complete record
+ *
+ * i:  the link
+ */
+static void linkRead(int i) {
+  peerLink *l = &links[i];
+  while (l->sd >= 0) {
+    ssize_t n = recv(l->sd, l->in + l->inLen, PEERBUF - l->inLen, MSG_DONTWAIT);
+    if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)) {
+      linkClose(i);
+      return;
+    }
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    l->inLen += n;
+    uint32_t pos = 0;
+    while (l->sd >= 0 && l->inLen - pos >= sizeof(peerHdr)) {
+      peerHdr h;
+      char dest[NAMELENGTH+1];
+      memcpy(&h, l->in + pos, sizeof(h));
+      h.len = ntohs(h.len);
+      h.altLen = ntohs(h.altLen);
+      if (h.destLen > NAMELENGTH) {
+        linkClose(i);
+        return;
+      }
+      uint32_t size = sizeof(h) + h.destLen + h.len + h.altLen;
+      if (l->inLen - pos < size)
+        break;
+      memcpy(dest, l->in + pos + sizeof(h), h.destLen);
+      dest[h.destLen] = 0;
+      linkRecord(i, &h, dest, l->in + pos + sizeof(h) + h.destLen);
+      pos += size;
+    }
+    if (l->sd < 0)
+      return;
+    memmove(l->in, l->in + pos, l->inLen - pos);
+    l->inLen -= pos;
+  }
+}
+
+/*
+ * Function: peerMail
+ * -------------------
+ * pass on what the shards want the other servers to hear
+ */
+static void peerMail() {
+  mail *m;
+  while ((m = takeMail()) != NULL) {
+    msgbuf *b = m->buf;
+    const char *alt = b->alt != NULL ? b->alt->data : NULL;
+    uint16_t altLen = b->alt != NULL ? b->alt->len : 0;
+    switch (m->type) {
+      case MAIL_ROOM:
+        for (int i = 0; i < MAXPEERS; i++) {
+          if (links[i].ready)
+            linkQueue(i, PEER_ROOM, m->dest, b->data, b->len, alt, altLen);
+        }
+        break;
+      case MAIL_DIRECT: {
+        int node = nameNode(m->dest);
+        if (node > 0 && links[node - 1].ready)
+          linkQueue(node - 1, PEER_DIRECT, m->dest, b->data, b->len, alt, altLen);
+        break;
+      }
+      case MAIL_ROSTER: {
+        uint8_t type = b->data[FRAMEHDR + 1] == '+' ? PEER_ADD : PEER_DEL;
+        for (int i = 0; i < MAXPEERS; i++) {
+          if (links[i].ready)
+            linkQueue(i, type, m->dest, NULL, 0, NULL, 0);
+        }
+        break;
+      }
+    }
+    doneMail(m);
+  }
+}
+
+/*
+ * Function: dialPeers
+ * -------------------
+ * start a connect to every -P peer that is down and due
+ */
+static void dialPeers() {
+  long now = nowMs();
+  for (int k = 0; k < numAddrs; k++) {
+    peerAddr *a = &addrs[k];
+    struct addrinfo hints, *res;
+    int sd;
+    if (a->link >= 0 || a->retryMs < 0 || a->retryMs > now)
+      continue;
+    a->retryMs = now + PEERRETRY;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(a->host, a->port, &hints, &res) != 0)
+      continue;
+    sd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sd >= 0 && (connect(sd, res->ai_addr, res->ai_addrlen) == 0 || errno == EINPROGRESS))
+      a->link = linkOpen(sd, k, 1);
+    else if (sd >= 0)
+      close(sd);
+    freeaddrinfo(res);
+  }
+}
+
+/*
+ * Function: peerMain
+ * -------------------
+ * the federation thread: links, our mailbox and redialing
+ *
+ * arg:  unused
+ */
+static void* peerMain(void *arg) {
+  struct epoll_event evs[MAXPEERS + 2];
+  //it reads the mailbox after the last shard's
+  myShard = numShards;
+  while (1) {
+    dialPeers();
+    int n = epoll_wait(pfd, evs, MAXPEERS + 2, PEERRETRY);
+    for (int k = 0; k < n; k++) {
+      uint32_t tag = evs[k].data.u32;
+      if (tag == TAG_LISTEN) {
+        int sd;
+        while ((sd = accept(listener, NULL, NULL)) >= 0) {
+          fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK);
+          linkOpen(sd, -1, 0);
+        }
+      } else if (tag == TAG_MAIL) {
+        peerMail();
+      } else {
+        peerLink *l = &links[tag];
+        if (l->sd < 0)
+          continue;
+        if (l->connecting && (evs[k].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+          int err = 0;
+          socklen_t len = sizeof(err);
+          getsockopt(l->sd, SOL_SOCKET, SO_ERROR, &err, &len);
+          if (err != 0) {
+            linkClose(tag);
+            continue;
+          }
+          l->connecting = 0;
+        }
+        if (l->sd >= 0 && (evs[k].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+          linkRead(tag);
+      }
+    }
+    //one write per link and pass, however many records it got
+    for (int i = 0; i < MAXPEERS; i++) {
+      if (links[i].sd >= 0 && !links[i].connecting && links[i].outLen > 0)
+        linkFlush(i);
+    }
+  }
+  return NULL;
+}
@@ -0,0 +1,124 @@
+/* pool.c - slab pools and size classed buffers, no malloc once warm */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../inc/server.h"
+
+pool *pools[MAXPOOLS];   //every pool in use, for the metrics dump
+int numPools = 0;        //slots of pools handed out
+
+static _Thread_local char ownerTag;  //its address tells threads apart
+static _Thread_local pool classes[SIZECLASSES] = {
+  {"msg64", 64}, {"msg256", 256}, {"msg1k", 1024},
+  {"msg4k", 4096}, {"msg16k", 16384}, {"msg64k", 65536},
+};
+
+static int grow(pool*);
+
+/*
+ * Function: poolGet
+ * -------------------
+ * take an object from the calling thread's pool, growing it by one
+ * slab when both the free list and the remote frees are empty
+ *
+ * *p:  pool owned by the calling thread
+ *
+ * returns the object, NULL when out of memory
+ */
+void* poolGet(pool *p) {
+  poolObj *o;
+  if (p->owner == NULL) {
+    int idx = __atomic_fetch_add(&numPools, 1, __ATOMIC_ACQ_REL);
+    p->owner = &ownerTag;
+    p->shard = myShard;
+    if (idx < MAXPOOLS)
+      __atomic_store_n(&pools[idx], p, __ATOMIC_RELEASE);
+  }
+  if (p->free == NULL) {
+    //take everything other threads gave back in one swap
+    p->free = __atomic_exchange_n(&p->remote, NULL, __ATOMIC_ACQUIRE);
+    if (p->free == NULL && grow(p) < 0)
+      return NULL;
+  }
+  o = p->free;
+  p->free = o->next;
+  __atomic_store_n(&p->gets, p->gets + 1, __ATOMIC_RELAXED);
+  return o + 1;
+}
+
+/*
+ * Function: poolPut
+ * -------------------
+ * give an object back to the pool it came from, from any thread
+ *
+ * *obj:  object from poolGet or sizedGet, NULL is ignored
+ */
+void poolPut(void *obj) {
+  poolObj *o;
+  pool *p;
+  if (obj == NULL)
+    return;
+  o = (poolObj*)obj - 1;
+  p = o->home;
+  if (p == NULL) {
+    free(o);
+  } else if (p->owner == &ownerTag) {
+    o->next = p->free;
+    p->free = o;
+    __atomic_store_n(&p->puts, p->puts + 1, __ATOMIC_RELAXED);
+  } else {
+    //the owner takes the whole list at once, so a plain push is ABA safe
+    o->next = __atomic_load_n(&p->remote, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&p->remote, &o->next, o, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+    __atomic_add_fetch(&p->remoteFrees, 1, __ATOMIC_RELAXED);
+  }
+}
+
+/*
+ * Function: sizedGet
+ * -------------------
+ * take a buffer from the smallest size class that fits,
+ * anything bigger than the largest class is malloced
+ *
+ * size:  bytes needed
+ *
+ * returns the buffer, free it with poolPut
+ */
+void* sizedGet(size_t size) {
+  for (int i = 0; i < SIZECLASSES; i++)
+    if (size <= classes[i].size)
+      return poolGet(&classes[i]);
+  poolObj *o = malloc(sizeof(poolObj) + size);
+  if (o == NULL)
+    return NULL;
+  o->home = NULL;
+  return o + 1;
+}
+
+/*
+ * Function: grow
+ * -------------------
+ * carve a new slab into free objects, slabs are never given back
+ * so the footprint stays at the high water mark
+ *
+ * *p:  pool to grow
+ *
+ * returns 0 on success, -1 when out of memory
+ */
+static int grow(pool *p) {
+  size_t stride = (sizeof(poolObj) + p->size + 15) & ~(size_t)15;
+  size_t count = SLABBYTES / stride ? SLABBYTES / stride : 1;
+  char *slab = malloc(stride * count);
+  if (slab == NULL)
+    return -1;
+  for (size_t i = 0; i < count; i++) {
+    poolObj *o = (poolObj*)(slab + i * stride);
+    o->home = p;
+    o->next = p->free;
+    p->free = o;
+  }
+  __atomic_store_n(&p->reserved, p->reserved + count, __ATOMIC_RELAXED);
+  return 0;
+}
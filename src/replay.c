@@ -0,0 +1,951 @@
+/* replay.c - plays a trace captured with server -C back into a server */
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "../inc/clientnet.h"
+#include "../inc/timer.h"
+#include "../inc/capture.h"
+
+#define PARSE_NAME 1       /* parser states of the server a trace carries */
+#define PARSE_BODY 3
+#define PARSE_TYPEDHDR 5
+#define PARSE_TYPED 6
+#define PARSE_RESUME 7
+#define SIGLEN 16          /* bytes at the end of a message its echo is known by */
+#define MAXPENDING 64      /* echoes one connection waits for at once */
+#define MAXEVENTS 256
+#define BATCH 256          /* records sent between polls when not paced */
+#define LATBUCKET 10       /* microseconds per latency histogram bucket */
+#define LATBUCKETS 100000  /* one second, anything slower lands in the last */
+#define MAXDIFFS 10        /* differing connections listed one by one */
+#define EDGEUS 100000      /* trace time around a join or leave whose messages are not compared */
+
+/*
+*****************************************************************************
+** syntax:  ./replay [-x speed] [-w drain_seconds] [-o output_file]        **
+**                   [-b baseline_file] <trace> <host> <port>              **
+*****************************************************************************
+*/
+
+//what the server is sending a connection
+#define IN_GREET   0       /* 'Y' or 'N' for the connection itself */
+#define IN_SHAKE   1       /* single byte answers to names, hellos and resumes */
+#define IN_VERSION 2       /* the version after HELLOACK */
+#define IN_FRAMES  3       /* framed messages, v1 or v2 */
+
+//one record of the trace, pointing into the loaded file
+typedef struct rec {
+  uint64_t us;             //when it was captured, from the first record
+  uint32_t conn;           //connection number
+  uint32_t seq;            //position in the file, keeps the sort stable
+  const char *data;        //len bytes of the field
+  uint16_t len;            //bytes in data
+  uint8_t type;            //CAP_*
+  uint16_t sigEnd;         //where the text its echo ends with stops in data
+  uint8_t sigLen;          //bytes of that text before sigEnd, 0 for no echo
+  uint16_t textLen;        //bytes of the whole text before sigEnd
+  uint8_t edge;            //opens, closes, names and joins what the connection is sent
+}rec;
+
+//a message that was played, so whoever receives it knows when it was sent
+typedef struct sent {
+  uint64_t key;            //hash of its echo text, 0 for a free slot
+  uint64_t us;             //trace time it was sent at
+  uint32_t conn;           //connection that sent it
+}sent;
+
+//a message whose echo has not come back yet
+typedef struct pending {
+  const char *sig;         //last bytes of the message
+  uint8_t sigLen;          //bytes in sig
+  uint64_t sentUs;         //when it was queued
+}pending;
+
+//one connection of the trace
+typedef struct conn {
+  int sd;                  //socket, -1 before it opens and once closed
+  uint8_t in;              //IN_*
+  uint8_t proto;           //PROTO_V1 or PROTO_V2
+  uint8_t closing;         //the trace closed it, close once out is written
+  uint8_t dirty;           //on the dirty list
+  struct conn *nextDirty;  //link in the dirty list
+  reader r;                //bytes from the server
+  char *out;               //bytes not yet written
+  uint32_t outLen;         //bytes in out
+  uint32_t outCap;         //bytes allocated for out
+  pending wait[MAXPENDING];//echoes owed, oldest first
+  uint32_t waitHead;       //slot of the oldest
+  uint32_t waitLen;        //echoes owed
+  uint64_t frames;         //messages received, presence traffic aside
+  uint64_t digest;         //sum of their hashes, so the order they came in does not matter
+  uint64_t *edges;         //trace times of its edge records, in order
+  uint32_t numEdges;       //entries in edges
+}conn;
+
+int loadTrace(char*);
+uint8_t echoSig(const char*, uint16_t, uint8_t, uint16_t*, uint16_t*);
+int byTime(const void*, const void*);
+void findEdges();
+int nearEdge(conn*, uint64_t);
+void noteSent(rec*);
+sent* findSent(uint8_t, const char*, uint32_t);
+void play(rec*, char*, int);
+void queueOut(conn*, const char*, uint16_t);
+void flushDirty();
+void flushOut(conn*);
+void drain(int);
+void readConn(conn*);
+void takeMessage(conn*, uint8_t, const char*, uint8_t, const char*, uint32_t);
+void matchEcho(conn*, const char*, uint32_t);
+void closeIfDone(conn*);
+void dropConn(conn*);
+uint64_t hashBytes(uint64_t, const void*, uint32_t);
+uint64_t percentile(double);
+int compareOutput(char*);
+void writeOutput(char*);
+void report(double, double, int);
+
+rec *recs = NULL;          /* the trace, sorted by time once loaded */
+uint32_t numRecs = 0;      /* entries in recs */
+conn *conns = NULL;        /* indexed by connection number */
+uint32_t maxConn = 0;      /* highest connection number in the trace */
+conn *dirtyList = NULL;    /* connections with bytes to write, in the order they got them */
+conn **dirtyTail = &dirtyList;
+int epfd = -1;
+uint64_t replayed = 0;     /* records played */
+uint64_t bytesSent = 0;    /* field bytes queued */
+uint64_t skipped = 0;      /* fields of connections that were not open */
+uint64_t opened = 0;       /* connections the server took */
+uint64_t failed = 0;       /* connects that failed */
+uint64_t rejected = 0;     /* connections the server turned away */
+uint64_t hungUp = 0;       /* connections the server closed on its own */
+uint64_t received = 0;     /* messages from the server */
+uint64_t echoes = 0;       /* messages whose echo came back */
+uint64_t unanswered = 0;   /* messages whose echo never came */
+uint64_t latMax = 0;
+uint64_t *latency = NULL;  /* histogram of echo latency */
+sent *sentTab = NULL;      /* messages played, by the hash of their echo text */
+uint32_t sentMask = 0;     /* slots in sentTab less one, a power of two less one */
+uint64_t edgeUs = EDGEUS;  /* EDGEUS in trace time at the speed played */
+uint64_t uncompared = 0;   /* messages near an edge, left out of the digest */
+uint64_t playedUs = 0;     /* trace time of the last record played */
+
+int main(int argc, char *argv[]) {
+  double speed = 1;        /* trace time over replay time, 0 for as fast as possible */
+  int drainTime = 2;       /* seconds to wait for stragglers */
+  char *outFile = NULL;    /* where to write what each connection received */
+  char *baseFile = NULL;   /* an earlier output file to compare with */
+  uint64_t start;
+  double playSecs;
+  int diffs = -1;
+  int opt;
+  struct rlimit rl;
+
+  while ((opt = getopt(argc, argv, "x:w:o:b:")) != -1) {
+    switch (opt) {
+      case 'x':
+        speed = atof(optarg);
+        break;
+      case 'w':
+        drainTime = atoi(optarg);
+        break;
+      case 'o':
+        outFile = optarg;
+        break;
+      case 'b':
+        baseFile = optarg;
+        break;
+      default:
+        argc = 0;
+    }
+  }
+  if (argc - optind != 3 || speed < 0 || drainTime < 0) {
+    fprintf(stderr,"Error: Wrong number of arguments\n");
+    fprintf(stderr,"usage:\n");
+    fprintf(stderr,"%s [-x speed] [-w drain_seconds] [-o output_file] [-b baseline_file] trace host port\n", argv[0]);
+    fprintf(stderr,"a speed of 0 plays the trace as fast as possible\n");
+    exit(EXIT_FAILURE);
+  }
+  //every connection of the trace may be open at once
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+  if (loadTrace(argv[optind]) < 0)
+    exit(EXIT_FAILURE);
+  if ((conns = calloc(maxConn + 1, sizeof(conn))) == NULL || (latency = calloc(LATBUCKETS, sizeof(uint64_t))) == NULL) {
+    fprintf(stderr, "Error: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  for (uint32_t i = 0; i <= maxConn; i++)
+    conns[i].sd = -1;
+  findEdges();
+  //how close to an edge is a race depends on real time
+  if (speed > 1)
+    edgeUs = EDGEUS * speed;
+  if ((epfd = epoll_create1(0)) < 0) {
+    perror("epoll_create1()");
+    exit(EXIT_FAILURE);
+  }
+
+  start = nowUs();
+  for (uint32_t i = 0; i < numRecs; i++) {
+    if (speed > 0) {
+      //wait for the record's turn, answering the server meanwhile
+      uint64_t due = start + (uint64_t)(recs[i].us / speed);
+      uint64_t now;
+      while ((now = nowUs()) < due) {
+        flushDirty();
+        drain((due - now + 999) / 1000);
+      }
+    }
+    //a replay that falls behind still has to read
+    if (i % BATCH == 0) {
+      flushDirty();
+      drain(0);
+    }
+    play(&recs[i], argv[optind + 1], atoi(argv[optind + 2]));
+  }
+  flushDirty();
+  playSecs = (nowUs() - start) / 1e6;
+  //wait for the echoes still owed, or the drain time
+  uint64_t end = nowUs() + (uint64_t)drainTime * 1000000;
+  while (nowUs() < end) {
+    uint64_t owed = 0;
+    for (uint32_t i = 0; i <= maxConn; i++)
+      if (conns[i].sd >= 0)
+        owed += conns[i].waitLen + (conns[i].outLen > 0);
+    if (owed == 0)
+      break;
+    flushDirty();
+    drain(10);
+  }
+  for (uint32_t i = 0; i <= maxConn; i++)
+    if (conns[i].sd >= 0)
+      dropConn(&conns[i]);
+  if (baseFile != NULL)
+    diffs = compareOutput(baseFile);
+  if (outFile != NULL)
+    writeOutput(outFile);
+  report(playSecs, numRecs > 0 ? recs[numRecs - 1].us / 1e6 : 0, diffs);
+  return 0;
+}
+
+/*
+ * Function: loadTrace
+ * -------------------
+ * reads a trace into memory, sorts it by time and marks the
+ * messages whose echo can be waited for
+ *
+ * *path:  trace file written by server -C
+ *
+ * returns 0 on success, -1 if the file is not a trace
+ */
+int loadTrace(char *path) {
+  struct stat st;
+  char *buf;
+  size_t pos = strlen(CAPMAGIC);
+  uint64_t first = UINT64_MAX;
+  uint8_t *typedOp;        /* v2 opcode of the last header on each connection */
+  uint8_t *typedArg;       /* and its name length */
+  int fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0 || (buf = malloc(st.st_size)) == NULL) {
+    fprintf(stderr, "Error: can not read %s\n", path);
+    return -1;
+  }
+  for (off_t got = 0; got < st.st_size; ) {
+    ssize_t n = read(fd, buf + got, st.st_size - got);
+    if (n <= 0) {
+      fprintf(stderr, "Error: can not read %s\n", path);
+      return -1;
+    }
+    got += n;
+  }
+  close(fd);
+  if ((size_t)st.st_size < pos || memcmp(buf, CAPMAGIC, pos) != 0) {
+    fprintf(stderr, "Error: %s is not a trace\n", path);
+    return -1;
+  }
+  //one pass to size everything, a second to fill it in
+  for (size_t p = pos; p + sizeof(capRec) <= (size_t)st.st_size; numRecs++) {
+    capRec h;
+    memcpy(&h, buf + p, sizeof(h));
+    if (ntohl(h.conn) > maxConn)
+      maxConn = ntohl(h.conn);
+    if (be64toh(h.us) < first)
+      first = be64toh(h.us);
+    p += sizeof(h) + ntohs(h.len);
+  }
+  recs = calloc(numRecs ? numRecs : 1, sizeof(rec));
+  typedOp = calloc(maxConn + 1, sizeof(uint8_t));
+  typedArg = calloc(maxConn + 1, sizeof(uint8_t));
+  if (recs == NULL || typedOp == NULL || typedArg == NULL) {
+    fprintf(stderr, "Error: out of memory\n");
+    return -1;
+  }
+  for (uint32_t i = 0; i < numRecs; i++) {
+    capRec h;
+    rec *r = &recs[i];
+    memcpy(&h, buf + pos, sizeof(h));
+    pos += sizeof(h);
+    r->us = be64toh(h.us) - first;
+    r->conn = ntohl(h.conn);
+    r->seq = i;
+    r->len = ntohs(h.len);
+    r->type = h.type;
+    r->data = buf + pos;
+    //a trace cut short by a crash ends in a partial record
+    if (pos + r->len > (size_t)st.st_size) {
+      numRecs = i;
+      break;
+    }
+    pos += r->len;
+    r->edge = r->type != CAP_FIELD || h.state == PARSE_NAME || h.state == PARSE_RESUME;
+    if (r->type != CAP_FIELD)
+      continue;
+    if (h.state == PARSE_BODY)
+      r->sigLen = echoSig(r->data, r->len, 0, &r->sigEnd, &r->textLen);
+    //a v2 body needs the header before it to be understood
+    if (h.state == PARSE_TYPEDHDR && r->len == sizeof(typedHdr)) {
+      typedHdr th;
+      memcpy(&th, r->data, sizeof(th));
+      typedOp[r->conn] = th.op;
+      typedArg[r->conn] = th.nameLen;
+    }
+    if (h.state == PARSE_TYPED && r->len >= typedArg[r->conn]) {
+      r->sigLen = echoSig(r->data + typedArg[r->conn], r->len - typedArg[r->conn], typedOp[r->conn], &r->sigEnd, &r->textLen);
+      r->sigEnd += typedArg[r->conn];
+    }
+    //a message without an echo is a /join, /part or the like
+    if ((h.state == PARSE_BODY || (h.state == PARSE_TYPED && typedOp[r->conn] != OP_CHAT &&
+        typedOp[r->conn] != OP_ACTION && typedOp[r->conn] != OP_PRIVATE)) && r->sigLen == 0)
+      r->edge = 1;
+  }
+  free(typedOp);
+  free(typedArg);
+  qsort(recs, numRecs, sizeof(rec), byTime);
+  //at least twice the messages that can be sent, so probes stay short
+  uint32_t msgs = 0, size = 2;
+  for (uint32_t i = 0; i < numRecs; i++)
+    msgs += recs[i].sigLen > 0;
+  while (size < msgs * 2)
+    size *= 2;
+  if ((sentTab = calloc(size, sizeof(sent))) == NULL) {
+    fprintf(stderr, "Error: out of memory\n");
+    return -1;
+  }
+  sentMask = size - 1;
+  return 0;
+}
+
+/*
+ * Function: echoSig
+ * -------------------
+ * finds the text a message's echo ends with, the way the server
+ * takes messages apart: @name and /me are not echoed, chat stops
+ * at the first newline and /join and /part get no echo at all
+ *
+ * *body:  message as sent
+ * len:    bytes in body
+ * op:     v2 opcode, 0 for a v1 message
+ * *end:   set to where the text stops in body
+ * *whole: set to the length of the text
+ *
+ * returns bytes of the text before end to match, 0 for no echo
+ */
+uint8_t echoSig(const char *body, uint16_t len, uint8_t op, uint16_t *end, uint16_t *whole) {
+  const char *text = body;
+  const char *stop = body + len;
+  if (op == 0 && len > 0 && body[0] == '@') {
+    //a private message, the name runs up to the first space
+    text = memchr(body, ' ', len);
+    text = text != NULL ? text + 1 : stop;
+  } else if (op == 0 || op == OP_CHAT || op == OP_ACTION) {
+    if (op == 0 && len >= 3 && (body[0] == '/' || body[0] == '\\')) {
+      if ((len == 5 || (len > 5 && body[5] == ' ')) && memcmp(body + 1, "join", 4) == 0)
+        return 0;
+      if (len == 5 && memcmp(body + 1, "part", 4) == 0)
+        return 0;
+      if (memcmp(body + 1, "me", 2) == 0)
+        text = body + 3 + (len > 3 && body[3] == ' ');
+    }
+    char *nl = memchr(text, '\n', stop - text);
+    if (nl != NULL)
+      stop = nl;
+  } else if (op != OP_PRIVATE) {
+    return 0;
+  }
+  *end = stop - body;
+  *whole = stop - text;
+  return stop - text < SIGLEN ? stop - text : SIGLEN;
+}
+
+/*
+ * Function: byTime
+ * -------------------
+ * qsort comparison, shards wrote their records in batches so only
+ * the time puts them back in order, the file order breaks ties
+ *
+ * returns <0, 0 or >0 as a sorts before, with or after b
+ */
+int byTime(const void *a, const void *b) {
+  const rec *x = a, *y = b;
+  if (x->us != y->us)
+    return x->us < y->us ? -1 : 1;
+  return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/*
+ * Function: findEdges
+ * -------------------
+ * lists the edge records of every connection, oldest first,
+ * from the trace sorted by time
+ */
+void findEdges() {
+  for (uint32_t i = 0; i < numRecs; i++)
+    conns[recs[i].conn].numEdges += recs[i].edge;
+  for (uint32_t i = 0; i <= maxConn; i++) {
+    if (conns[i].numEdges > 0 && (conns[i].edges = malloc(conns[i].numEdges * sizeof(uint64_t))) == NULL) {
+      fprintf(stderr, "Error: out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+    conns[i].numEdges = 0;
+  }
+  for (uint32_t i = 0; i < numRecs; i++)
+    if (recs[i].edge) {
+      conn *c = &conns[recs[i].conn];
+      c->edges[c->numEdges++] = recs[i].us;
+    }
+}
+
+/*
+ * Function: nearEdge
+ * -------------------
+ * whether a message sent at some trace time is close enough to the
+ * receiver connecting, leaving or changing rooms that getting it
+ * depends on how the replay was scheduled
+ *
+ * *c:  the receiver
+ * us:  trace time the message was sent at
+ *
+ * returns 1 if an edge of c is within edgeUs of us
+ */
+int nearEdge(conn *c, uint64_t us) {
+  uint32_t lo = 0, hi = c->numEdges;
+  //first edge at or after us, the one before it is the other candidate
+  while (lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    if (c->edges[mid] < us)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return (lo < c->numEdges && c->edges[lo] - us < edgeUs) || (lo > 0 && us - c->edges[lo - 1] < edgeUs);
+}
+
+/*
+ * Function: noteSent
+ * -------------------
+ * remembers when a message was played, by its whole text,
+ * a later message with the same text takes its place
+ *
+ * *r:  record of the message
+ */
+void noteSent(rec *r) {
+  uint64_t key = hashBytes(14695981039346656037ULL, r->data + r->sigEnd - r->textLen, r->textLen) | 1;
+  uint32_t i = key & sentMask;
+  while (sentTab[i].key != 0 && sentTab[i].key != key)
+    i = (i + 1) & sentMask;
+  sentTab[i].key = key;
+  sentTab[i].us = r->us;
+  sentTab[i].conn = r->conn;
+}
+
+/*
+ * Function: findSent
+ * -------------------
+ * finds the played message a received one carries, by the text
+ * after the "> name: " or "*name " the server puts in front for v1
+ *
+ * op:     v2 opcode, 0 for a v1 message
+ * *body:  message as received
+ * len:    bytes in body
+ *
+ * returns the message, NULL if the text is none the trace sent
+ */
+sent* findSent(uint8_t op, const char *body, uint32_t len) {
+  const char *text = body;
+  if (op == 0) {
+    const char *sep = NULL;
+    //chat and private messages pad the name, an action does not
+    if (len > 1 && body[0] == '*' && body[1] != ' ')
+      sep = memchr(body, ' ', len);
+    for (const char *p = body; sep == NULL && p + 1 < body + len; p++)
+      if (p[0] == ':' && p[1] == ' ')
+        sep = p + 1;
+    if (sep == NULL)
+      return NULL;
+    text = sep + 1;
+  }
+  uint64_t key = hashBytes(14695981039346656037ULL, text, body + len - text) | 1;
+  for (uint32_t i = key & sentMask; sentTab[i].key != 0; i = (i + 1) & sentMask)
+    if (sentTab[i].key == key)
+      return &sentTab[i];
+  return NULL;
+}
+
+/*
+ * Function: play
+ * -------------------
+ * does what one record says, opening a connection, sending a field
+ * or closing a connection
+ *
+ * *r:     record to play
+ * *host:  address of the server
+ * port:   port of the server
+ */
+void play(rec *r, char *host, int port) {
+  conn *c = &conns[r->conn];
+  struct epoll_event ev;
+  replayed++;
+  playedUs = r->us;
+  switch (r->type) {
+    case CAP_OPEN:
+      if (c->sd >= 0)
+        dropConn(c);
+      if ((c->sd = dialHost(host, port)) < 0) {
+        failed++;
+        break;
+      }
+      fcntl(c->sd, F_SETFL, fcntl(c->sd, F_GETFL) | O_NONBLOCK);
+      //Nagle would hold small fields back and skew the latency
+      setsockopt(c->sd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+      c->in = IN_GREET;
+      c->proto = PROTO_V1;
+      c->closing = 0;
+      ev.events = EPOLLIN;
+      ev.data.ptr = c;
+      if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->sd, &ev) < 0) {
+        perror("epoll_ctl()");
+        exit(EXIT_FAILURE);
+      }
+      opened++;
+      break;
+    case CAP_FIELD:
+      if (c->sd < 0 || c->closing) {
+        skipped++;
+        break;
+      }
+      queueOut(c, r->data, r->len);
+      if (r->sigLen > 0) {
+        noteSent(r);
+        if (c->waitLen == MAXPENDING) {
+          c->waitHead = (c->waitHead + 1) % MAXPENDING;
+          c->waitLen--;
+          unanswered++;
+        }
+        pending *p = &c->wait[(c->waitHead + c->waitLen++) % MAXPENDING];
+        p->sig = r->data + r->sigEnd - r->sigLen;
+        p->sigLen = r->sigLen;
+        p->sentUs = nowUs();
+      }
+      break;
+    case CAP_CLOSE:
+      if (c->sd < 0)
+        break;
+      //count what already came, echoes still owed never will
+      c->closing = 1;
+      readConn(c);
+      closeIfDone(c);
+      break;
+  }
+}
+
+/*
+ * Function: queueOut
+ * -------------------
+ * adds bytes to a connection's output, written by the next flushDirty
+ *
+ * *c:     connection to write to
+ * *data:  bytes to send
+ * len:    bytes in data
+ */
+void queueOut(conn *c, const char *data, uint16_t len) {
+  if (c->outLen + len > c->outCap) {
+    uint32_t cap = c->outCap ? c->outCap * 2 : 4096;
+    while (cap < c->outLen + len)
+      cap *= 2;
+    char *grown = realloc(c->out, cap);
+    if (grown == NULL) {
+      fprintf(stderr, "Error: out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+    c->out = grown;
+    c->outCap = cap;
+  }
+  memcpy(c->out + c->outLen, data, len);
+  c->outLen += len;
+  bytesSent += len;
+  if (!c->dirty) {
+    c->dirty = 1;
+    c->nextDirty = NULL;
+    *dirtyTail = c;
+    dirtyTail = &c->nextDirty;
+  }
+}
+
+/*
+ * Function: flushDirty
+ * -------------------
+ * writes what was queued since the last call, fields played
+ * together go out together
+ */
+void flushDirty() {
+  while (dirtyList != NULL) {
+    conn *c = dirtyList;
+    dirtyList = c->nextDirty;
+    if (dirtyList == NULL)
+      dirtyTail = &dirtyList;
+    c->dirty = 0;
+    if (c->sd >= 0)
+      flushOut(c);
+  }
+}
+
+/*
+ * Function: flushOut
+ * -------------------
+ * writes as much of a connection's output as the socket takes,
+ * waiting for EPOLLOUT for the rest
+ *
+ * *c:  connection with bytes to write
+ */
+void flushOut(conn *c) {
+  struct epoll_event ev;
+  int n = 0;
+  if (c->outLen > 0)
+    n = send(c->sd, c->out, c->outLen, MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (n < 0 && errno != EAGAIN && errno != EINTR) {
+    dropConn(c);
+    return;
+  }
+  if (n > 0) {
+    c->outLen -= n;
+    memmove(c->out, c->out + n, c->outLen);
+  }
+  if (c->outLen == 0 && c->closing) {
+    dropConn(c);
+    return;
+  }
+  ev.events = c->outLen > 0 ? EPOLLIN | EPOLLOUT : EPOLLIN;
+  ev.data.ptr = c;
+  epoll_ctl(epfd, EPOLL_CTL_MOD, c->sd, &ev);
+}
+
+/*
+ * Function: drain
+ * -------------------
+ * handles whatever the sockets are ready for
+ *
+ * waitms:  how long epoll_wait may block
+ */
+void drain(int waitms) {
+  struct epoll_event evs[MAXEVENTS];
+  int n = epoll_wait(epfd, evs, MAXEVENTS, waitms);
+  for (int i = 0; i < n; i++) {
+    conn *c = evs[i].data.ptr;
+    if (c->sd >= 0 && (evs[i].events & EPOLLOUT))
+      flushOut(c);
+    if (c->sd >= 0 && (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+      readConn(c);
+  }
+}
+
+/*
+ * Function: readConn
+ * -------------------
+ * reads from a connection, follows the handshake answers and hands
+ * every message after them to takeMessage
+ *
+ * *c:  connection that is readable
+ */
+void readConn(conn *c) {
+  int gone = readAll(c->sd, &c->r) < 0;
+  char *frame;
+  uint32_t len;
+  //until a name or resume is taken the server answers in single bytes
+  while (c->in != IN_FRAMES && c->r.start < c->r.len) {
+    char b = c->r.data[c->r.start++];
+    if (c->in == IN_GREET && b != 'Y')
+      rejected++;
+    if (c->in == IN_VERSION)
+      c->proto = b;
+    if (c->in == IN_SHAKE && b == 'Y')
+      c->in = IN_FRAMES;
+    else
+      c->in = c->in == IN_SHAKE && b == HELLOACK ? IN_VERSION : IN_SHAKE;
+  }
+  while (c->in == IN_FRAMES && (frame = nextFrame(&c->r, c->proto, &len)) != NULL) {
+    if (c->proto == PROTO_V1) {
+      takeMessage(c, 0, NULL, 0, frame, len);
+      continue;
+    }
+    //a container holds typed messages back to back
+    for (uint32_t pos = 0; pos + sizeof(typedHdr) <= len; ) {
+      typedHdr h;
+      memcpy(&h, frame + pos, sizeof(h));
+      uint32_t size = sizeof(h) + h.nameLen + ntohs(h.bodyLen);
+      if (pos + size > len)
+        break;
+      takeMessage(c, h.op, frame + pos + sizeof(h), h.nameLen, frame + pos + sizeof(h) + h.nameLen, ntohs(h.bodyLen));
+      pos += size;
+    }
+  }
+  if (gone) {
+    hungUp++;
+    dropConn(c);
+  }
+}
+
+/*
+ * Function: takeMessage
+ * -------------------
+ * counts a message into the connection's output digest and
+ * checks whether it is the echo of something the connection sent,
+ * joins, leaves and rosters are counted but not compared, and
+ * and neither is anything near an edge of it, or of the sender
+ *
+ * *c:     connection it arrived on
+ * op:     v2 opcode, 0 for a v1 message
+ * *name:  v2 name, NULL for v1
+ * nameLen: bytes in name
+ * *body:  v1 text or v2 body
+ * len:    bytes in body
+ */
+void takeMessage(conn *c, uint8_t op, const char *name, uint8_t nameLen, const char *body, uint32_t len) {
+  int said = op == 0 ? len > 0 && (body[0] == '>' || body[0] == '*') :
+             op == OP_CHAT || op == OP_ACTION || op == OP_PRIVATE;
+  received++;
+  //chat, actions and private messages come back to their sender
+  if (said)
+    matchEcho(c, body, len);
+  //who comes and goes races with the closes of the trace, compare what is said
+  if (op == 0 ? len == 0 || body[0] == '%' || (len >= 5 && memcmp(body, "User ", 5) == 0) :
+      op == OP_NOTICE || op == OP_ROSTER || op == OP_ROSTERADD || op == OP_ROSTERDEL)
+    return;
+  //whether a message arrives is a race when we, or its sender, had just
+  //connected or were about to leave, it is only compared away from those.
+  //what the server says on its own answers what was just played
+  sent *s = said ? findSent(op, body, len) : NULL;
+  uint64_t us = s != NULL ? s->us : playedUs;
+  if (nearEdge(c, us) || (s != NULL && nearEdge(&conns[s->conn], us))) {
+    uncompared++;
+    return;
+  }
+  uint64_t h = hashBytes(14695981039346656037ULL, &op, sizeof(op));
+  h = hashBytes(h, name, nameLen);
+  //resume tokens are random, only that one came counts
+  c->digest += hashBytes(h, body, op == OP_SESSION ? 0 : len);
+  c->frames++;
+}
+
+/*
+ * Function: matchEcho
+ * -------------------
+ * takes the latency of the oldest message the text is the echo of,
+ * older messages that were passed over never got one
+ *
+ * *c:     connection the text arrived on
+ * *text:  message text, ends with what was sent
+ * len:    bytes in text
+ */
+void matchEcho(conn *c, const char *text, uint32_t len) {
+  for (uint32_t k = 0; k < c->waitLen; k++) {
+    pending *p = &c->wait[(c->waitHead + k) % MAXPENDING];
+    if (len < p->sigLen || memcmp(text + len - p->sigLen, p->sig, p->sigLen) != 0)
+      continue;
+    uint64_t lat = nowUs() - p->sentUs;
+    if (lat > latMax)
+      latMax = lat;
+    lat /= LATBUCKET;
+    latency[lat < LATBUCKETS ? lat : LATBUCKETS - 1]++;
+    echoes++;
+    unanswered += k;
+    c->waitHead = (c->waitHead + k + 1) % MAXPENDING;
+    c->waitLen -= k + 1;
+    return;
+  }
+}
+
+/*
+ * Function: closeIfDone
+ * -------------------
+ * closes a connection the trace closed once its output is written
+ *
+ * *c:  connection to check
+ */
+void closeIfDone(conn *c) {
+  if (c->sd >= 0 && c->closing && c->outLen == 0)
+    dropConn(c);
+}
+
+/*
+ * Function: dropConn
+ * -------------------
+ * closes a connection, its output digest is kept
+ *
+ * *c:  connection to close
+ */
+void dropConn(conn *c) {
+  unanswered += c->waitLen;
+  c->waitLen = 0;
+  epoll_ctl(epfd, EPOLL_CTL_DEL, c->sd, NULL);
+  close(c->sd);
+  c->sd = -1;
+  c->outLen = 0;
+  c->r.start = c->r.len = 0;
+}
+
+/*
+ * Function: hashBytes
+ * -------------------
+ * FNV-1a over some bytes
+ *
+ * h:      hash so far
+ * *data:  bytes to add
+ * len:    bytes in data
+ *
+ * returns the new hash
+ */
+uint64_t hashBytes(uint64_t h, const void *data, uint32_t len) {
+  const unsigned char *p = data;
+  for (uint32_t i = 0; i < len; i++)
+    h = (h ^ p[i]) * 1099511628211ULL;
+  return h;
+}
+
+/*
+ * Function: percentile
+ * -------------------
+ * reads a percentile off the latency histogram
+ *
+ * p:  fraction of samples at or below the answer
+ *
+ * returns latency in microseconds
+ */
+uint64_t percentile(double p) {
+  uint64_t total = 0, seen = 0;
+  for (int i = 0; i < LATBUCKETS; i++)
+    total += latency[i];
+  for (int i = 0; i < LATBUCKETS; i++) {
+    seen += latency[i];
+    if (seen > 0 && seen >= p * total)
+      return (uint64_t)(i + 1) * LATBUCKET;
+  }
+  return 0;
+}
+
+/*
+ * Function: compareOutput
+ * -------------------
+ * compares what each connection received with an earlier run,
+ * printing the first few that differ
+ * messages are compared as a set, so the order they came in is free,
+ * and messages sent within edgeUs of their receiver or sender connecting,
+ * leaving or changing rooms are not compared at all, nor are server
+ * answers that come in that close to one. a difference
+ * means a connection got other messages than before away from those
+ * races: something was lost, duplicated, changed, or sent to the wrong
+ * people. runs at a speed above 1 or of 0 leave more to chance
+ *
+ * *path:  output file of the earlier run
+ *
+ * returns connections that differ, -1 if the file can not be read
+ */
+int compareOutput(char *path) {
+  FILE *f = fopen(path, "r");
+  unsigned long id, frames;
+  unsigned long long digest;
+  uint8_t *seen = calloc(maxConn + 1, sizeof(uint8_t));
+  int diffs = 0;
+  if (f == NULL || seen == NULL) {
+    fprintf(stderr, "Error: can not read %s\n", path);
+    return -1;
+  }
+  while (fscanf(f, "%lu %lu %llx", &id, &frames, &digest) == 3) {
+    int same = id <= maxConn && conns[id].frames == frames && conns[id].digest == digest;
+    if (id <= maxConn)
+      seen[id] = 1;
+    if (same)
+      continue;
+    if (diffs++ < MAXDIFFS)
+      printf("differs:     connection %lu, %lu messages before, %lu now\n", id,
+             frames, id <= maxConn ? (unsigned long)conns[id].frames : 0);
+  }
+  //connections the earlier run did not have differ too
+  for (uint32_t i = 1; i <= maxConn; i++)
+    if (!seen[i] && conns[i].frames > 0 && diffs++ < MAXDIFFS)
+      printf("differs:     connection %u, not in %s\n", i, path);
+  fclose(f);
+  free(seen);
+  return diffs;
+}
+
+/*
+ * Function: writeOutput
+ * -------------------
+ * saves what each connection received, for -b of a later run
+ *
+ * *path:  file to write
+ */
+void writeOutput(char *path) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    fprintf(stderr, "Error: can not write %s\n", path);
+    return;
+  }
+  for (uint32_t i = 1; i <= maxConn; i++)
+    if (conns[i].frames > 0)
+      fprintf(f, "%u %lu %016llx\n", i, (unsigned long)conns[i].frames, (unsigned long long)conns[i].digest);
+  fclose(f);
+}
+
+/*
+ * Function: report
+ * -------------------
+ * prints the results, the RESULT line is meant for comparing runs
+ *
+ * playSecs:   how long playing the trace took
+ * traceSecs:  how long the trace was captured for
+ * diffs:      connections that differ from the baseline, -1 without one
+ */
+void report(double playSecs, double traceSecs, int diffs) {
+  printf("trace:       %lu records, %lu connections, %.1f s\n", (unsigned long)numRecs, (unsigned long)maxConn, traceSecs);
+  printf("replayed:    %lu records, %lu bytes in %.2f s, %.0f records/s, %.1fx\n", (unsigned long)replayed,
+         (unsigned long)bytesSent, playSecs, replayed / playSecs, playSecs > 0 ? traceSecs / playSecs : 0);
+  printf("connections: %lu opened, %lu failed, %lu rejected, %lu hung up, %lu fields skipped\n", (unsigned long)opened,
+         (unsigned long)failed, (unsigned long)rejected, (unsigned long)hungUp, (unsigned long)skipped);
+  printf("received:    %lu msgs, %.0f msgs/s\n", (unsigned long)received, received / playSecs);
+  printf("latency us:  p50 %lu  p99 %lu  p999 %lu  max %lu  (%lu echoes, %lu unanswered)\n", (unsigned long)percentile(0.50),
+         (unsigned long)percentile(0.99), (unsigned long)percentile(0.999), (unsigned long)latMax,
+         (unsigned long)echoes, (unsigned long)unanswered);
+  if (diffs >= 0)
+    printf("output:      %d connections differ from the baseline, %lu msgs near a join or leave not compared\n",
+           diffs, (unsigned long)uncompared);
+  printf("RESULT records=%lu records_per_s=%.0f received_per_s=%.0f p50_us=%lu p99_us=%lu p999_us=%lu unanswered=%lu diffs=%d\n",
+         (unsigned long)replayed, replayed / playSecs, received / playSecs, (unsigned long)percentile(0.50),
+         (unsigned long)percentile(0.99), (unsigned long)percentile(0.999), (unsigned long)unanswered, diffs);
+}
@@ -0,0 +1,124 @@
+/* room.c - named rooms and their member lists
+ *
+ * every shard keeps its own rooms, holding only its own clients
+ * a message to a room is fanned out locally and mailed to the others
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../inc/server.h"
+
+static _Thread_local room *buckets[ROOMTABLE]; //rooms chained by hash
+static _Thread_local pool roomPool = {"room", sizeof(room)};
+
+/*
+ * Function: roomHash
+ * -------------------
+ * FNV-1a hash of a room name
+ *
+ * name:  room name to hash
+ *
+ * returns the bucket the room goes in
+ */
+static uint32_t roomHash(const char *name) {
+  uint32_t h = 2166136261u;
+  while (*name) {
+    h ^= (uint8_t)*name++;
+    h *= 16777619u;
+  }
+  return h & (ROOMTABLE - 1);
+}
+
+/*
+ * Function: roomFind
+ * -------------------
+ * look up one of this shard's rooms
+ *
+ * name:  room name
+ *
+ * returns the room, NULL if no local client is in it
+ */
+room* roomFind(const char *name) {
+  room *r = buckets[roomHash(name)];
+  while (r != NULL && strcmp(r->name, name) != 0)
+    r = r->next;
+  return r;
+}
+
+/*
+ * Function: roomFree
+ * -------------------
+ * unlink an empty room from its bucket and give it back
+ *
+ * *r:  room with no members left
+ */
+static void roomFree(room *r) {
+  room **pr = &buckets[roomHash(r->name)];
+  while (*pr != r)
+    pr = &(*pr)->next;
+  *pr = r->next;
+  free(r->members);
+  poolPut(r);
+}
+
+/*
+ * Function: roomJoin
+ * -------------------
+ * move a client into a room, creating the room if this shard
+ * has nobody in it yet, the client leaves its old room first
+ *
+ * *user:  client joining
+ * name:   room name, at most NAMELENGTH characters
+ *
+ * returns 0 on success, -1 if out of memory
+ */
+int roomJoin(client *user, const char *name) {
+  room *r = roomFind(name);
+  if (r != NULL && r == user->room)
+    return 0;
+  if (r == NULL) {
+    if ((r = poolGet(&roomPool)) == NULL)
+      return -1;
+    memset(r, 0, sizeof(room));
+    strncpy(r->name, name, NAMELENGTH);
+    uint32_t b = roomHash(r->name);
+    r->next = buckets[b];
+    buckets[b] = r;
+  }
+  if (r->numMembers == r->cap) {
+    int cap = r->cap ? r->cap * 2 : 8;
+    client **grown = realloc(r->members, cap * sizeof(client*));
+    if (grown == NULL) {
+      if (r->numMembers == 0)
+        roomFree(r);
+      return -1;
+    }
+    r->members = grown;
+    r->cap = cap;
+  }
+  roomLeave(user);
+  user->room = r;
+  user->roomSlot = r->numMembers;
+  r->members[r->numMembers++] = user;
+  return 0;
+}
+
+/*
+ * Function: roomLeave
+ * -------------------
+ * take a client out of its room, the last one out frees it
+ *
+ * *user:  client leaving, may be in no room
+ */
+void roomLeave(client *user) {
+  room *r = user->room;
+  if (r == NULL)
+    return;
+  user->room = NULL;
+  //move the last member into the hole
+  r->members[user->roomSlot] = r->members[--r->numMembers];
+  r->members[user->roomSlot]->roomSlot = user->roomSlot;
+  if (r->numMembers == 0)
+    roomFree(r);
+}
@@ -0,0 +1,228 @@
+/* rostertest.c - checks a new client gets the whole roster, however long */
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "../inc/clientnet.h"
+
+#define NAMELENGTH 10
+#define PREFIX "rt"        /* usernames are PREFIX + 8 digits, the longest allowed */
+#define JOINEVERY 100      /* logins between draining the connections already in */
+#define MAXEVENTS 256
+#define WAITMS 10000       /* how long a roster may take to arrive */
+
+/*
+*****************************************************************************
+** syntax:  ./rostertest [-c users] <host> <port>                           **
+*****************************************************************************
+*/
+
+void drainAll(int);
+int joinUser(char*, int, char*, int);
+int readRoster(int, int, int);
+int takeNames(char*, uint32_t, int);
+
+char *seen = NULL;     /* names of the roster already counted */
+int numUsers = 0;      /* users logged in before the checks */
+int numFrames = 0;     /* frames the roster came in */
+
+int main(int argc, char *argv[]) {
+  int want = 6000;     /* enough 10 character names to need several frames */
+  int failed = 0;
+  int epfd, opt;
+  struct rlimit rl;
+  struct epoll_event ev;
+  char name[16];
+
+  while ((opt = getopt(argc, argv, "c:")) != -1) {
+    if (opt == 'c')
+      want = atoi(optarg);
+    else
+      argc = 0;
+  }
+  if (argc - optind != 2 || want < 1 || want > 100000000) {
+    fprintf(stderr,"Error: Wrong number of arguments\n");
+    fprintf(stderr,"usage:\n");
+    fprintf(stderr,"%s [-c users] host port\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  char *host = argv[optind];
+  int port = atoi(argv[optind + 1]);
+
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+  seen = malloc(want);
+  epfd = epoll_create1(0);
+  if (seen == NULL || epfd < 0) {
+    perror("setup");
+    exit(EXIT_FAILURE);
+  }
+
+  //everyone stays connected, the joins they are told about are read
+  //and thrown away so the server has no reason to drop anything
+  for (int i = 0; i < want; i++) {
+    snprintf(name, sizeof(name), PREFIX "%08d", i);
+    int sd = joinUser(host, port, name, PROTO_V1);
+    if (sd < 0) {
+      fprintf(stderr, "FAIL: %s was not let in\n", name);
+      exit(EXIT_FAILURE);
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = sd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, sd, &ev);
+    numUsers++;
+    if (numUsers % JOINEVERY == 0)
+      drainAll(epfd);
+  }
+  drainAll(epfd);
+
+  for (int proto = PROTO_V1; proto <= PROTO_V2; proto++) {
+    snprintf(name, sizeof(name), "rtjoin%d", proto);
+    int sd = joinUser(host, port, name, proto);
+    int got = sd < 0 ? -1 : readRoster(sd, proto, epfd);
+    printf("v%d roster: %d of %d names in %d frames\n", proto, got, numUsers, numFrames);
+    if (got != numUsers || numFrames < 2) {
+      printf("FAIL: v%d joiner did not get the whole roster\n", proto);
+      failed = 1;
+    }
+    if (sd >= 0)
+      close(sd);
+  }
+  if (!failed)
+    printf("PASS\n");
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Function: drainAll
+ * -------------------
+ * reads and throws away whatever the held connections have waiting
+ *
+ * epfd:  epoll instance with every held connection
+ */
+void drainAll(int epfd) {
+  struct epoll_event evs[MAXEVENTS];
+  char buf[65536];
+  int n;
+  while ((n = epoll_wait(epfd, evs, MAXEVENTS, 0)) > 0)
+    for (int i = 0; i < n; i++)
+      while (recv(evs[i].data.fd, buf, sizeof(buf), MSG_DONTWAIT) > 0);
+}
+
+/*
+ * Function: joinUser
+ * -------------------
+ * connects and logs in, leaving the socket non-blocking
+ *
+ * *host:  server to connect to
+ * port:   port it listens on
+ * *name:  username to take
+ * proto:  PROTO_V1 or PROTO_V2
+ *
+ * returns the connected socket, -1 if the server turned it away
+ */
+int joinUser(char *host, int port, char *name, int proto) {
+  char valid = 0;
+  int sd = openSocket(host, port);
+  //logins are one at a time, a delayed ack on each would add up
+  setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+  if (recv(sd, &valid, sizeof(valid), MSG_WAITALL) != sizeof(valid) || valid != 'Y'
+      || (proto == PROTO_V2 && sendHello(sd) != PROTO_V2)
+      || sendName(sd, name, strlen(name)) != 'Y') {
+    close(sd);
+    return -1;
+  }
+  fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK);
+  return sd;
+}
+
+/*
+ * Function: readRoster
+ * -------------------
+ * reads a new client's roster the way the client takes it: the first
+ * part replaces the list, the rest add to it
+ *
+ * sd:     socket of the client that just logged in
+ * proto:  PROTO_V1 or PROTO_V2
+ * epfd:   held connections, drained while waiting
+ *
+ * returns the number of test users the roster held
+ */
+int readRoster(int sd, int proto, int epfd) {
+  reader r = {NULL, 0, 0, 0};
+  struct pollfd pfd = {sd, POLLIN, 0};
+  int found = 0;
+  uint32_t len;
+  char *msg;
+  numFrames = 0;
+  while (found < numUsers && poll(&pfd, 1, WAITMS) > 0) {
+    if (readAll(sd, &r) < 0)
+      break;
+    while ((msg = nextFrame(&r, proto, &len)) != NULL) {
+      char *end = msg + len;
+      if (proto == PROTO_V1) {
+        //"%" starts the list, "%+" is a join or more of the list
+        if (len > 0 && msg[0] == '%') {
+          int more = len > 1 && msg[1] == '+';
+          found = takeNames(msg + 1 + more, len - 1 - more, more ? found : 0);
+          numFrames++;
+        }
+        continue;
+      }
+      while (msg + sizeof(typedHdr) <= end) {
+        typedHdr h;
+        memcpy(&h, msg, sizeof(h));
+        char *body = msg + sizeof(h) + h.nameLen;
+        uint16_t bodyLen = ntohs(h.bodyLen);
+        if (h.op == OP_ROSTER || (h.op == OP_ROSTERADD && h.nameLen == 0)) {
+          found = takeNames(body, bodyLen, h.op == OP_ROSTER ? 0 : found);
+          numFrames++;
+        }
+        msg = body + bodyLen;
+      }
+    }
+    drainAll(epfd);
+  }
+  free(r.data);
+  return found;
+}
+
+/*
+ * Function: takeNames
+ * -------------------
+ * counts the test users in part of a roster that were not seen yet
+ *
+ * *list:  " name\n" lines
+ * len:    bytes of list
+ * found:  names seen so far, 0 starts the roster over
+ *
+ * returns names seen with this part
+ */
+int takeNames(char *list, uint32_t len, int found) {
+  static char copy[UINT16_MAX + 1];
+  if (found == 0)
+    memset(seen, 0, numUsers);
+  memcpy(copy, list, len);
+  copy[len] = 0;
+  for (char *name = strtok(copy, " \n"); name != NULL; name = strtok(NULL, " \n")) {
+    if (strlen(name) != NAMELENGTH || strncmp(name, PREFIX, strlen(PREFIX)) != 0)
+      continue;
+    int i = atoi(name + strlen(PREFIX));
+    if (i >= 0 && i < numUsers && !seen[i]) {
+      seen[i] = 1;
+      found++;
+    }
+  }
+  return found;
+}
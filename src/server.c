@@ -1,5 +1,7 @@
 /* server.c - network multiplayer chatroom TCP */
 
+#define _GNU_SOURCE  //for accept4
+
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -9,52 +11,240 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <errno.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <endian.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
 #include "../inc/server.h"
 
-#define QLEN 6 /* size of request queue */
+#define QLEN 4096 /* default size of request queue, -Q changes it, somaxconn caps it */
+#define MAXEVENTS 64 /* ready events handled per epoll_wait */
 
 /*
 *****************************************************************************
-** syntax:  ./server <part port>                                           **
+** syntax:  ./server [-t threads] [-q bytes] [-p drop|disconnect|pause]    **
+**                   [-b batch_ms] [-u] [-m metrics_port]                  **
+**                   [-l error|warn|info|debug] [-c max_clients]           **
+**                   [-d history_dir] [-r replay_count] [-g grace_s]       **
+**                   [-R msgs_per_s[:bytes_per_s]] [-H handover_socket]    **
+**                   [-F peer_port] [-A peer_addr] [-K secret_file]        **
+**                   [-P host:port]... [-Q backlog] [-C trace_file]        **
+**                   <part port>                                           **
 *****************************************************************************
  */
-char isValidName(char*, int);
+char isValidName(char*);
 void startServer(int);
 int openSocket(struct sockaddr_in,int, int);
-void getConnectedUsers(int*, fd_set*, struct timeval);
+void handshakeExpired(timer*);
 void addUser(int);
-void print();
 void deleteUser(client*);
-void newParticipant(int);
-void sendToAllClients(char*);
-void participantActions(int, fd_set);
-void sendPrivate(char*, uint16_t, client*);
-void sendListOfNames();
+void sendToRoom(const char*, msgbuf*);
+void roomBroadcast(room*, msgbuf*);
+void changeRoom(client*, char*);
+void localBroadcast(msgbuf*, client*);
+void participantActions(client*);
+int handleName(client*, char*, uint8_t);
+int handleResume(client*, uint64_t, uint64_t);
+void holdExpired(timer*);
+void leaveHeld(const session*);
+void kickUser(client*);
+int takeTokens(client*, uint32_t);
+void throttleUser(client*, uint32_t);
+void throttleExpired(timer*);
+int handleMessage(client*, char*);
+void handleTyped(client*, uint8_t, char*, char*);
+void sayInRoom(client*, uint8_t, char*);
+void sendPrivate(client*, const char*, const char*);
+void sendRoster(client*);
+void sendRosterChange(char, const char*, client*);
+void queueMessage(client*, msgbuf*);
+void flushQueue(client*);
+void trimQueue(client*);
+void updateEvents(client*);
+void closeDoomed();
+void markDirty(client*);
+int batchWait();
+void flushDirty();
+void freeDeleted();
+void handoverShard();
+void adoptClients();
+void acceptBatch(int);
+void pauseAccepts();
+void resumeAccepts(timer*);
 
-client *pset = NULL;       //array of participant clients
-client *lowestTime = NULL; //pointer to client with lowest time
-int numParts = 0;          //number of connected participants
+//each shard owns its clients, epoll instance and close list
+_Thread_local client **live = NULL;      //connected clients, packed at the front
+_Thread_local int numParts = 0;          //number of connected participants
+_Thread_local int numThrottled = 0;      //clients waiting for their token buckets
+_Thread_local int liveCap = 0;           //room in live before it has to grow
+_Thread_local int epfd = -1;             //epoll instance all sockets are registered with
+_Thread_local client *closeList = NULL;  //clients to disconnect at the end of the pass
+_Thread_local client *dirtyList = NULL;  //clients with frames held for the batch
+_Thread_local int numDirty = 0;          //entries in dirtyList
+_Thread_local client *freeList = NULL;   //deleted clients, freed at the end of the pass
+_Thread_local long batchStart = 0;       //when the oldest held frame was queued, in ms
+_Thread_local int handingOver = 0;       //a new process asked for our clients
+_Thread_local int listenSd = -1;         //this shard's listener
+_Thread_local int reserveFd = -1;        //spare descriptor, given up to shed a connection
+_Thread_local timer acceptTimer;         //resumes accepting after a pause
+_Thread_local pool outmsgPool = {"outmsg", sizeof(outmsg)}; //queue entries
+_Thread_local pool clientPool = {"client", sizeof(client)}; //hot client records
+_Thread_local pool coldPool = {"client_cold", sizeof(clientCold)}; //cold client records
+_Thread_local pool holdPool = {"hold", sizeof(hold)};    //grace timers of held sessions
+int maxClients = MAXCLIENT;     //connected clients allowed per shard
+uint32_t highWater = HIGHWATER; //outbound queue limit per client
+int slowPolicy = POLICY_DROP;   //what to do when a client passes highWater
+int batchDelay = -1;            //ms frames may be held for batching, -1 sends at once
+uint32_t nextUserId = 0;        //last user id handed out, ids are never reused
+uint32_t msgRate = 0;           //messages a client may send a second, 0 for no limit
+uint32_t byteRate = 0;          //message bytes a client may send a second, 0 for no limit
+char *handoverPath = NULL;      //unix socket a new process takes over through, NULL for none
+int listenQueue = QLEN;         //listen backlog of every listener
+char *capturePath = NULL;       //trace file inbound traffic is recorded to, NULL for none
 
 int main(int argc, char **argv) {
   struct sockaddr_in sad; /* structure to hold server's address */
-  int Psd; /* socket descriptors */
+  int Psd[MAXSHARDS]; /* socket descriptors, one per shard */
+  int threads = 1; /* number of reactor threads */
   uint16_t particpant_port; /* protocol port number */
   int optval = 1; /* boolean value when we set socket option */
+  int metricsPort = 0; /* 0 leaves the metrics endpoint off */
+  int limit = MAXCLIENT; /* connected clients across all shards */
+  char *histDir = NULL; /* NULL keeps no history */
+  int taken = 0; /* listeners handed over by the process we replace */
+  struct rlimit rl;
+  int opt;
 
-  if( argc != 2 ) {
+  while ((opt = getopt(argc, argv, "t:q:p:b:um:l:c:d:r:g:R:H:F:A:K:P:Q:C:")) != -1) {
+    switch (opt) {
+      case 'H':
+        handoverPath = optarg;
+        break;
+      case 'F':
+        peerPort = atoi(optarg);
+        break;
+      case 'A':
+        peerBind = optarg;
+        break;
+      case 'K':
+        if (peerSecret(optarg) < 0) {
+          fprintf(stderr, "Error: Can not read a peer secret from %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'Q':
+        listenQueue = atoi(optarg);
+        break;
+      case 'C':
+        capturePath = optarg;
+        break;
+      case 'P':
+        if (peerAdd(optarg) < 0)
+          argc = 0;
+        break;
+      case 'd':
+        histDir = optarg;
+        break;
+      case 'r':
+        historyDepth = atoi(optarg);
+        break;
+      case 'g':
+        resumeGrace = atoi(optarg);
+        break;
+      case 'R': {
+        //messages a second, optionally followed by bytes a second
+        char *bytes = strchr(optarg, ':');
+        msgRate = atoi(optarg);
+        byteRate = bytes != NULL ? atoi(bytes + 1) : 0;
+        break;
+      }
+      case 'c':
+        limit = atoi(optarg);
+        break;
+      case 'l':
+        if ((logLevel = logParseLevel(optarg)) < 0)
+          argc = 0;
+        break;
+      case 'm':
+        metricsPort = atoi(optarg);
+        break;
+      case 'u':
+        useUring = 1;
+        break;
+      case 'b':
+        batchDelay = atoi(optarg);
+        break;
+      case 't':
+        threads = atoi(optarg);
+        break;
+      case 'q':
+        highWater = atoi(optarg);
+        break;
+      case 'p':
+        if (strcmp(optarg, "drop") == 0)
+          slowPolicy = POLICY_DROP;
+        else if (strcmp(optarg, "disconnect") == 0)
+          slowPolicy = POLICY_DISCONNECT;
+        else if (strcmp(optarg, "pause") == 0)
+          slowPolicy = POLICY_PAUSE;
+        else
+          argc = 0;
+        break;
+      default:
+        argc = 0;
+    }
+  }
+  if( argc - optind != 1 || highWater == 0 || limit < 1 || historyDepth < 0 || historyDepth > 1000 || resumeGrace < 0 || resumeGrace > 3600 || peerPort < 0 || peerPort > 65535 || listenQueue < 1 || msgRate > 1000000 || byteRate > 1000000000 || threads < 1 || threads > MAXSHARDS ) {
     fprintf(stderr,"Error: Wrong number of arguments\n");
     fprintf(stderr,"usage:\n");
-    fprintf(stderr,"%s client_port \n", argv[0]);
+    fprintf(stderr,"%s [-t threads] [-q queue_bytes] [-p drop|disconnect|pause] [-b batch_ms] [-u] [-m metrics_port] [-l error|warn|info|debug] [-c max_clients] [-d history_dir] [-r replay_count] [-g grace_s] [-R msgs_per_s[:bytes_per_s]] [-H handover_socket] [-F peer_port] [-A peer_addr] [-K secret_file] [-P host:port]... [-Q backlog] [-C trace_file] client_port \n", argv[0]);
     exit(EXIT_FAILURE);
   }
-  particpant_port = atoi(argv[1]);
+  particpant_port = atoi(argv[optind]);
   if (particpant_port < 0 || particpant_port > 65535) {
     fprintf(stderr,"Error: Bad participant port number %d\n",particpant_port);
     exit(EXIT_FAILURE);
   }
-  Psd = openSocket(sad, optval, particpant_port);
-  startServer(Psd);
+  //io_uring needs a recent kernel, fall back to epoll without it
+  if (useUring && uringProbe() < 0) {
+    fprintf(stderr, "io_uring unavailable, using epoll\n");
+    useUring = 0;
+  }
+  //every client is a descriptor, the default limit is far too low
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+  logStart();
+  //a server already running on the same handover socket gives us its
+  //listeners and clients, more shards than listeners could not be bound
+  if (handoverPath != NULL && (taken = handoverTake(handoverPath, Psd, threads)) < 0)
+    taken = 0;
+  if (taken > 0 && taken < threads) {
+    LOG(LOG_WARN, "took over %d listeners, running %d shards instead of %d", taken, taken, threads);
+    threads = taken;
+  }
+  //every shard gets its own listener, the kernel spreads connections
+  numShards = threads;
+  maxClients = (limit + threads - 1) / threads;
+  if (histDir != NULL && historyStart(histDir, taken > 0) < 0) {
+    fprintf(stderr, "Error: can not keep history in %s\n", histDir);
+    exit(EXIT_FAILURE);
+  }
+  if (capturePath != NULL && captureStart(capturePath) < 0) {
+    fprintf(stderr, "Error: can not write the trace %s\n", capturePath);
+    exit(EXIT_FAILURE);
+  }
+  if (metricsPort > 0)
+    statsServe(metricsPort);
+  for (int i = taken; i < threads; i++)
+    Psd[i] = openSocket(sad, optval, particpant_port);
+  startShards(Psd, threads, startServer);
 }
 
 /*
@@ -65,55 +255,217 @@ int main(int argc, char **argv) {
  * Psd:  fd for client connections
   */
 void startServer(int Psd) {
-  int sock;
-  struct sockaddr_in pad;
-  pset = calloc(MAXCLIENT,sizeof(client));
-  lowestTime = (client*)calloc(1, sizeof(client));  //only need one pointer
-  int retval;                    //select return value
-  fd_set rfds;                   //set of fds for select
-  struct timeval elapsedTime;    //stores elapsed time since last Select
-  struct timeval tv;             //timeval for select
-  elapsedTime.tv_sec = 0;
-  elapsedTime.tv_usec = 0;
-  unsigned int alen = sizeof(pad);
+  int retval;                        //epoll_wait return value
+  int waitms;                        //epoll_wait timeout, -1 blocks
+  struct epoll_event ev;             //registration for the listener
+  struct epoll_event evs[MAXEVENTS]; //ready events from epoll_wait
+
+  timerInit();
+  statsInit(myShard);
+  listenSd = Psd;
+  //held back so a connection can still be turned away once we run out
+  reserveFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  //the federation shares the shards' mailboxes, they exist now
+  if (myShard == 0)
+    peerStart();
+  if (useUring) {
+    if (uringInit(Psd) < 0) {
+      fprintf(stderr, "Error: io_uring setup failed\n");
+      exit(EXIT_FAILURE);
+    }
+    adoptClients();
+    uringLoop();
+    return;
+  }
+  if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    perror("epoll_create1()");
+    exit(EXIT_FAILURE);
+  }
+  //the listener and mailbox are the only registrations without a client
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, Psd, &ev) < 0) {
+    perror("epoll_ctl()");
+    exit(EXIT_FAILURE);
+  }
+  ev.data.ptr = &shards[myShard].box;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, shards[myShard].box.efd, &ev) < 0) {
+    perror("epoll_ctl()");
+    exit(EXIT_FAILURE);
+  }
+  adoptClients();
   //keep the server alive
   while (1) {
-    int maxfd = Psd;
-    FD_ZERO(&rfds);
-    FD_SET(Psd, &rfds);
-    //handle timeouts and get currently connected clients
-    getConnectedUsers(&maxfd, &rfds, elapsedTime);
-    dprintf(1, "parts: %d\n", numParts);
-    print();
-    //run select with the lowest time
-    tv = lowestTime->timeout;
-    //If time is "0", there are no timeouts - block on select
-    if (!timerisset(&tv)) {
-      retval = select(maxfd + 1, &rfds, NULL, NULL, NULL);
-    }
-    else {
-      retval = select(maxfd + 1, &rfds, NULL, NULL, &tv);
-    }
-    timersub(&lowestTime->timeout,&tv,&elapsedTime);
+    //handle timeouts and get the time until the next one fires
+    waitms = passTimeout();
+    retval = epoll_wait(epfd, evs, MAXEVENTS, waitms);
     if (retval == -1) {
-      perror("select()");
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait()");
       break;
+    }
+    statsPassStart();
     //timeouts are handled at the top of the while loop
-    } else if (retval == 0) {
-      continue;
-    } else {
-      if (FD_ISSET(Psd, &rfds)) {
-        if ((sock=accept(Psd, (struct sockaddr *)&pad, &alen)) < 0) {
-          fprintf(stderr, "Error: Accept failed\n");
-          exit(EXIT_FAILURE);
-        }
-        dprintf(1, "New Participant\n");
-        newParticipant(sock);
+    for (int i = 0; i < retval; i++) {
+      if (evs[i].data.ptr == NULL) {
+        acceptBatch(Psd);
+      } else if (evs[i].data.ptr == &shards[myShard].box) {
+        deliverMail();
       } else {
-        participantActions(sock, rfds);
+        client *user = evs[i].data.ptr;
+        if (evs[i].events & EPOLLOUT)
+          flushQueue(user);
+        if (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+          participantActions(user);
       }
     }
+    endPass();
+    if (handingOver)
+      handoverShard();
+  }
+}
+
+/*
+ * Function: passTimeout
+ * -------------------
+ * start of a loop pass: fire due timers
+ *
+ * returns ms the loop may sleep, -1 to block until something happens
+ */
+int passTimeout() {
+  int waitms = timerRun();
+  //held frames are due before the next timer
+  int batch = batchWait();
+  if (batch >= 0 && (waitms < 0 || batch < waitms))
+    waitms = batch;
+  return waitms;
+}
+
+/*
+ * Function: endPass
+ * -------------------
+ * end of a loop pass: drop doomed clients and send batched frames
+ */
+void endPass() {
+  closeDoomed();
+  flushDirty();
+  freeDeleted();
+  if (captureFd >= 0)
+    captureFlush();
+  STAT_SET(clients, numParts);
+  STAT_SET(throttled, numThrottled);
+  statsPassEnd();
+}
+
+/*
+ * Function: acceptBatch
+ * -------------------
+ * drain the listener's queue, up to ACCEPTBUDGET connections so a
+ * reconnect storm can not starve the clients already here. the
+ * listener stays ready while connections are left, the next pass
+ * takes more. nothing an accept can fail with stops the server
+ *
+ * listener:  the shard's listening socket
+ */
+void acceptBatch(int listener) {
+  for (int n = 0; n < ACCEPTBUDGET; n++) {
+    int sock = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (sock >= 0) {
+      LOG(LOG_DEBUG, "New Participant");
+      newParticipant(sock);
+      continue;
+    }
+    switch (errno) {
+      case EAGAIN:
+        return;
+      //the connection died in the queue, or a signal came
+      case EINTR:
+      case ECONNABORTED:
+      case EPROTO:
+        STAT_ADD(acceptErrors, 1);
+        break;
+      case EMFILE:
+      case ENFILE:
+        switch (shedConnection(listener)) {
+          case 1:
+            return;
+          case -1:
+            pauseAccepts();
+            return;
+        }
+        break;
+      default:
+        //out of buffers or memory, give the system a moment
+        STAT_ADD(acceptErrors, 1);
+        LOG(LOG_WARN, "accept failed: %s", strerror(errno));
+        pauseAccepts();
+        return;
+    }
+  }
+  STAT_ADD(acceptBudgetHits, 1);
+}
+
+/*
+ * Function: shedConnection
+ * -------------------
+ * out of descriptors: give up the reserve to accept one waiting
+ * connection and turn it away, rather than leave the queue full of
+ * clients that time out on their own
+ *
+ * listener:  listening socket with connections waiting
+ *
+ * returns 0 if a connection was turned away, 1 if none was waiting,
+ *         -1 if none could be
+ */
+int shedConnection(int listener) {
+  int sock;
+  int err;
+  if (reserveFd < 0) {
+    LOG(LOG_WARN, "out of descriptors, accepts paused");
+    return -1;
+  }
+  close(reserveFd);
+  sock = accept(listener, NULL, NULL);
+  err = errno;
+  if (sock >= 0) {
+    STAT_ADD(acceptShed, 1);
+    send(sock, "N", sizeof(char), MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(sock);
   }
+  reserveFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  //the queue was empty, the descriptor limit only showed up first
+  if (sock < 0 && err == EAGAIN)
+    return 1;
+  if (sock < 0)
+    LOG(LOG_WARN, "out of descriptors, accepts paused");
+  return sock >= 0 ? 0 : -1;
+}
+
+/*
+ * Function: pauseAccepts
+ * -------------------
+ * stop watching the listener for ACCEPTPAUSE ms, a listener that can
+ * not be drained would otherwise wake every pass
+ */
+void pauseAccepts() {
+  struct epoll_event ev = {0, {.ptr = NULL}};
+  STAT_ADD(acceptPauses, 1);
+  epoll_ctl(epfd, EPOLL_CTL_MOD, listenSd, &ev);
+  timerArm(&acceptTimer, ACCEPTPAUSE, resumeAccepts);
+}
+
+/*
+ * Function: resumeAccepts
+ * -------------------
+ * timer callback: watch the listener again after a pause
+ *
+ * *t:  the shard's acceptTimer, unused: there is only the one, but
+ *      timerArm callbacks all take the timer that fired
+ */
+void resumeAccepts(timer *t) {
+  struct epoll_event ev = {EPOLLIN, {.ptr = NULL}};
+  epoll_ctl(epfd, EPOLL_CTL_MOD, listenSd, &ev);
 }
 
 /*
@@ -126,15 +478,16 @@ void startServer(int Psd) {
  */
 void newParticipant(int sock) {
   char valid;
-  if (numParts >= MAXCLIENT) {
+  STAT_ADD(accepts, 1);
+  if (numParts >= maxClients) {
+    STAT_ADD(rejects, 1);
     valid = 'N';
-    dprintf(1, "rejected a socket because full: %d-%d\n", numParts, MAXCLIENT);
+    LOG(LOG_WARN, "rejected a socket because full: %d-%d", numParts, maxClients);
     send(sock,&valid,sizeof(char),MSG_DONTWAIT);
     close(sock);
   } else {
     valid = 'Y';
     send(sock,&valid,sizeof(char),MSG_DONTWAIT);
-    numParts++;
     addUser(sock);
   }
 }
@@ -143,147 +496,682 @@ void newParticipant(int sock) {
  * Function: participantActions
  * -------------------
  * handles all things related to participant sockets
+ * drains the socket with one large recv and then parses every
+ * complete frame in the buffer, keeping partial frames for later
  *
- * sock:  socket that was flagged by select
- * rfds:  set of fds in select
+ * *user:  client whose socket was flagged by epoll
  */
-void participantActions(int sock, fd_set rfds) {
-  char buf[MSGLENGTH+15];  //reuse the same buffer, +15 for padding messages
+void participantActions(client *user) {
   int n;
-  client *user = pset;
-  for (int i = 0; i < MAXCLIENT; i++, user++) {
-    if (user->socket < 1)
-      continue;
-    sock = user->socket;
-    if (FD_ISSET(sock, &rfds)) {
-      if (user->nameLen == 0) {
-        uint8_t nameLen;
-        n = recv(sock, &nameLen, sizeof(uint8_t), 0);
-        // client disconnected, delete them
-        if (n == 0) {
-          numParts--;
-          deleteUser(user);
-          continue;
+  int sock = user->socket;
+  //an earlier event in the same batch may have removed this client
+  if (sock < 1 || user->closing)
+    return;
+  clientCold *cold = user->cold;
+  //reads are off while throttled, only a hangup or an error gets here
+  if (user->throttled) {
+    dropUser(user);
+    return;
+  }
+  n = recv(sock, cold->inbuf + cold->inLen, INBUFSIZE - cold->inLen, 0);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return;
+  //client disconnected, hold its session or delete them
+  if (n <= 0) {
+    dropUser(user);
+    return;
+  }
+  STAT_ADD(bytesIn, n);
+  cold->inLen += n;
+  parseInput(user);
+}
+
+/*
+ * Function: parseInput
+ * -------------------
+ * handle every complete frame in a client's receive buffer
+ * and keep the partial one at the front for later
+ *
+ * *user:  client with new data in inbuf
+ */
+void parseInput(client *user) {
+  char saved;
+  int n;
+  int pos = 0;
+  int sock = user->socket;
+  clientCold *cold = user->cold;
+  //a throttled client's frames wait where they are
+  while (cold->inLen - pos >= cold->want && !user->throttled) {
+    char *field = cold->inbuf + pos;
+    //messages pay for themselves before anything is done with them
+    if ((cold->state == PARSE_BODY || cold->state == PARSE_TYPED) && !takeTokens(user, cold->want)) {
+      throttleUser(user, cold->want);
+      break;
+    }
+    //recorded before the state moves on, it says what the field is
+    if (captureFd >= 0)
+      captureField(user, field, cold->want);
+    pos += cold->want;
+    switch (cold->state) {
+      case PARSE_NAMELEN:
+        if ((uint8_t)*field == 0) {
+          LOG(LOG_DEBUG, "name = 0");
+          break;
         }
-        if (nameLen == 0) {
-          dprintf(1, "name = 0\n");
-          return;
+        //a v2 client asks for its version ahead of the name
+        if ((uint8_t)*field == HELLO) {
+          cold->state = PARSE_HELLO;
+          cold->want = sizeof(uint8_t);
+          break;
         }
-        user->nameLen = nameLen;
-        n = recv(sock, &buf, user->nameLen, 0);
-        buf[user->nameLen] = 0;
-        char valid = isValidName(buf, 0);
-        dprintf(1, "user: >%s< with length %d.  valid: %c\n", buf, user->nameLen, valid);
-        send(sock,&valid,sizeof(char),MSG_WAITALL);
-        switch (valid) {
-          //Invalid name
-          case 'I':
-            user->nameLen = 0;
-            break;
-          //User name was taken, reset timer
-          case 'T':
-            user->nameLen = 0;
-            user->timeout.tv_sec = TIMEOUT;
-            user->timeout.tv_usec = 0;
-            break;
-          //username is good!
-          case 'Y':
-            user->timeout.tv_sec = 0;
-            user->timeout.tv_usec = 0;
-            user->name = strdup(buf);
-            user->isActive = 1;
-            dprintf(1, "User %s has joined, len: %d", user->name, user->nameLen);
-            snprintf(buf, MSGLENGTH, "User %s has joined\n", user->name);
-            sendToAllClients(buf);
-            sendListOfNames();
-            break;
+        //and once it has one may come back to its session instead
+        if ((uint8_t)*field == RESUME && user->proto == PROTO_V2) {
+          cold->state = PARSE_RESUME;
+          cold->want = 2 * sizeof(uint64_t);
+          break;
         }
-      } else {
-        //We have a message instead of a name
+        cold->nameLen = (uint8_t)*field;
+        cold->state = PARSE_NAME;
+        cold->want = cold->nameLen;
+        break;
+      case PARSE_NAME:
+        STAT_ADD(framesIn, 1);
+        //terminate in place, the byte after the field is put back below
+        saved = field[cold->nameLen];
+        field[cold->nameLen] = 0;
+        n = handleName(user, field, cold->nameLen);
+        field[cold->want] = saved;
+        if (n && user->proto == PROTO_V2) {
+          cold->state = PARSE_TYPEDHDR;
+          cold->want = sizeof(typedHdr);
+        } else if (n) {
+          cold->state = PARSE_MSGLEN;
+          cold->want = sizeof(uint16_t);
+        } else {
+          cold->state = PARSE_NAMELEN;
+          cold->want = sizeof(uint8_t);
+        }
+        break;
+      case PARSE_MSGLEN: {
         uint16_t msgLen;
-        n = recv(sock, &msgLen, sizeof(uint16_t), 0);
+        memcpy(&msgLen, field, sizeof(uint16_t));
         msgLen = ntohs(msgLen);
-        dprintf(1, "new message, length: %d\n", msgLen);
-        //if 0, user disconnected.
+        LOG(LOG_DEBUG, "new message, length: %d", msgLen);
         //if message too big, disconnect the user ourselves
-        if ((n == 0) || (msgLen > MSGLENGTH) || (msgLen >= MSGLENGTH)) {
-          snprintf(buf, MSGLENGTH, "User %s has left", user->name);
-          sendToAllClients(buf);
-          numParts--;
-          deleteUser(user);
-          sendListOfNames();
+        if (msgLen >= MSGLENGTH) {
+          leaveUser(user);
+          return;
+        }
+        cold->state = PARSE_BODY;
+        cold->want = msgLen;
+        break;
+      }
+      case PARSE_BODY:
+        STAT_ADD(framesIn, 1);
+        saved = field[cold->want];
+        field[cold->want] = 0;
+        cold->state = PARSE_MSGLEN;
+        handleMessage(user, field);
+        field[cold->want] = saved;
+        cold->want = sizeof(uint16_t);
+        break;
+      case PARSE_HELLO: {
+        //speak the highest version both sides know
+        char ack[2] = {HELLOACK, (uint8_t)*field >= PROTO_V2 ? PROTO_V2 : PROTO_V1};
+        user->proto = ack[1];
+        msgbuf *m = rawMessage(ack, sizeof(ack));
+        queueMessage(user, m);
+        releaseMessage(m);
+        cold->state = PARSE_NAMELEN;
+        cold->want = sizeof(uint8_t);
+        break;
+      }
+      case PARSE_RESUME: {
+        uint64_t token, lastSeq;
+        STAT_ADD(framesIn, 1);
+        memcpy(&token, field, sizeof(uint64_t));
+        memcpy(&lastSeq, field + sizeof(uint64_t), sizeof(uint64_t));
+        if (handleResume(user, be64toh(token), be64toh(lastSeq))) {
+          cold->state = PARSE_TYPEDHDR;
+          cold->want = sizeof(typedHdr);
         } else {
-          memset(buf, 0, MSGLENGTH);
-          n = recv(sock, &buf, msgLen, MSG_WAITALL);
-          dprintf(1, "message: >%s<\n", buf);
-          //user lied about the length of the message, don't send it
-          if (n != msgLen) {
-            dprintf(1, "message lengths do not match\n");
-            return;
-          }
-          if (buf[0] == '@') {
-            //private message
-            sendPrivate(buf,msgLen, user);
-          } else if ((buf[0] == '\\' || buf[0] == '/') && buf[1] == 'm' && buf[2] == 'e') {
-            //action
-            char msg[MSGLENGTH+15] = {0};
-            snprintf(msg, MSGLENGTH, "*%s%s", user->name, buf+3);
-            dprintf(1, "message: >%s<\n", buf+3);
-            msg[strcspn(msg, "\n")] = 0;
-            sendToAllClients(msg);
-          } else {
-            //regular message
-            char msg[MSGLENGTH+20] = {0};
-            int pad = 10 - (user->nameLen);
-            sprintf(msg, "%c%*c%s: %s", '>', pad,' ', user->name, buf);
-            msg[strcspn(msg, "\n")] = 0;
-            sendToAllClients(msg);
-          }
+          cold->state = PARSE_NAMELEN;
+          cold->want = sizeof(uint8_t);
+        }
+        break;
+      }
+      case PARSE_TYPEDHDR: {
+        typedHdr h;
+        memcpy(&h, field, sizeof(typedHdr));
+        if (ntohs(h.bodyLen) >= MSGLENGTH) {
+          leaveUser(user);
+          return;
         }
+        cold->op = h.op;
+        cold->argLen = h.nameLen;
+        cold->state = PARSE_TYPED;
+        cold->want = h.nameLen + ntohs(h.bodyLen);
+        break;
+      }
+      case PARSE_TYPED: {
+        char arg[UINT8_MAX + 1];
+        STAT_ADD(framesIn, 1);
+        memcpy(arg, field, cold->argLen);
+        arg[cold->argLen] = 0;
+        saved = field[cold->want];
+        field[cold->want] = 0;
+        cold->state = PARSE_TYPEDHDR;
+        handleTyped(user, cold->op, arg, field + cold->argLen);
+        field[cold->want] = saved;
+        cold->want = sizeof(typedHdr);
+        break;
       }
     }
+    //sending may have cost us this client
+    if (user->socket != sock || user->closing)
+      return;
+  }
+  //keep the partial frame at the front of the buffer
+  cold->inLen -= pos;
+  memmove(cold->inbuf, cold->inbuf + pos, cold->inLen);
+}
+
+/*
+ * Function: handleName
+ * -------------------
+ * validates a requested username and completes the handshake
+ *
+ * *user:    client requesting the name
+ * buf:      the name, null terminated
+ * nameLen:  length of the name
+ *
+ * returns 1 if the name was accepted
+ */
+int handleName(client *user, char *buf, uint8_t nameLen) {
+  msgbuf *m;
+  char valid = isValidName(buf);
+  //another shard may claim the same name between the check and here
+  if (valid == 'Y' && nameInsert(buf, user, myShard) < 0)
+    valid = 'T';
+  LOG(LOG_INFO, "user: >%s< with length %d.  valid: %c", buf, nameLen, valid);
+  m = rawMessage(&valid, sizeof(char));
+  queueMessage(user, m);
+  releaseMessage(m);
+  switch (valid) {
+    //Invalid name
+    case 'I':
+      user->cold->nameLen = 0;
+      break;
+    //User name was taken, reset timer
+    case 'T':
+      user->cold->nameLen = 0;
+      timerArm(&user->cold->timeout, TIMEOUT * 1000, handshakeExpired);
+      break;
+    //username is good!
+    case 'Y':
+      timerCancel(&user->cold->timeout);
+      memcpy(user->cold->name, buf, nameLen + 1);
+      user->cold->id = __atomic_add_fetch(&nextUserId, 1, __ATOMIC_RELAXED);
+      user->isActive = 1;
+      LOG(LOG_INFO, "User %s has joined, len: %d", user->cold->name, user->cold->nameLen);
+      //v2 clients get a token to come back with if the connection drops
+      if (user->proto == PROTO_V2 && resumeGrace > 0 &&
+          (user->cold->token = sessionOpen(user->cold->name, user->cold->id)) != 0) {
+        uint64_t token = htobe64(user->cold->token);
+        m = typedMessage(OP_SESSION, 0, "", (char*)&token, sizeof(token));
+        stampMessage(m, historyLastSeq());
+        queueMessage(user, m);
+        releaseMessage(m);
+      }
+      //everyone starts out in the lobby
+      changeRoom(user, LOBBY);
+      //the full list once for the new user, a delta for everyone else
+      sendRoster(user);
+      sendRosterChange('+', user->cold->name, user);
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Function: handleResume
+ * -------------------
+ * give a held session to a client that came back for it: its name,
+ * room and whatever the room said since, without telling anyone
+ *
+ * *user:    client presenting the token
+ * token:    the session's token
+ * lastSeq:  newest message the client saw
+ *
+ * returns 1 if the session was resumed
+ */
+int handleResume(client *user, uint64_t token, uint64_t lastSeq) {
+  msgbuf *m;
+  session s;
+  clientCold *cold = user->cold;
+  char valid = 'Y';
+  if (sessionTake(token, &s) < 0) {
+    valid = 'X';
+  } else if (nameClaim(s.name, user, myShard) < 0) {
+    //the name can not be had back, nobody can come back for the session
+    sessionClose(token);
+    leaveHeld(&s);
+    valid = 'X';
+  }
+  LOG(LOG_INFO, "resume: %c", valid);
+  m = rawMessage(&valid, sizeof(char));
+  queueMessage(user, m);
+  releaseMessage(m);
+  //the client may still pick a name before its timer runs out
+  if (valid != 'Y')
+    return 0;
+  STAT_ADD(resumed, 1);
+  timerCancel(&cold->timeout);
+  cold->nameLen = strlen(s.name);
+  memcpy(cold->name, s.name, cold->nameLen + 1);
+  cold->id = s.id;
+  cold->token = token;
+  user->isActive = 1;
+  if (roomJoin(user, s.room) < 0) {
+    closeClient(user);
+    return 0;
+  }
+  m = newMessage("#%s", s.room);
+  withTyped(m, OP_ROOM, 0, "", s.room, strlen(s.room));
+  queueMessage(user, m);
+  releaseMessage(m);
+  //the roster may have changed while it was away, only it needs the list
+  sendRoster(user);
+  historyReplay(user, s.room, lastSeq);
+  return 1;
+}
+
+/*
+ * Function: handleMessage
+ * -------------------
+ * works out what a v1 text message asks for and does it
+ *
+ * *user:  client that sent the message
+ * buf:    message body, null terminated
+ *
+ * returns 0
+ */
+int handleMessage(client *user, char *buf) {
+  LOG(LOG_DEBUG, "message: >%s<", buf);
+  if (buf[0] == '@') {
+    //private message, the username runs up to the first space
+    char *msg = buf + 1 + strcspn(buf + 1, " ");
+    if (*msg != 0)
+      *(msg++) = 0;
+    sendPrivate(user, buf + 1, msg);
+    return 0;
+  }
+  //chat lines stop at the first newline
+  buf[strcspn(buf, "\n")] = 0;
+  if ((buf[0] == '\\' || buf[0] == '/') && strncmp(buf+1, "join", 4) == 0 && (buf[5] == ' ' || buf[5] == 0)) {
+    //switch rooms, the name may be given with its #
+    char *name = buf + 5 + strspn(buf + 5, " ");
+    changeRoom(user, name + (*name == '#'));
+  } else if ((buf[0] == '\\' || buf[0] == '/') && strcmp(buf+1, "part") == 0) {
+    changeRoom(user, LOBBY);
+  } else if ((buf[0] == '\\' || buf[0] == '/') && buf[1] == 'm' && buf[2] == 'e') {
+    //action
+    LOG(LOG_DEBUG, "message: >%s<", buf+3);
+    sayInRoom(user, OP_ACTION, buf + 3 + (buf[3] == ' '));
+  } else {
+    sayInRoom(user, OP_CHAT, buf);
+  }
+  return 0;
+}
+
+/*
+ * Function: handleTyped
+ * -------------------
+ * does what a v2 message asks for, the opcode says what that is
+ *
+ * *user:  client that sent the message
+ * op:     OP_*
+ * arg:    the name field, null terminated
+ * body:   the body, null terminated
+ */
+void handleTyped(client *user, uint8_t op, char *arg, char *body) {
+  LOG(LOG_DEBUG, "typed message %d: >%s< >%s<", op, arg, body);
+  switch (op) {
+    case OP_CHAT:
+    case OP_ACTION:
+      body[strcspn(body, "\n")] = 0;
+      sayInRoom(user, op, body);
+      break;
+    case OP_PRIVATE:
+      sendPrivate(user, arg, body);
+      break;
+    case OP_JOIN:
+      changeRoom(user, body + (body[0] == '#'));
+      break;
+    case OP_PART:
+      changeRoom(user, LOBBY);
+      break;
+    default:
+      LOG(LOG_DEBUG, "unknown opcode %d", op);
+  }
+}
+
+/*
+ * Function: sayInRoom
+ * -------------------
+ * send chat or an action to the user's room and keep it in the history
+ *
+ * *user:  client that said it
+ * op:     OP_CHAT or OP_ACTION
+ * text:   what was said, null terminated
+ */
+void sayInRoom(client *user, uint8_t op, char *text) {
+  msgbuf *m;
+  clientCold *cold = user->cold;
+  //the handshake reply may have cost us the room
+  if (user->room == NULL)
+    return;
+  if (op == OP_ACTION) {
+    m = newMessage("*%s %s", cold->name, text);
+  } else {
+    //regular message
+    int pad = 10 - (cold->nameLen);
+    m = newMessage("%c%*c%s: %s", '>', pad,' ', cold->name, text);
+  }
+  withTyped(m, op, cold->id, cold->name, text, strlen(text));
+  historyAppend(user->room->name, m);
+  sendToRoom(user->room->name, m);
+  releaseMessage(m);
+}
+
+/*
+ * Function: withTyped
+ * -------------------
+ * attach the v2 form of a message for the v2 clients among its receivers
+ *
+ * *m:    v1 frame, may be NULL
+ * op:    OP_*
+ * id:    user the message is from, 0 for the server
+ * name:  user it is from or about
+ * body:  v2 body, NULL to use the v1 text without a trailing newline
+ * len:   length of body
+ *
+ * returns m
+ */
+msgbuf* withTyped(msgbuf *m, uint8_t op, uint32_t id, const char *name, const char *body, int len) {
+  if (m == NULL)
+    return NULL;
+  if (body == NULL) {
+    body = m->data + FRAMEHDR;
+    len = m->len - FRAMEHDR;
+    if (len > 0 && body[len - 1] == '\n')
+      len--;
+  }
+  //a v1 frame would break a v2 client's container stream
+  if ((m->alt = typedMessage(op, id, name, body, len)) == NULL)
+    m->v1only = 1;
+  return m;
+}
+
+/*
+ * Function: leaveUser
+ * -------------------
+ * disconnect a client and tell the room if they had joined
+ *
+ * *user:  client that is leaving
+ */
+void leaveUser(client *user) {
+  msgbuf *m = NULL;
+  int wasActive = user->isActive;
+  char name[NAMELENGTH+1];
+  char roomName[NAMELENGTH+1] = "";
+  if (wasActive) {
+    if (user->cold->token != 0)
+      sessionClose(user->cold->token);
+    m = newMessage("User %s has left", user->cold->name);
+    withTyped(m, OP_NOTICE, user->cold->id, user->cold->name, NULL, 0);
+    strcpy(name, user->cold->name);
+    //the room is gone with the client if it was the last one in it
+    if (user->room != NULL)
+      strcpy(roomName, user->room->name);
+  }
+  deleteUser(user);
+  if (wasActive) {
+    if (roomName[0] != 0)
+      sendToRoom(roomName, m);
+    releaseMessage(m);
+    sendRosterChange('-', name, NULL);
   }
 }
 
+/*
+ * Function: dropUser
+ * -------------------
+ * the connection went away under a client: hold its session for a
+ * resume if it has one, the room hears nothing unless the grace
+ * period runs out. anyone else leaves right away
+ *
+ * *user:  client whose connection dropped
+ */
+void dropUser(client *user) {
+  hold *h;
+  clientCold *cold = user->cold;
+  if (!user->isActive || cold->token == 0 || user->room == NULL || (h = poolGet(&holdPool)) == NULL) {
+    leaveUser(user);
+    return;
+  }
+  STAT_ADD(held, 1);
+  LOG(LOG_INFO, "holding the session of %s", cold->name);
+  //the name stays claimed, deleting an inactive client leaves it be
+  user->isActive = 0;
+  memset(h, 0, sizeof(hold));
+  h->token = cold->token;
+  h->gen = sessionHold(cold->token, user->room->name);
+  nameHold(cold->name);
+  timerArm(&h->t, resumeGrace * 1000, holdExpired);
+  deleteUser(user);
+}
+
+/*
+ * Function: holdExpired
+ * -------------------
+ * a held session's grace period is over, unless a client took it
+ * back in the meantime its user leaves now
+ *
+ * *t:  timer of the hold
+ */
+void holdExpired(timer *t) {
+  hold *h = (hold*)((char*)t - offsetof(hold, t));
+  session s;
+  if (sessionExpire(h->token, h->gen, &s) == 0) {
+    STAT_ADD(expired, 1);
+    leaveHeld(&s);
+  }
+  poolPut(h);
+}
+
+/*
+ * Function: leaveHeld
+ * -------------------
+ * a held session ended without a resume: free its name and tell
+ * its room, and everyone else if the name was still ours
+ *
+ * *s:  the session, already out of the table
+ */
+void leaveHeld(const session *s) {
+  int ours = nameRemoveNode(s->name, 0) == 0;
+  msgbuf *m = newMessage("User %s has left", s->name);
+  withTyped(m, OP_NOTICE, s->id, s->name, NULL, 0);
+  sendToRoom(s->room, m);
+  releaseMessage(m);
+  //a name a peer took over stays on the roster
+  if (ours)
+    sendRosterChange('-', s->name, NULL);
+}
+
+/*
+ * Function: kickUser
+ * -------------------
+ * a peer server had the user's name first: disconnect it, its room
+ * here hears it leave, everyone keeps seeing the name on the roster
+ *
+ * *user:  client that lost its name
+ */
+void kickUser(client *user) {
+  clientCold *cold = user->cold;
+  msgbuf *m = newMessage("Warning: %s is taken on another server, pick another name", cold->name);
+  withTyped(m, OP_WARNING, 0, "", NULL, 0);
+  queueMessage(user, m);
+  releaseMessage(m);
+  if (user->room != NULL) {
+    room *r;
+    char name[NAMELENGTH+1];
+    strcpy(name, user->room->name);
+    roomLeave(user);
+    //only this server's members, the winner is still in the room elsewhere
+    m = newMessage("User %s has left", cold->name);
+    withTyped(m, OP_NOTICE, cold->id, cold->name, NULL, 0);
+    if ((r = roomFind(name)) != NULL)
+      roomBroadcast(r, m);
+    postAll(MAIL_ROOM, m, name);
+    releaseMessage(m);
+  }
+  if (cold->token != 0)
+    sessionClose(cold->token);
+  cold->token = 0;
+  //the name is not ours to release any more
+  user->isActive = 0;
+  closeClient(user);
+}
+
 /*
  * Function: addUser
  * -------------------
- * register a newly connected user to an array
+ * register a newly connected user in the live list
+ * the list doubles when it runs out of room
+ *
+ * register it with epoll once, for the lifetime of the connection
  *
  * socket:  socket associated with client
- * isPart:  true if client is participant
  */
 void addUser(int socket){
-  client *puser = NULL;
-    puser = pset;
-  for (int i = 0; i < MAXCLIENT; i++, puser++) {
-    if (puser->socket == 0) {
-      puser->isActive = 0;
-      puser->socket = socket;
-      puser->nameLen = 0;
-      puser->timeout.tv_sec = TIMEOUT;
-      puser->timeout.tv_usec = 0;
+  client *puser;
+  struct epoll_event ev;
+  if (numParts == liveCap) {
+    int cap = liveCap ? liveCap * 2 : 64;
+    client **grown = realloc(live, cap * sizeof(client*));
+    if (grown == NULL) {
+      close(socket);
       return;
     }
+    live = grown;
+    liveCap = cap;
+  }
+  puser = poolGet(&clientPool);
+  clientCold *cold = poolGet(&coldPool);
+  if (puser == NULL || cold == NULL) {
+    poolPut(puser);
+    poolPut(cold);
+    close(socket);
+    return;
+  }
+  memset(puser, 0, sizeof(client));
+  memset(cold, 0, offsetof(clientCold, inbuf));
+  puser->cold = cold;
+  cold->hot = puser;
+  puser->socket = socket;
+  puser->slot = numParts;
+  live[numParts++] = puser;
+  if (captureFd >= 0)
+    captureOpen(puser);
+  timerArm(&cold->timeout, TIMEOUT * 1000, handshakeExpired);
+  //start with full buckets
+  cold->msgTokens = (uint64_t)msgRate * 1000 * RATEBURST;
+  cold->byteTokens = (uint64_t)byteRate * 1000 * RATEBURST;
+  cold->refillMs = nowMs();
+  cold->state = PARSE_NAMELEN;
+  cold->want = sizeof(uint8_t);
+  //batches are already coalesced, Nagle would only add delay
+  if (batchDelay >= 0)
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+  if (useUring) {
+    uringAttach(puser);
+    return;
+  }
+  ev.events = puser->events = EPOLLIN;
+  ev.data.ptr = puser;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, socket, &ev) < 0) {
+    perror("epoll_ctl()");
+    deleteUser(puser);
   }
 }
 
 /*
  * Function: deleteUser
  * -------------------
- * remove a client from the array
+ * remove a client from the live list
+ * the record itself stays valid until the end of the pass,
+ * callers up the stack may still be holding it
  *
  * *puser:  pointer to the user
  */
 void deleteUser(client *puser){
-  close(puser->socket);
+  if (puser->socket < 1)
+    return;
+  if (captureFd >= 0)
+    captureClose(puser);
+  if (puser->isActive)
+    nameRemove(puser->cold->name);
+  //io_uring closes the socket once the kernel is done with it
+  if (puser->ur != NULL) {
+    uringDetach(puser);
+  } else {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, puser->socket, NULL);
+    close(puser->socket);
+  }
+  while (puser->outHead != NULL) {
+    outmsg *m = puser->outHead;
+    puser->outHead = m->next;
+    releaseMessage(m->buf);
+    poolPut(m);
+  }
+  puser->outTail = NULL;
+  puser->outBytes = 0;
+  puser->paused = 0;
   puser->socket = 0;
-  puser->nameLen = 0;
-  timerclear(&puser->timeout);
-  puser->name = 0;
-  free(puser->name);
+  timerCancel(&puser->cold->timeout);
+  timerCancel(&puser->cold->throttle);
+  if (puser->throttled) {
+    puser->throttled = 0;
+    numThrottled--;
+  }
+  roomLeave(puser);
   puser->isActive = 0;
-  return;
+  //move the last live client into the hole
+  live[puser->slot] = live[--numParts];
+  live[puser->slot]->slot = puser->slot;
+  puser->nextFree = freeList;
+  freeList = puser;
+}
+
+/*
+ * Function: freeDeleted
+ * -------------------
+ * end of pass: give back the records of deleted clients
+ * one still on the dirty list waits for the flush that takes it off
+ */
+void freeDeleted() {
+  client **pu = &freeList;
+  while (*pu != NULL) {
+    client *puser = *pu;
+    if (puser->dirty) {
+      pu = &puser->nextFree;
+      continue;
+    }
+    *pu = puser->nextFree;
+    poolPut(puser->cold);
+    poolPut(puser);
+  }
 }
 
 /*
@@ -291,13 +1179,11 @@ void deleteUser(client *puser){
  * -------------------
  * determines if username is valid
  *
- * name:    name to associate with new client
- * sock:    socket associated with the client
- * isPart:  True if the client is a participant
+ * name:  name to associate with new client
  *
  * returns character value based on validity of the name
  */
-char isValidName(char* name, int sock) {
+char isValidName(char* name) {
   int len = strlen(name);
   if (len == 0 || len > NAMELENGTH) {
       return 'I';
@@ -308,62 +1194,233 @@ char isValidName(char* name, int sock) {
         return 'I';
     }
   }
-  //check if name allready exists as a participant
+  //check if name allready exists as a participant, here or on a peer
   //participants may not have the same name
-  client *puser = pset;
-  for (int i = 0; i < MAXCLIENT; i++, puser++) {
-    if (puser->isActive) {
-      if (strcmp(puser->name,name) == 0) {
-          return 'T';
-      }
-    }
+  if (nameNode(name) >= 0) {
+      return 'T';
   }
   return 'Y';
 }
 
 /*
- * Function: sendListOfNames
+ * Function: sendRoster
  * -------------------
- * send the list of connected users to all clients
+ * send the full list of connected users to one client
+ * after this the client keeps its own list from the deltas
+ * the list goes out ROSTERCHUNK bytes at a time: the first frame
+ * replaces the client's list ("%", OP_ROSTER), the rest add to it
+ * ("%+", OP_ROSTERADD without a name)
  *
+ * *user:  client to send the list to
  */
-void sendListOfNames(){
-  client *puser = pset;
-  int totalLength = 1;
-  for (int i = 0; i < MAXCLIENT; i++, puser++) {
-    if (puser->isActive) {
-      totalLength += strlen(puser->name) + 1;
+void sendRoster(client *user){
+  uint32_t len, pos = 0;
+  char *names = nameSnapshot(&len);
+  if (names == NULL)
+    return;
+  do {
+    uint32_t n = len - pos;
+    int first = pos == 0;
+    //whole lines only
+    if (n > ROSTERCHUNK) {
+      n = ROSTERCHUNK;
+      while (names[pos + n - 1] != '\n')
+        n--;
     }
+    msgbuf *m = allocMessage(n + 2);
+    if (m == NULL)
+      break;
+    char *body = m->data + FRAMEHDR;
+    memcpy(body, first ? "%" : "%+", 2 - first);
+    memcpy(body + 2 - first, names + pos, n);
+    sealMessage(m, n + 2 - first);
+    withTyped(m, first ? OP_ROSTER : OP_ROSTERADD, 0, "", names + pos, n);
+    queueMessage(user, m);
+    releaseMessage(m);
+    pos += n;
+    //into the kernel before the next part, it would trip highWater
+    if (pos < len)
+      flushQueue(user);
+  } while (pos < len);
+  free(names);
+}
+
+/*
+ * Function: sendRosterChange
+ * -------------------
+ * tell every client that a user joined or left
+ * sent as "%+name" or "%-name"
+ *
+ * op:       '+' for a join, '-' for a leave
+ * name:     the user
+ * *except:  local client that already knows, may be NULL
+ */
+void sendRosterChange(char op, const char *name, client *except){
+  msgbuf *m = newMessage("%%%c%s", op, name);
+  if (m == NULL)
+    return;
+  withTyped(m, op == '+' ? OP_ROSTERADD : OP_ROSTERDEL, 0, name, "", 0);
+  localBroadcast(m, except);
+  postAll(MAIL_ROSTER, m, name);
+  peerPost(MAIL_ROSTER, m, name);
+  releaseMessage(m);
+}
+
+/*
+ * Function: sendToRoom
+ * -------------------
+ * send a message to everyone in a room, on every shard and server
+ *
+ * name:  the room
+ * *m:    the framed message to send to the members
+ */
+void sendToRoom(const char *name, msgbuf* m) {
+  room *r;
+  if (m == NULL)
+    return;
+  if ((r = roomFind(name)) != NULL)
+    roomBroadcast(r, m);
+  postAll(MAIL_ROOM, m, name);
+  peerPost(MAIL_ROOM, m, name);
+}
+
+/*
+ * Function: roomBroadcast
+ * -------------------
+ * send a message to this shard's members of a room
+ * costs one queue entry per member, however many clients the shard has
+ *
+ * *r:  the room
+ * *m:  the framed message to send to the members
+ */
+void roomBroadcast(room *r, msgbuf* m) {
+  //queueing can only mark clients for closing, the list holds still
+  for (int i = 0; i < r->numMembers; i++)
+    queueMessage(r->members[i], m);
+}
+
+/*
+ * Function: changeRoom
+ * -------------------
+ * handle /join and /part: move a user to another room,
+ * tell both rooms and send the user a "#room" frame for its display
+ *
+ * *user:  client that is moving
+ * name:   room to move to, null terminated
+ */
+void changeRoom(client *user, char *name) {
+  msgbuf *m;
+  char old[NAMELENGTH+1] = "";
+  int len = strlen(name);
+  int ok = len > 0 && len <= NAMELENGTH;
+  //room names follow the username rules
+  for (int i = 0; ok && i < len; i++)
+    ok = isalnum((unsigned char)name[i]) || name[i] == '_';
+  if (!ok) {
+    m = newMessage("Warning: bad room name, use up to %d letters, digits or _", NAMELENGTH);
+    withTyped(m, OP_WARNING, 0, "", NULL, 0);
+    queueMessage(user, m);
+    releaseMessage(m);
+    return;
   }
-  char *nameList = malloc(totalLength);
-  puser = pset;
-  strcpy(nameList, "%\n");
-  int pos = 2;
-  for (int i = 0; i < MAXCLIENT; i++, puser++) {
-    if (puser->isActive) {
-      pos += sprintf(&nameList[pos-1], " %s\n", puser->name);
+  if (user->room != NULL) {
+    if (strcmp(user->room->name, name) == 0)
+      return;
+    strcpy(old, user->room->name);
+  }
+  if (roomJoin(user, name) < 0) {
+    closeClient(user);
+    return;
+  }
+  if (old[0] != 0) {
+    m = newMessage("User %s has left #%s", user->cold->name, old);
+    withTyped(m, OP_NOTICE, user->cold->id, user->cold->name, NULL, 0);
+    sendToRoom(old, m);
+    releaseMessage(m);
+  }
+  m = newMessage("#%s", name);
+  withTyped(m, OP_ROOM, 0, "", name, strlen(name));
+  queueMessage(user, m);
+  releaseMessage(m);
+  //catch up on what was said before the user got here
+  historyReplay(user, name, 0);
+  if (strcmp(name, LOBBY) == 0)
+    m = newMessage("User %s has joined\n", user->cold->name);
+  else
+    m = newMessage("User %s has joined #%s", user->cold->name, name);
+  withTyped(m, OP_NOTICE, user->cold->id, user->cold->name, NULL, 0);
+  sendToRoom(name, m);
+  releaseMessage(m);
+}
+
+/*
+ * Function: localBroadcast
+ * -------------------
+ * send a message to this shard's clients
+ * every client queues a reference to the same encoded frame
+ *
+ * *m:       the framed message to send to the clients
+ * *except:  client to leave out, may be NULL
+ */
+void localBroadcast(msgbuf* m, client *except) {
+  //queueing can only mark clients for closing, the list holds still
+  for (int i = 0; i < numParts; i++) {
+    client *client = live[i];
+    //clients still picking a name would read chat as their handshake reply
+    if (client->isActive && client != except) {
+      queueMessage(client, m);
     }
   }
-  sendToAllClients(nameList);
-  free(nameList);
 }
 
 /*
- * Function: sendToAllClients
+ * Function: deliverMail
  * -------------------
- * send a message to all connected clients
+ * handle everything the other shards have sent us
  *
- * msg:  the message to send to the clients
  */
-void sendToAllClients(char* msg) {
-  client *client = pset;
-  uint16_t len = strlen(msg);
-  uint16_t netlen = htons(len);
-  for (int i = 0; i < MAXCLIENT; i++, client++) {
-    if (client->socket > 0) {
-      send(client->socket, &netlen, sizeof(uint16_t), MSG_NOSIGNAL | MSG_DONTWAIT);
-      send(client->socket, msg, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+void deliverMail() {
+  mail *m;
+  while ((m = takeMail()) != NULL) {
+    switch (m->type) {
+      case MAIL_ROOM: {
+        room *r = roomFind(m->dest);
+        //only shards with members have the room at all
+        if (r != NULL)
+          roomBroadcast(r, m->buf);
+        break;
+      }
+      case MAIL_DIRECT: {
+        int shard = -1;
+        client *dest = nameFind(m->dest, &shard);
+        //the user may have left while the mail was in flight
+        if (dest != NULL && shard == myShard)
+          queueMessage(dest, m->buf);
+        break;
+      }
+      case MAIL_ROSTER: {
+        //a name can leave one shard and rejoin another while the
+        //deltas are in flight: only pass on the ones that still hold
+        int present = nameNode(m->dest) >= 0;
+        if ((m->buf->data[FRAMEHDR + 1] == '+') == present)
+          localBroadcast(m->buf, NULL);
+        break;
+      }
+      case MAIL_HANDOVER:
+        //finish the pass, the loop stops after it
+        handingOver = 1;
+        break;
+      case MAIL_KICK:
+        //the directory already points at the other node, find it by name
+        for (int i = 0; i < numParts; i++) {
+          if (live[i]->isActive && strcmp(live[i]->cold->name, m->dest) == 0) {
+            kickUser(live[i]);
+            break;
+          }
+        }
+        break;
     }
+    doneMail(m);
   }
 }
 
@@ -371,111 +1428,664 @@ void sendToAllClients(char* msg) {
  * Function: sendPrivate
  * -------------------
  * send a private message to a client
+ * recipients on another shard are reached through its mailbox,
+ * recipients on another server through the federation
  *
- * buf:     message from to be modified
- * msgLen:  length of original message
- * *user:   pointer to user sending the message
- */
-void sendPrivate(char* buf, uint16_t msgLen, client* user) {
-    uint16_t netLen;
-    char dest[NAMELENGTH+1];
-    char* msg = buf;
-    //username is the first
-    while (*msg != ' ' && *msg != 0) {
-      msg++;
-    }
-    *(msg++) = 0;
-    strncpy(dest, buf+1, msgLen);
-    dest[msgLen] = 0;
-    char fmsg[MSGLENGTH+15] = {0};
-    int pad = 11 - (user->nameLen);
-    sprintf(fmsg, "%c%*c%s: %s", '*', pad,' ', user->name, msg);
-    msgLen = strlen(fmsg);
-    fmsg[msgLen] = 0;
-    netLen = htons(msgLen);
-    client *client = pset;
-    for (int i = 0; i < MAXCLIENT; i++, client++) {
-      if (client->isActive) {
-        if (strcmp(dest, client->name) == 0) {
-            send(client->socket, &netLen, sizeof(uint16_t), MSG_DONTWAIT);
-            send(client->socket, fmsg, msgLen, MSG_DONTWAIT);
-          if (client->socket != user->socket) {
-            send(user->socket, &netLen, sizeof(uint16_t), MSG_DONTWAIT);
-            send(user->socket, fmsg, msgLen, MSG_DONTWAIT);
-          }
-          return;
-        }
+ * *user:  pointer to user sending the message
+ * dest:   username of the recipient
+ * msg:    the message
+ */
+void sendPrivate(client* user, const char *dest, const char *msg) {
+    msgbuf *m;
+    int shard = -1;
+    int pad = 11 - (user->cold->nameLen);
+    //names never exceed NAMELENGTH, anything longer cannot match
+    client *client = strlen(dest) > NAMELENGTH ? NULL : nameFind(dest, &shard);
+    if (client != NULL || (strlen(dest) <= NAMELENGTH && nameNode(dest) > 0)) {
+      m = newMessage("%c%*c%s: %s", '*', pad,' ', user->cold->name, msg);
+      withTyped(m, OP_PRIVATE, user->cold->id, user->cold->name, msg, strlen(msg));
+      if (client == NULL)
+        peerPost(MAIL_DIRECT, m, dest);
+      else if (shard == myShard)
+        queueMessage(client, m);
+      else
+        postMail(shard, MAIL_DIRECT, m, dest);
+      if (client != user) {
+        queueMessage(user, m);
       }
+      releaseMessage(m);
+      return;
     }
-    snprintf(buf, MSGLENGTH, "Warning: user %s doesn't exist...", dest);
-    msgLen = strlen(buf);
-    netLen = htons(msgLen);
-    send(user->socket, &netLen, sizeof(uint16_t), MSG_DONTWAIT);
-    send(user->socket, buf, msgLen, MSG_DONTWAIT);
-}
-
-/*
- * Function: getConnectedUsers
- * -------------------
- * Adjust all the timer values for connected clients
- * remove any clients that have timed out
- * adjust pointer to the lowest time
- *
- * *maxfd:    pointer to the current maxfd
- * *rfds:     pointer to the set of fds
- * elapTime:  elapsted time since last Select call
- * isPart:    True if we're adjusting participants
- */
-void getConnectedUsers(int *maxfd, fd_set *rfds, struct timeval elapTime) {
-  client *user = NULL;
-    user = pset;
-  struct timeval lowestTimer;
-  lowestTimer.tv_sec = TIMEOUT+1; //+1 second garuntees that a timer will always get set
-  lowestTimer.tv_usec = 0;
-  for (int i=0; i< MAXCLIENT; i++, user++) {
-    //only adjust timers on non-username clients
-    if (user->socket > 0) {
-      if(!user->isActive) {
-        timersub(&user->timeout,&elapTime,&user->timeout);
-        //if the timer is now 0, remove them from the array
-        if (!timerisset(&user->timeout)) {
-          numParts--;
-          deleteUser(user);
-          continue;
-        } else if (timercmp(&user->timeout,&lowestTimer,<)) {
-          lowestTimer = user->timeout;
-          lowestTime = user;
+    m = newMessage("Warning: user %.*s doesn't exist...", NAMELENGTH, dest);
+    withTyped(m, OP_WARNING, 0, "", NULL, 0);
+    queueMessage(user, m);
+    releaseMessage(m);
+}
+
+/*
+ * Function: queueMessage
+ * -------------------
+ * queue a reference to a framed message for a client and try to send it
+ *
+ * *user:  client to send to
+ * *buf:   the framed message
+ */
+void queueMessage(client *user, msgbuf *buf) {
+  //v2 clients get the typed form of anything that has one
+  if (buf != NULL && user->proto == PROTO_V2 && buf->alt != NULL)
+    buf = buf->alt;
+  else if (buf != NULL && user->proto == PROTO_V2 && buf->v1only)
+    return;
+  if (buf != NULL)
+    queueSpan(user, buf, buf->data, buf->len, buf->typed);
+}
+
+/*
+ * Function: queueSpan
+ * -------------------
+ * queue bytes for a client and try to send them, holding a reference
+ * to the frame that owns them (for history replay, one that keeps the
+ * mapped segment they live in alive)
+ * applies the slow consumer policy once the queue passes highWater
+ *
+ * *user:  client to send to
+ * *buf:   frame that owns the bytes
+ * data:   bytes to send
+ * len:    number of bytes
+ * typed:  the bytes are a v2 message, to be sent in a container
+ */
+void queueSpan(client *user, msgbuf *buf, const char *data, uint32_t len, uint8_t typed) {
+  if (buf == NULL || user->socket < 1 || user->closing)
+    return;
+  outmsg *m = poolGet(&outmsgPool);
+  if (m == NULL) {
+    closeClient(user);
+    return;
+  }
+  m->next = NULL;
+  m->buf = holdMessage(buf);
+  m->data = data;
+  m->len = len;
+  m->sent = 0;
+  m->typed = typed;
+  if (user->outTail == NULL)
+    user->outHead = m;
+  else
+    user->outTail->next = m;
+  user->outTail = m;
+  user->outBytes += len;
+  statsHist(myStats->queue, &myStats->queueSum, user->outBytes);
+  //the queue was empty, skip waiting for EPOLLOUT
+  if (batchDelay >= 0)
+    markDirty(user);
+  else if (user->outHead == m)
+    flushQueue(user);
+  if (user->outBytes > highWater)
+    trimQueue(user);
+}
+
+/*
+ * Function: trimQueue
+ * -------------------
+ * apply the slow consumer policy to a client over highWater
+ *
+ * *user:  client with the overfull queue
+ */
+void trimQueue(client *user) {
+  switch (slowPolicy) {
+    case POLICY_DROP:
+      //a partly written frame has to finish or the stream desyncs,
+      //frames the kernel is sending from must stay put, and so must
+      //the ones an open container has promised
+      while (user->outBytes > highWater) {
+        outmsg **pm = &user->outHead;
+        outmsg *prev = NULL;
+        for (int k = 0; *pm != NULL && (k < user->outLocked || k < user->contMsgs || (k == 0 && (*pm)->sent > 0)); k++) {
+          prev = *pm;
+          pm = &(*pm)->next;
         }
+        if (*pm == NULL)
+          break;
+        outmsg *m = *pm;
+        *pm = m->next;
+        if (user->outTail == m)
+          user->outTail = prev;
+        user->outBytes -= m->len - m->sent;
+        STAT_ADD(dropped, 1);
+        releaseMessage(m->buf);
+        poolPut(m);
       }
-      FD_SET(user->socket, rfds);
-      *maxfd = (*maxfd > user->socket) ? *maxfd : user->socket;
+      break;
+    case POLICY_DISCONNECT:
+      STAT_ADD(slowCloses, 1);
+      closeClient(user);
+      break;
+    case POLICY_PAUSE:
+      if (user->outBytes > HARDLIMIT * highWater) {
+        STAT_ADD(slowCloses, 1);
+        closeClient(user);
+      } else if (!user->paused) {
+        user->paused = 1;
+        updateEvents(user);
+      }
+      break;
+  }
+}
+
+/*
+ * Function: flushQueue
+ * -------------------
+ * write as much of a client's outbound queue as the socket will take
+ * gathers up to IOVBATCH queued frames into each sendmsg
+ * registers for EPOLLOUT while anything is left over
+ *
+ * *user:  client to flush
+ */
+void flushQueue(client *user) {
+  struct iovec iov[IOVBATCH];
+  struct msghdr mh;
+  ssize_t n;
+  size_t total;
+  int cnt, entries;
+  if (user->socket < 1 || user->closing)
+    return;
+  if (user->ur != NULL) {
+    uringSend(user);
+    return;
+  }
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = iov;
+  while (user->outHead != NULL) {
+    outmsg *m = user->outHead;
+    cnt = gatherQueue(user, iov, IOVBATCH, &entries);
+    for (int k = 0; k < entries; k++)
+      m = m->next;
+    total = 0;
+    for (int k = 0; k < cnt; k++)
+      total += iov[k].iov_len;
+    mh.msg_iovlen = cnt;
+    //tell the stack more is coming when the queue outruns one batch
+    n = sendmsg(user->socket, &mh, MSG_NOSIGNAL | MSG_DONTWAIT | (m != NULL ? MSG_MORE : 0));
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        closeClient(user);
+      break;
+    }
+    retireBytes(user, n);
+    //the socket is full, wait for EPOLLOUT
+    if ((size_t)n < total) {
+      STAT_ADD(partialSends, 1);
+      break;
+    }
+  }
+  afterSend(user);
+}
+
+/*
+ * Function: gatherQueue
+ * -------------------
+ * point iovecs at the head of a client's queue for one gathered write
+ * for a v2 client a run of typed messages goes out in a container,
+ * its header is made here when the run reaches the head of the queue
+ *
+ * *user:     client to write to
+ * iov:       iovecs to fill
+ * max:       room in iov
+ * *entries:  set to the number of queue entries the iovecs cover
+ *
+ * returns the number of iovecs filled
+ */
+int gatherQueue(client *user, struct iovec *iov, int max, int *entries) {
+  outmsg *m = user->outHead;
+  int cnt = 0;
+  int k = 0;
+  if (m != NULL && m->typed && user->contMsgs == 0) {
+    uint32_t bytes = 0;
+    uint16_t count = 0;
+    //the header takes one iovec, a container holds at least one message
+    for (outmsg *t = m; t != NULL && t->typed && count < max - 1 && (count == 0 || bytes + t->len <= CONTMAX); t = t->next) {
+      bytes += t->len;
+      count++;
+    }
+    user->cont.op = OP_BATCH;
+    user->cont.pad = 0;
+    user->cont.count = htons(count);
+    user->cont.len = htonl(bytes);
+    user->contMsgs = count;
+    user->hdrSent = 0;
+  }
+  if (user->contMsgs > 0 && user->hdrSent < sizeof(contHdr)) {
+    iov[cnt].iov_base = (char*)&user->cont + user->hdrSent;
+    iov[cnt++].iov_len = sizeof(contHdr) - user->hdrSent;
+  }
+  for (; m != NULL && cnt < max; m = m->next, k++) {
+    //a write ends with its container, or where the next one would start
+    if (user->contMsgs > 0 ? k == user->contMsgs : m->typed)
+      break;
+    iov[cnt].iov_base = (char*)m->data + m->sent;
+    iov[cnt++].iov_len = m->len - m->sent;
+  }
+  *entries = k;
+  return cnt;
+}
+
+/*
+ * Function: retireBytes
+ * -------------------
+ * account for bytes written from the head of a client's queue
+ * and free every frame that is now completely sent
+ *
+ * *user:  client that was written to
+ * n:      bytes written
+ */
+void retireBytes(client *user, size_t n) {
+  STAT_ADD(bytesOut, n);
+  //the container header goes out ahead of its messages
+  if (user->contMsgs > 0 && user->hdrSent < sizeof(contHdr)) {
+    size_t k = sizeof(contHdr) - user->hdrSent;
+    if (k > n)
+      k = n;
+    user->hdrSent += k;
+    n -= k;
+  }
+  user->outBytes -= n;
+  while (n > 0) {
+    outmsg *m = user->outHead;
+    if (n < (size_t)(m->len - m->sent)) {
+      m->sent += n;
+      break;
     }
+    n -= m->len - m->sent;
+    STAT_ADD(framesOut, 1);
+    if (user->contMsgs > 0)
+      user->contMsgs--;
+    user->outHead = m->next;
+    releaseMessage(m->buf);
+    poolPut(m);
+  }
+  if (user->outHead == NULL)
+    user->outTail = NULL;
+}
+
+/*
+ * Function: afterSend
+ * -------------------
+ * resume reading once a paused client has caught up
+ * and bring the event registration up to date
+ *
+ * *user:  client that was written to
+ */
+void afterSend(client *user) {
+  if (user->paused && user->outBytes <= highWater / 2)
+    user->paused = 0;
+  updateEvents(user);
+}
+
+/*
+ * Function: markDirty
+ * -------------------
+ * hold a client's new frames for the end of the pass
+ * a record stays listed until flushDirty, even once its client is gone
+ *
+ * *user:  client that has frames queued
+ */
+void markDirty(client *user) {
+  if (user->dirty)
+    return;
+  if (numDirty == 0)
+    batchStart = nowMs();
+  user->dirty = 1;
+  user->nextDirty = dirtyList;
+  dirtyList = user;
+  numDirty++;
+}
+
+/*
+ * Function: batchWait
+ * -------------------
+ * returns ms until the held frames must go out, -1 if nothing is held
+ */
+int batchWait() {
+  if (numDirty == 0)
+    return -1;
+  long left = batchStart + batchDelay - nowMs();
+  return left > 0 ? left : 0;
+}
+
+/*
+ * Function: flushDirty
+ * -------------------
+ * end of pass: once the batch delay is up, write everything that was
+ * queued since the last flush with one gathered write per client
+ */
+void flushDirty() {
+  if (numDirty == 0 || batchWait() > 0)
+    return;
+  while (dirtyList != NULL) {
+    client *user = dirtyList;
+    dirtyList = user->nextDirty;
+    numDirty--;
+    user->dirty = 0;
+    flushQueue(user);
+  }
+}
+
+/*
+ * Function: updateEvents
+ * -------------------
+ * keep the epoll registration in step with the client's state
+ *
+ * *user:  client to update
+ */
+void updateEvents(client *user) {
+  struct epoll_event ev;
+  if (user->ur != NULL) {
+    uringUpdate(user);
+    return;
+  }
+  if (user->socket < 1 || user->closing)
+    return;
+  ev.events = (user->paused || user->throttled ? 0 : EPOLLIN) | (user->outHead ? EPOLLOUT : 0);
+  if (ev.events == user->events)
+    return;
+  ev.data.ptr = user;
+  if (epoll_ctl(epfd, EPOLL_CTL_MOD, user->socket, &ev) < 0) {
+    closeClient(user);
+    return;
+  }
+  user->events = ev.events;
+}
+
+/*
+ * Function: closeClient
+ * -------------------
+ * mark a client to be disconnected once the current pass is done
+ * keeps fan-out loops from deleting clients out from under themselves
+ *
+ * *user:  client to disconnect
+ */
+void closeClient(client *user) {
+  if (user->closing || user->socket < 1)
+    return;
+  user->closing = 1;
+  user->nextClosing = closeList;
+  closeList = user;
+}
+
+/*
+ * Function: closeDoomed
+ * -------------------
+ * disconnect every client marked by closeClient
+ * and tell the room about the ones that had joined
+ */
+void closeDoomed() {
+  while (closeList != NULL) {
+    client *user = closeList;
+    closeList = user->nextClosing;
+    //it may have hung up on its own after being marked
+    if (user->socket > 0)
+      leaveUser(user);
   }
 }
 
+/*
+ * Function: takeTokens
+ * -------------------
+ * top up a client's token buckets and pay for one message out of them
+ *
+ * *user:  client that sent the message
+ * len:    bytes of the message
+ *
+ * returns 1 if the message may be handled, 0 if the client must wait
+ */
+int takeTokens(client *user, uint32_t len) {
+  clientCold *cold = user->cold;
+  uint64_t msgCap = (uint64_t)msgRate * 1000 * RATEBURST;
+  uint64_t byteCap = (uint64_t)byteRate * 1000 * RATEBURST;
+  //a message bigger than the whole bucket only has to wait for a full one
+  uint64_t cost = (uint64_t)len * 1000 < byteCap ? (uint64_t)len * 1000 : byteCap;
+  if (msgRate == 0 && byteRate == 0)
+    return 1;
+  long now = nowMs();
+  uint64_t elapsed = now - cold->refillMs;
+  cold->refillMs = now;
+  cold->msgTokens += elapsed * msgRate;
+  if (cold->msgTokens > msgCap)
+    cold->msgTokens = msgCap;
+  cold->byteTokens += elapsed * byteRate;
+  if (cold->byteTokens > byteCap)
+    cold->byteTokens = byteCap;
+  if ((msgRate > 0 && cold->msgTokens < 1000) || (byteRate > 0 && cold->byteTokens < cost))
+    return 0;
+  if (msgRate > 0)
+    cold->msgTokens -= 1000;
+  if (byteRate > 0)
+    cold->byteTokens -= cost;
+  return 1;
+}
+
+/*
+ * Function: throttleUser
+ * -------------------
+ * stop reading from a client that ran out of tokens until its
+ * buckets hold enough for the message it is waiting to send
+ * nothing it sent is dropped, TCP pushes back on it meanwhile
+ *
+ * *user:  client that is over its rate
+ * len:    bytes of the waiting message
+ */
+void throttleUser(client *user, uint32_t len) {
+  clientCold *cold = user->cold;
+  uint64_t byteCap = (uint64_t)byteRate * 1000 * RATEBURST;
+  uint64_t cost = (uint64_t)len * 1000 < byteCap ? (uint64_t)len * 1000 : byteCap;
+  uint64_t wait = TIMERTICK;
+  if (msgRate > 0 && cold->msgTokens < 1000 && (1000 - cold->msgTokens + msgRate - 1) / msgRate > wait)
+    wait = (1000 - cold->msgTokens + msgRate - 1) / msgRate;
+  if (byteRate > 0 && cold->byteTokens < cost && (cost - cold->byteTokens + byteRate - 1) / byteRate > wait)
+    wait = (cost - cold->byteTokens + byteRate - 1) / byteRate;
+  STAT_ADD(throttles, 1);
+  numThrottled++;
+  user->throttled = 1;
+  updateEvents(user);
+  timerArm(&cold->throttle, wait, throttleExpired);
+}
 
+/*
+ * Function: throttleExpired
+ * -------------------
+ * a throttled client's buckets have refilled: handle the frames it
+ * has waiting and start reading again
+ *
+ * *t:  the client's throttle timer
+ */
+void throttleExpired(timer *t) {
+  clientCold *cold = (clientCold*)((char*)t - offsetof(clientCold, throttle));
+  client *user = cold->hot;
+  int sock = user->socket;
+  numThrottled--;
+  user->throttled = 0;
+  parseInput(user);
+  //io_uring may have received more than fit while reads were stopping
+  if (user->ur != NULL && user->socket == sock && !user->closing)
+    uringDrain(user);
+  if (user->socket == sock && !user->closing)
+    updateEvents(user);
+}
 
 /*
- * Function: print
+ * Function: handshakeExpired
  * -------------------
- * helper function while developing to display connected participants
+ * timer callback for a client that never picked a valid name
  *
- * returns
+ * *t:  the client's timeout timer
  */
-void print() {
-  client *user = pset;
-  dprintf(2, "***********\n");
-  dprintf(1, "parts: %d\n", numParts);
-  for (int i=0; i< MAXCLIENT; i++, user++) {
-    if (user->socket > 0) {
-      if (user->isActive)
-        dprintf(2, "  %s\n", user->name);
-      dprintf(2, "    psock:%d\n", user->socket);
-      dprintf(2, "    nlen :%d\n", user->nameLen);
-      dprintf(2, "    time :%ld:%ld\n\n", user->timeout.tv_sec, user->timeout.tv_usec);
+void handshakeExpired(timer *t) {
+  clientCold *cold = (clientCold*)((char*)t - offsetof(clientCold, timeout));
+  STAT_ADD(timeouts, 1);
+  deleteUser(cold->hot);
+}
+
+/*
+ * Function: handoverShard
+ * -------------------
+ * a new process is taking over: once every shard has stopped reading
+ * and the last mail between them is delivered, send each client with
+ * its socket, parse state and unsent queue, then never run again
+ */
+void handoverShard() {
+  handoverBarrier();
+  deliverMail();
+  //leaving clients still tell the other shards
+  closeDoomed();
+  handoverBarrier();
+  deliverMail();
+  for (int i = 0; i < numParts; i++) {
+    client *user = live[i];
+    clientCold *cold = user->cold;
+    uint32_t queueLen = 0;
+    char *queue, *q;
+    //whoever was about to be dropped is just dropped
+    if (user->closing) {
+      if (cold->token != 0)
+        sessionClose(cold->token);
+      continue;
     }
+    hoClient *c = calloc(1, sizeof(hoClient) + cold->inLen);
+    for (outmsg *m = user->outHead; m != NULL; m = m->next)
+      queueLen += sizeof(hoEntry) + m->len;
+    queue = q = malloc(queueLen ? queueLen : 1);
+    if (c == NULL || queue == NULL) {
+      free(c);
+      free(queue);
+      continue;
+    }
+    c->isActive = user->isActive;
+    c->proto = user->proto;
+    c->state = cold->state;
+    c->op = cold->op;
+    c->argLen = cold->argLen;
+    c->nameLen = cold->nameLen;
+    c->hdrSent = user->hdrSent;
+    c->want = cold->want;
+    c->inLen = cold->inLen;
+    c->contMsgs = user->contMsgs;
+    c->cont = user->cont;
+    c->id = cold->id;
+    c->token = cold->token;
+    memcpy(c->name, cold->name, sizeof(c->name));
+    if (user->room != NULL)
+      strcpy(c->room, user->room->name);
+    memcpy(c->inbuf, cold->inbuf, cold->inLen);
+    //whole entries go along, a partly written one says how far it got
+    for (outmsg *m = user->outHead; m != NULL; m = m->next) {
+      hoEntry e = {m->typed, m->len, m->sent};
+      memcpy(q, &e, sizeof(e));
+      memcpy(q + sizeof(e), m->data, m->len);
+      q += sizeof(e) + m->len;
+    }
+    handoverSend(c, sizeof(hoClient) + c->inLen, user->socket, queue, queueLen);
+    free(c);
+    free(queue);
+  }
+  LOG(LOG_INFO, "handed over %d clients", numParts);
+  //the buffer is this shard's own, nobody writes it out once it parks
+  if (captureFd >= 0)
+    captureFlush();
+  handoverDone();
+}
+
+/*
+ * Function: adoptClients
+ * -------------------
+ * take on this shard's share of the clients an old process handed
+ * over, as if nothing had happened to them. shard 0 also times the
+ * sessions that were held, each with a fresh grace period
+ */
+void adoptClients() {
+  for (int i = myShard; i < numStaged; i += numShards) {
+    hoStaged *st = &staged[i];
+    hoClient *c = st->rec;
+    //io_uring waits in the kernel, the old epoll loop did not
+    if (useUring)
+      fcntl(st->fd, F_SETFL, fcntl(st->fd, F_GETFL) & ~O_NONBLOCK);
+    addUser(st->fd);
+    if (numParts > 0 && live[numParts - 1]->socket == st->fd) {
+      client *user = live[numParts - 1];
+      clientCold *cold = user->cold;
+      const char *q = st->queue;
+      user->proto = c->proto;
+      cold->state = c->state;
+      cold->op = c->op;
+      cold->argLen = c->argLen;
+      cold->nameLen = c->nameLen;
+      cold->want = c->want;
+      cold->inLen = c->inLen;
+      cold->id = c->id;
+      cold->token = c->token;
+      memcpy(cold->name, c->name, sizeof(cold->name));
+      memcpy(cold->inbuf, c->inbuf, c->inLen);
+      while (q < st->queue + c->queueLen) {
+        hoEntry e;
+        memcpy(&e, q, sizeof(e));
+        msgbuf *buf = rawMessage(q + sizeof(e), e.len);
+        outmsg *m = poolGet(&outmsgPool);
+        q += sizeof(e) + e.len;
+        if (buf == NULL || m == NULL) {
+          releaseMessage(buf);
+          poolPut(m);
+          closeClient(user);
+          break;
+        }
+        buf->typed = e.typed;
+        m->next = NULL;
+        m->buf = buf;
+        m->data = buf->data;
+        m->len = e.len;
+        m->sent = e.sent;
+        m->typed = e.typed;
+        if (user->outTail == NULL)
+          user->outHead = m;
+        else
+          user->outTail->next = m;
+        user->outTail = m;
+        user->outBytes += e.len - e.sent;
+      }
+      user->cont = c->cont;
+      user->contMsgs = c->contMsgs;
+      user->hdrSent = c->hdrSent;
+      if (c->isActive) {
+        timerCancel(&cold->timeout);
+        if (nameClaim(cold->name, user, myShard) == 0) {
+          user->isActive = 1;
+          if (roomJoin(user, c->room) < 0)
+            closeClient(user);
+        } else {
+          closeClient(user);
+        }
+      }
+      flushQueue(user);
+      if (cold->inLen > 0 && !user->closing)
+        parseInput(user);
+    }
+    free(st->rec);
+    free(st->queue);
+  }
+  if (myShard == 0) {
+    for (int i = 0; i < numHeld; i++) {
+      hold *h = poolGet(&holdPool);
+      if (h == NULL)
+        break;
+      memset(h, 0, sizeof(hold));
+      h->token = stagedHeld[i].token;
+      h->gen = stagedHeld[i].holds;
+      timerArm(&h->t, resumeGrace * 1000, holdExpired);
+    }
+    //the next process takes over from us the same way
+    if (handoverPath != NULL)
+      handoverServe(handoverPath);
   }
-  dprintf(2, "***********\n");
 }
 
 /*
@@ -517,6 +2127,12 @@ int openSocket(struct sockaddr_in sad,int optval, int port) {
     exit(EXIT_FAILURE);
   }
 
+  /* Let every shard bind its own listener to the same port */
+  if( numShards > 1 && setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0 ) {
+    fprintf(stderr, "Error Setting socket option failed\n");
+    exit(EXIT_FAILURE);
+  }
+
   /* Bind a local address to the socket */
   if (bind(sd, (struct sockaddr *)&sad, sizeof(sad)) < 0) {
     fprintf(stderr,"Error: Bind failed\n");
@@ -524,10 +2140,13 @@ int openSocket(struct sockaddr_in sad,int optval, int port) {
   }
 
   /* Specify size of request queue */
-  if (listen(sd, QLEN) < 0) {
+  if (listen(sd, listenQueue) < 0) {
     fprintf(stderr,"Error: Listen failed\n");
     exit(EXIT_FAILURE);
   }
 
+  /* Accepts drain the queue until it is empty, they must not block */
+  fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK);
+
   return sd;
 }
@@ -0,0 +1,195 @@
+/* session.c - resume tokens of v2 users
+ *
+ * a session outlives its connection by resumeGrace seconds, a client
+ * that comes back with the token in time gets its name back without
+ * the room hearing it leave and join again. shared by every shard,
+ * one mutex guards it
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/random.h>
+#include "../inc/server.h"
+
+int resumeGrace = RESUMEGRACE;              //seconds a dropped session is held
+
+static session *buckets[SESSIONTABLE];      //sessions chained by token
+static pthread_mutex_t sessionLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Function: sessionSlot
+ * -------------------
+ * find the link pointing at a session, or the NULL that ends its bucket
+ *
+ * token:  session to look for
+ *
+ * returns the link
+ */
+static session** sessionSlot(uint64_t token) {
+  //tokens are random, their low bits spread well enough
+  session **ps = &buckets[token & (SESSIONTABLE - 1)];
+  while (*ps != NULL && (*ps)->token != token)
+    ps = &(*ps)->next;
+  return ps;
+}
+
+/*
+ * Function: sessionOpen
+ * -------------------
+ * start a session for a user that just got its name
+ *
+ * name:  the username
+ * id:    its user id
+ *
+ * returns the token, 0 if none could be made
+ */
+uint64_t sessionOpen(const char *name, uint32_t id) {
+  uint64_t token = 0;
+  session *s = calloc(1, sizeof(session));
+  if (s == NULL)
+    return 0;
+  strcpy(s->name, name);
+  s->id = id;
+  pthread_mutex_lock(&sessionLock);
+  //the token is all a resume checks, so it has to be unguessable
+  while (token == 0 || *sessionSlot(token) != NULL) {
+    if (getrandom(&token, sizeof(token), 0) != sizeof(token)) {
+      pthread_mutex_unlock(&sessionLock);
+      free(s);
+      return 0;
+    }
+  }
+  s->token = token;
+  s->next = buckets[token & (SESSIONTABLE - 1)];
+  buckets[token & (SESSIONTABLE - 1)] = s;
+  pthread_mutex_unlock(&sessionLock);
+  return token;
+}
+
+/*
+ * Function: sessionHold
+ * -------------------
+ * the connection dropped: keep the session for a resume
+ *
+ * token:  the session
+ * room:   room the user was in
+ *
+ * returns the hold's generation, for its grace timer
+ */
+uint32_t sessionHold(uint64_t token, const char *room) {
+  uint32_t gen = 0;
+  pthread_mutex_lock(&sessionLock);
+  session *s = *sessionSlot(token);
+  if (s != NULL) {
+    strcpy(s->room, room);
+    s->held = 1;
+    gen = ++s->holds;
+  }
+  pthread_mutex_unlock(&sessionLock);
+  return gen;
+}
+
+/*
+ * Function: sessionTake
+ * -------------------
+ * hand a held session to a new connection
+ *
+ * token:  what the client presented
+ * *out:   set to the session when taken
+ *
+ * returns 0 if taken, -1 for an unknown token or one in use
+ */
+int sessionTake(uint64_t token, session *out) {
+  int ret = -1;
+  pthread_mutex_lock(&sessionLock);
+  session *s = *sessionSlot(token);
+  if (s != NULL && s->held) {
+    s->held = 0;
+    *out = *s;
+    ret = 0;
+  }
+  pthread_mutex_unlock(&sessionLock);
+  return ret;
+}
+
+/*
+ * Function: sessionExpire
+ * -------------------
+ * the grace period is over: end the session unless it was resumed,
+ * whichever of this and sessionTake gets the lock first wins. the
+ * timer of an earlier hold finds a later one and leaves it be
+ *
+ * token:  the session
+ * gen:    the hold the timer was armed for
+ * *out:   set to the session when it ended
+ *
+ * returns 0 if it ended, -1 if it was resumed in the meantime
+ */
+int sessionExpire(uint64_t token, uint32_t gen, session *out) {
+  int ret = -1;
+  pthread_mutex_lock(&sessionLock);
+  session **ps = sessionSlot(token);
+  session *s = *ps;
+  if (s != NULL && s->held && s->holds == gen) {
+    *ps = s->next;
+    *out = *s;
+    free(s);
+    ret = 0;
+  }
+  pthread_mutex_unlock(&sessionLock);
+  return ret;
+}
+
+/*
+ * Function: sessionClose
+ * -------------------
+ * end a session right away, its user left for good
+ *
+ * token:  the session
+ */
+void sessionClose(uint64_t token) {
+  pthread_mutex_lock(&sessionLock);
+  session **ps = sessionSlot(token);
+  session *s = *ps;
+  if (s != NULL) {
+    *ps = s->next;
+    free(s);
+  }
+  pthread_mutex_unlock(&sessionLock);
+}
+
+/*
+ * Function: sessionEach
+ * -------------------
+ * call fn on every session, with the table locked
+ *
+ * fn:  callback, must not touch the sessions
+ */
+void sessionEach(void (*fn)(const session*)) {
+  pthread_mutex_lock(&sessionLock);
+  for (int i = 0; i < SESSIONTABLE; i++) {
+    for (session *s = buckets[i]; s != NULL; s = s->next)
+      fn(s);
+  }
+  pthread_mutex_unlock(&sessionLock);
+}
+
+/*
+ * Function: sessionRestore
+ * -------------------
+ * put back a session another process handed over
+ *
+ * *from:  the session, token included
+ */
+void sessionRestore(const session *from) {
+  session *s = malloc(sizeof(session));
+  if (s == NULL)
+    return;
+  *s = *from;
+  pthread_mutex_lock(&sessionLock);
+  s->next = buckets[s->token & (SESSIONTABLE - 1)];
+  buckets[s->token & (SESSIONTABLE - 1)] = s;
+  pthread_mutex_unlock(&sessionLock);
+}
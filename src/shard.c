@@ -0,0 +1,210 @@
+/* shard.c - reactor threads and the mailboxes between them */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include "../inc/server.h"
+
+shard *shards = NULL;        //every shard, indexed by shard number
+int numShards = 1;           //number of reactor threads
+_Thread_local int myShard;   //shard the calling thread runs
+
+static void (*shardLoop)(int);  //event loop every shard runs
+static _Thread_local pool mailPool = {"mail", sizeof(mail)}; //mail this shard sends
+
+/*
+ * Function: mailboxInit
+ * -------------------
+ * set up an empty mailbox and the eventfd that signals it
+ *
+ * *box:  mailbox to set up
+ */
+static void mailboxInit(mailbox *box) {
+  box->stub.next = NULL;
+  box->head = &box->stub;
+  box->tail = &box->stub;
+  box->signalled = 0;
+  box->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (box->efd < 0) {
+    perror("eventfd()");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ * Function: push
+ * -------------------
+ * append mail to a mailbox, wait free for any number of producers
+ *
+ * *box:  mailbox to append to
+ * *m:    mail to append
+ */
+static void push(mailbox *box, mail *m) {
+  m->next = NULL;
+  mail *prev = __atomic_exchange_n(&box->head, m, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&prev->next, m, __ATOMIC_RELEASE);
+}
+
+/*
+ * Function: wake
+ * -------------------
+ * make the owning shard's epoll_wait return for its mailbox
+ *
+ * *box:  mailbox to signal
+ */
+static void wake(mailbox *box) {
+  uint64_t one = 1;
+  if (write(box->efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    perror("write(eventfd)");
+}
+
+/*
+ * Function: shardMain
+ * -------------------
+ * thread entry point for the extra shards
+ *
+ * arg:  the shard number
+ */
+static void* shardMain(void *arg) {
+  myShard = (int)(intptr_t)arg;
+  shardLoop(shards[myShard].listener);
+  return NULL;
+}
+
+/*
+ * Function: startShards
+ * -------------------
+ * create the shards and run loop in each of them
+ * the calling thread becomes shard 0 and does not return
+ *
+ * listeners:  one listening socket per shard
+ * count:      number of shards
+ * loop:       event loop, called with the shard's listener
+ */
+void startShards(int *listeners, int count, void (*loop)(int)) {
+  numShards = count;
+  shardLoop = loop;
+  //one mailbox more than shards, the federation thread reads the last
+  shards = calloc(count + 1, sizeof(shard));
+  if (shards == NULL) {
+    perror("calloc()");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < count; i++)
+    shards[i].listener = listeners[i];
+  for (int i = 0; i <= count; i++)
+    mailboxInit(&shards[i].box);
+  for (int i = 1; i < count; i++) {
+    if (pthread_create(&shards[i].thread, NULL, shardMain, (void*)(intptr_t)i) != 0) {
+      fprintf(stderr, "Error: could not start shard %d\n", i);
+      exit(EXIT_FAILURE);
+    }
+  }
+  myShard = 0;
+  shardLoop(listeners[0]);
+}
+
+/*
+ * Function: postMail
+ * -------------------
+ * send mail to another shard, waking it if it is not already awake
+ *
+ * to:    shard number
+ * type:  MAIL_*
+ * *buf:  frame to deliver, a new reference is taken, may be NULL
+ * dest:  recipient name for MAIL_DIRECT, may be NULL
+ */
+void postMail(int to, uint8_t type, msgbuf *buf, const char *dest) {
+  mailbox *box = &shards[to].box;
+  mail *m = poolGet(&mailPool);
+  if (m == NULL)
+    return;
+  m->type = type;
+  m->buf = buf ? holdMessage(buf) : NULL;
+  m->dest[0] = 0;
+  if (dest != NULL) {
+    strncpy(m->dest, dest, NAMELENGTH);
+    m->dest[NAMELENGTH] = 0;
+  }
+  push(box, m);
+  //only the first post after the shard drains pays for the write
+  if (!__atomic_exchange_n(&box->signalled, 1, __ATOMIC_SEQ_CST))
+    wake(box);
+}
+
+/*
+ * Function: postAll
+ * -------------------
+ * send the same mail to every shard but this one
+ *
+ * type:  MAIL_*
+ * *buf:  frame to deliver, may be NULL
+ * dest:  name the mail is about, may be NULL
+ */
+void postAll(uint8_t type, msgbuf *buf, const char *dest) {
+  for (int i = 0; i < numShards; i++) {
+    if (i != myShard)
+      postMail(i, type, buf, dest);
+  }
+}
+
+/*
+ * Function: takeMail
+ * -------------------
+ * take the oldest mail from this shard's mailbox
+ * call it until it returns NULL once the eventfd fires
+ *
+ * returns the mail, NULL when the mailbox is empty
+ */
+mail* takeMail() {
+  mailbox *box = &shards[myShard].box;
+  mail *tail = box->tail;
+  mail *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  if (tail == &box->stub) {
+    if (next == NULL) {
+      uint64_t count;
+      //empty: rearm the wakeup, then make sure no post slipped past it
+      if (read(box->efd, &count, sizeof(count)) < 0) {}
+      __atomic_store_n(&box->signalled, 0, __ATOMIC_SEQ_CST);
+      if (__atomic_load_n(&box->head, __ATOMIC_SEQ_CST) != &box->stub)
+        wake(box);
+      return NULL;
+    }
+    box->tail = next;
+    tail = next;
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  }
+  if (next != NULL) {
+    box->tail = next;
+    return tail;
+  }
+  //tail is the last mail: put the stub behind it so it can be taken
+  if (tail != __atomic_load_n(&box->head, __ATOMIC_SEQ_CST)) {
+    //a producer is half way through a push, come back for it
+    wake(box);
+    return NULL;
+  }
+  push(box, &box->stub);
+  next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  if (next != NULL) {
+    box->tail = next;
+    return tail;
+  }
+  wake(box);
+  return NULL;
+}
+
+/*
+ * Function: doneMail
+ * -------------------
+ * release a mail taken with takeMail
+ *
+ * *m:  mail to release
+ */
+void doneMail(mail *m) {
+  releaseMessage(m->buf);
+  poolPut(m);
+}
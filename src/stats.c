@@ -0,0 +1,252 @@
+/* stats.c - per-shard counters and the metrics endpoint that exposes them */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../inc/server.h"
+
+stats shardStats[MAXSHARDS];         //counters, indexed by shard number
+_Thread_local stats *myStats = NULL; //counters of the calling shard
+static _Thread_local uint64_t passStart; //when the current pass began, in us
+
+static void* serveMetrics(void*);
+static void dumpMetrics(FILE*);
+static void dumpPools(FILE*);
+
+/*
+ * Function: statsInit
+ * -------------------
+ * point the calling shard at its counters
+ *
+ * shard:  shard number of the caller
+ */
+void statsInit(int shard) {
+  myStats = &shardStats[shard];
+}
+
+/*
+ * Function: statsHist
+ * -------------------
+ * count a sample in a power of two histogram
+ *
+ * *hist:  HISTBUCKETS buckets, bucket i holds samples below 2^i
+ * *sum:   running total of the samples
+ * v:      the sample
+ */
+void statsHist(uint64_t *hist, uint64_t *sum, uint64_t v) {
+  int b = v ? 64 - __builtin_clzll(v) : 0;
+  if (b >= HISTBUCKETS)
+    b = HISTBUCKETS - 1;
+  __atomic_store_n(&hist[b], hist[b] + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(sum, *sum + v, __ATOMIC_RELAXED);
+}
+
+/*
+ * Function: statsPassStart
+ * -------------------
+ * note that the loop woke up and starts handling events
+ */
+void statsPassStart() {
+  passStart = nowUs();
+}
+
+/*
+ * Function: statsPassEnd
+ * -------------------
+ * record how long the loop pass took
+ */
+void statsPassEnd() {
+  statsHist(myStats->passUs, &myStats->passUsSum, nowUs() - passStart);
+}
+
+/*
+ * Function: statsServe
+ * -------------------
+ * start a thread answering every connection to 127.0.0.1:port
+ * with a Prometheus text dump of the counters
+ *
+ * port:  port to listen on
+ */
+void statsServe(int port) {
+  struct sockaddr_in sad;
+  pthread_t thread;
+  int sd;
+  memset(&sad, 0, sizeof(sad));
+  sad.sin_family = AF_INET;
+  sad.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sad.sin_port = htons((u_short)port);
+  sd = socket(PF_INET, SOCK_STREAM, 0);
+  if (sd < 0) {
+    fprintf(stderr, "Error: Socket creation failed\n");
+    exit(EXIT_FAILURE);
+  }
+  setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
+  if (bind(sd, (struct sockaddr *)&sad, sizeof(sad)) < 0 || listen(sd, 6) < 0) {
+    fprintf(stderr, "Error: Metrics bind failed\n");
+    exit(EXIT_FAILURE);
+  }
+  if (pthread_create(&thread, NULL, serveMetrics, (void*)(intptr_t)sd) != 0) {
+    perror("pthread_create()");
+    exit(EXIT_FAILURE);
+  }
+  pthread_detach(thread);
+}
+
+/*
+ * Function: serveMetrics
+ * -------------------
+ * metrics thread, one blocking scrape at a time
+ *
+ * arg:  the listening socket
+ */
+static void* serveMetrics(void *arg) {
+  int sd = (int)(intptr_t)arg;
+  char req[1024];
+  while (1) {
+    int csd = accept(sd, NULL, NULL);
+    if (csd < 0)
+      continue;
+    //scrapers speak HTTP, anything else just gets the text
+    setsockopt(csd, SOL_SOCKET, SO_RCVTIMEO, &(struct timeval){0, 100000}, sizeof(struct timeval));
+    //a scraper that stops reading must not hold up the next one
+    setsockopt(csd, SOL_SOCKET, SO_SNDTIMEO, &(struct timeval){1, 0}, sizeof(struct timeval));
+    if (recv(csd, req, sizeof(req), 0) < 0)
+      req[0] = 0;
+    FILE *out = fdopen(csd, "w");
+    if (out == NULL) {
+      close(csd);
+      continue;
+    }
+    fprintf(out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n");
+    dumpMetrics(out);
+    fclose(out);
+  }
+  return NULL;
+}
+
+/*
+ * Function: dumpMetrics
+ * -------------------
+ * write every shard's counters in the Prometheus text format
+ *
+ * *out:  where to write
+ */
+static void dumpMetrics(FILE *out) {
+  static const struct {
+    const char *name;
+    const char *type;
+    size_t off;
+  } counters[] = {
+    {"chat_accepts_total", "counter", offsetof(stats, accepts)},
+    {"chat_rejects_total", "counter", offsetof(stats, rejects)},
+    {"chat_handshake_timeouts_total", "counter", offsetof(stats, timeouts)},
+    {"chat_bytes_in_total", "counter", offsetof(stats, bytesIn)},
+    {"chat_frames_in_total", "counter", offsetof(stats, framesIn)},
+    {"chat_bytes_out_total", "counter", offsetof(stats, bytesOut)},
+    {"chat_frames_out_total", "counter", offsetof(stats, framesOut)},
+    {"chat_partial_sends_total", "counter", offsetof(stats, partialSends)},
+    {"chat_dropped_frames_total", "counter", offsetof(stats, dropped)},
+    {"chat_slow_disconnects_total", "counter", offsetof(stats, slowCloses)},
+    {"chat_sessions_held_total", "counter", offsetof(stats, held)},
+    {"chat_sessions_resumed_total", "counter", offsetof(stats, resumed)},
+    {"chat_sessions_expired_total", "counter", offsetof(stats, expired)},
+    {"chat_throttles_total", "counter", offsetof(stats, throttles)},
+    {"chat_accept_errors_total", "counter", offsetof(stats, acceptErrors)},
+    {"chat_accept_shed_total", "counter", offsetof(stats, acceptShed)},
+    {"chat_accept_pauses_total", "counter", offsetof(stats, acceptPauses)},
+    {"chat_accept_budget_hits_total", "counter", offsetof(stats, acceptBudgetHits)},
+    {"chat_accept_rearms_total", "counter", offsetof(stats, acceptRearms)},
+    {"chat_clients", "gauge", offsetof(stats, clients)},
+    {"chat_throttled_clients", "gauge", offsetof(stats, throttled)},
+  };
+  static const struct {
+    const char *name;
+    size_t hist;
+    size_t sum;
+  } hists[] = {
+    {"chat_loop_pass_us", offsetof(stats, passUs), offsetof(stats, passUsSum)},
+    {"chat_queue_bytes", offsetof(stats, queue), offsetof(stats, queueSum)},
+  };
+  for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+    fprintf(out, "# TYPE %s %s\n", counters[i].name, counters[i].type);
+    for (int s = 0; s < numShards; s++) {
+      uint64_t *v = (uint64_t*)((char*)&shardStats[s] + counters[i].off);
+      fprintf(out, "%s{shard=\"%d\"} %lu\n", counters[i].name, s, (unsigned long)__atomic_load_n(v, __ATOMIC_RELAXED));
+    }
+  }
+  fprintf(out, "# TYPE chat_log_dropped_total counter\nchat_log_dropped_total %lu\n", (unsigned long)logDropped());
+  fprintf(out, "# TYPE chat_history_dropped_total counter\nchat_history_dropped_total %lu\n", (unsigned long)historyDropped());
+  fprintf(out, "# TYPE chat_peer_links gauge\nchat_peer_links %lu\n", (unsigned long)__atomic_load_n(&peerStats.links, __ATOMIC_RELAXED));
+  fprintf(out, "# TYPE chat_peer_records_in_total counter\nchat_peer_records_in_total %lu\n", (unsigned long)__atomic_load_n(&peerStats.recordsIn, __ATOMIC_RELAXED));
+  fprintf(out, "# TYPE chat_peer_records_out_total counter\nchat_peer_records_out_total %lu\n", (unsigned long)__atomic_load_n(&peerStats.recordsOut, __ATOMIC_RELAXED));
+  fprintf(out, "# TYPE chat_peer_name_collisions_total counter\nchat_peer_name_collisions_total %lu\n", (unsigned long)__atomic_load_n(&peerStats.collisions, __ATOMIC_RELAXED));
+  dumpPools(out);
+  for (size_t i = 0; i < sizeof(hists) / sizeof(hists[0]); i++) {
+    fprintf(out, "# TYPE %s histogram\n", hists[i].name);
+    for (int s = 0; s < numShards; s++) {
+      uint64_t *h = (uint64_t*)((char*)&shardStats[s] + hists[i].hist);
+      uint64_t *sum = (uint64_t*)((char*)&shardStats[s] + hists[i].sum);
+      uint64_t seen = 0;
+      //bucket b holds samples below 2^b, Prometheus buckets are cumulative
+      for (int b = 0; b < HISTBUCKETS - 1; b++) {
+        seen += __atomic_load_n(&h[b], __ATOMIC_RELAXED);
+        fprintf(out, "%s_bucket{shard=\"%d\",le=\"%lu\"} %lu\n", hists[i].name, s, (1UL << b) - 1, (unsigned long)seen);
+      }
+      seen += __atomic_load_n(&h[HISTBUCKETS - 1], __ATOMIC_RELAXED);
+      fprintf(out, "%s_bucket{shard=\"%d\",le=\"+Inf\"} %lu\n", hists[i].name, s, (unsigned long)seen);
+      fprintf(out, "%s_sum{shard=\"%d\"} %lu\n", hists[i].name, s, (unsigned long)__atomic_load_n(sum, __ATOMIC_RELAXED));
+      fprintf(out, "%s_count{shard=\"%d\"} %lu\n", hists[i].name, s, (unsigned long)seen);
+    }
+  }
+}
+
+/*
+ * Function: dumpPools
+ * -------------------
+ * write the use of every slab pool in the Prometheus text format
+ *
+ * *out:  where to write
+ */
+static void dumpPools(FILE *out) {
+  static const struct {
+    const char *name;
+    const char *type;
+    size_t off;
+  } fields[] = {
+    {"chat_pool_objects_reserved", "gauge", offsetof(pool, reserved)},
+    {"chat_pool_gets_total", "counter", offsetof(pool, gets)},
+    {"chat_pool_remote_frees_total", "counter", offsetof(pool, remoteFrees)},
+  };
+  int n = __atomic_load_n(&numPools, __ATOMIC_ACQUIRE);
+  if (n > MAXPOOLS)
+    n = MAXPOOLS;
+  //in use is derived, the counters behind it have different writers
+  fprintf(out, "# TYPE chat_pool_objects_in_use gauge\n");
+  for (int k = 0; k < n; k++) {
+    pool *p = __atomic_load_n(&pools[k], __ATOMIC_ACQUIRE);
+    if (p == NULL)
+      continue;
+    uint64_t back = __atomic_load_n(&p->puts, __ATOMIC_RELAXED) + __atomic_load_n(&p->remoteFrees, __ATOMIC_RELAXED);
+    uint64_t given = __atomic_load_n(&p->gets, __ATOMIC_RELAXED);
+    fprintf(out, "chat_pool_objects_in_use{pool=\"%s\",shard=\"%d\"} %lu\n", p->name, p->shard,
+            (unsigned long)(given > back ? given - back : 0));
+  }
+  for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+    fprintf(out, "# TYPE %s %s\n", fields[i].name, fields[i].type);
+    for (int k = 0; k < n; k++) {
+      pool *p = __atomic_load_n(&pools[k], __ATOMIC_ACQUIRE);
+      if (p == NULL)
+        continue;
+      uint64_t *v = (uint64_t*)((char*)p + fields[i].off);
+      fprintf(out, "%s{pool=\"%s\",shard=\"%d\"} %lu\n", fields[i].name, p->name, p->shard,
+              (unsigned long)__atomic_load_n(v, __ATOMIC_RELAXED));
+    }
+  }
+}
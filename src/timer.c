@@ -0,0 +1,229 @@
+/* timer.c - two level hierarchical timing wheel on the monotonic clock */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../inc/timer.h"
+
+//every shard runs its own wheel
+static _Thread_local timer *level0[WHEELSIZE];       //one slot per tick
+static _Thread_local timer *level1[UPPERSIZE];       //one slot per WHEELSIZE ticks
+static _Thread_local uint64_t used0[WHEELSIZE / 64]; //bitmap of non-empty level0 slots
+static _Thread_local uint64_t used1;                 //bitmap of non-empty level1 slots
+static _Thread_local uint64_t current = 0;           //last tick that was processed
+static _Thread_local uint32_t pending = 0;           //armed timers
+
+/*
+ * Function: nowMs
+ * -------------------
+ * read the monotonic clock
+ *
+ * returns the current time in milliseconds
+ */
+long nowMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Function: nowUs
+ * -------------------
+ * read the monotonic clock, for timing that needs more than ms
+ *
+ * returns the current time in microseconds
+ */
+uint64_t nowUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Function: nowTick
+ * -------------------
+ * returns the current time in ticks
+ */
+static uint64_t nowTick() {
+  return nowMs() / TIMERTICK;
+}
+
+/*
+ * Function: place
+ * -------------------
+ * link a timer into the slot for its expiry
+ * timers too far out for level 1 sit in its furthest slot and are
+ * placed again when that slot cascades
+ *
+ * *t:  timer to link
+ */
+static void place(timer *t) {
+  uint64_t delta = t->expires > current ? t->expires - current : 0;
+  timer **slot;
+  if (delta < WHEELSIZE) {
+    uint32_t i = t->expires & (WHEELSIZE - 1);
+    //already due timers go in the next slot to be processed
+    if (delta == 0)
+      i = (current + 1) & (WHEELSIZE - 1);
+    slot = &level0[i];
+    used0[i / 64] |= 1ull << (i % 64);
+  } else {
+    uint64_t at = t->expires;
+    if (delta >= (uint64_t)WHEELSIZE * UPPERSIZE)
+      at = current + (uint64_t)WHEELSIZE * UPPERSIZE - 1;
+    uint32_t i = (at >> WHEELBITS) & (UPPERSIZE - 1);
+    slot = &level1[i];
+    used1 |= 1ull << i;
+  }
+  t->next = *slot;
+  if (t->next != NULL)
+    t->next->pprev = &t->next;
+  t->pprev = slot;
+  *slot = t;
+}
+
+/*
+ * Function: timerInit
+ * -------------------
+ * start the wheel at the current time
+ */
+void timerInit() {
+  memset(level0, 0, sizeof(level0));
+  memset(level1, 0, sizeof(level1));
+  memset(used0, 0, sizeof(used0));
+  used1 = 0;
+  pending = 0;
+  current = nowTick();
+}
+
+/*
+ * Function: timerArm
+ * -------------------
+ * arm (or re-arm) a timer, O(1)
+ *
+ * *t:    timer to arm
+ * ms:    milliseconds from now
+ * fire:  callback for when it expires
+ */
+void timerArm(timer *t, uint32_t ms, void (*fire)(timer*)) {
+  if (timerArmed(t))
+    timerCancel(t);
+  t->expires = nowTick() + (ms + TIMERTICK - 1) / TIMERTICK;
+  t->fire = fire;
+  place(t);
+  pending++;
+}
+
+/*
+ * Function: timerCancel
+ * -------------------
+ * disarm a timer, O(1), harmless if it is not armed
+ *
+ * *t:  timer to cancel
+ */
+void timerCancel(timer *t) {
+  if (!timerArmed(t))
+    return;
+  *t->pprev = t->next;
+  if (t->next != NULL)
+    t->next->pprev = t->pprev;
+  t->next = NULL;
+  t->pprev = NULL;
+  pending--;
+}
+
+/*
+ * Function: timerArmed
+ * -------------------
+ * *t:  timer to check
+ *
+ * returns true if the timer is waiting to fire
+ */
+int timerArmed(timer *t) {
+  return t->pprev != NULL;
+}
+
+/*
+ * Function: nextBusy
+ * -------------------
+ * find the next non-empty level 0 slot after the current tick
+ *
+ * returns ticks from current to that slot, WHEELSIZE if all are empty
+ */
+static uint32_t nextBusy() {
+  for (uint32_t step = 1; step <= WHEELSIZE; ) {
+    uint32_t i = (current + step) & (WHEELSIZE - 1);
+    uint64_t bits = used0[i / 64] >> (i % 64);
+    if (bits != 0)
+      return step + __builtin_ctzll(bits) > WHEELSIZE ? WHEELSIZE : step + __builtin_ctzll(bits);
+    step += 64 - (i % 64);
+  }
+  return WHEELSIZE;
+}
+
+/*
+ * Function: timerRun
+ * -------------------
+ * advance the wheel to the current time and fire expired timers
+ * empty stretches are skipped with the bitmaps, so the work done
+ * follows the number of expiries rather than the number of timers
+ *
+ * returns milliseconds until the next timer is due, -1 if none are armed
+ */
+int timerRun() {
+  uint64_t now = nowTick();
+  while (current < now && pending > 0) {
+    //jump to the next busy slot, stopping at level 1 cascades
+    uint64_t step = nextBusy();
+    uint64_t edge = ((current >> WHEELBITS) + 1) << WHEELBITS;
+    uint64_t next = current + step;
+    if (next > edge)
+      next = edge;
+    if (next > now)
+      break;
+    current = next;
+    //pull the level 1 slot for this stretch down into level 0
+    if ((current & (WHEELSIZE - 1)) == 0) {
+      uint32_t i = (current >> WHEELBITS) & (UPPERSIZE - 1);
+      timer *t = level1[i];
+      level1[i] = NULL;
+      used1 &= ~(1ull << i);
+      while (t != NULL) {
+        timer *n = t->next;
+        place(t);
+        t = n;
+      }
+    }
+    uint32_t i = current & (WHEELSIZE - 1);
+    timer *t = level0[i];
+    level0[i] = NULL;
+    used0[i / 64] &= ~(1ull << (i % 64));
+    if (t != NULL)
+      t->pprev = &t;
+    //unlink each timer before its callback so it may re-arm or free
+    while (t != NULL) {
+      timer *fired = t;
+      t = fired->next;
+      if (t != NULL)
+        t->pprev = &t;
+      fired->next = NULL;
+      fired->pprev = NULL;
+      pending--;
+      fired->fire(fired);
+    }
+  }
+  if (pending == 0) {
+    current = now;
+    return -1;
+  }
+  if (current < now)
+    current = now;
+  //work out how long until the next slot with something in it
+  uint64_t step = nextBusy();
+  if (used1 != 0) {
+    uint64_t edge = ((current >> WHEELBITS) + 1) << WHEELBITS;
+    if (edge - current < step)
+      step = edge - current;
+  }
+  return step * TIMERTICK;
+}
@@ -0,0 +1,649 @@
+/* uring.c - io_uring backend: multishot accept and receive, batched sends */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "../inc/server.h"
+
+//operation tags kept in the low bits of user_data, the rest is the uringConn
+#define TAG_ACCEPT 1
+#define TAG_MAIL   2
+#define TAG_RECV   3
+#define TAG_SEND   4
+#define TAG_CANCEL 5
+#define TAGMASK    7
+
+int useUring = 0; //-u given and the kernel supports what we need
+
+//each shard has its own ring and receive buffers
+static _Thread_local int ringFd = -1;
+static _Thread_local int listenFd = -1;
+static _Thread_local unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+static _Thread_local unsigned *cqHead, *cqTail, *cqMask;
+static _Thread_local unsigned sqEntries;
+static _Thread_local unsigned toSubmit;    //queued sqes the kernel has not seen
+static _Thread_local struct io_uring_sqe *sqes;
+static _Thread_local struct io_uring_cqe *cqes;
+static _Thread_local struct io_uring_buf_ring *bufRing;
+static _Thread_local char *bufBase;        //RECVBUFS buffers of RECVBUFSIZE
+static _Thread_local unsigned short bufTail;
+static _Thread_local pool connPool = {"uringconn", sizeof(uringConn)};
+static _Thread_local uringConn *handling;  //connection whose completion is being handled
+static _Thread_local timer acceptTimer;    //arms the accept again after a pause
+
+static int ringOpen();
+static int ringEnter(unsigned, unsigned, unsigned, void*, size_t);
+static struct io_uring_sqe* getSqe();
+static void recycleBuffer(unsigned short);
+static void armAccept();
+static void rearmAccept(timer*);
+static void armMail();
+static void armRecv(uringConn*);
+static void handleCqe(uint64_t, int, unsigned);
+static void onRecv(uringConn*, int, unsigned);
+static int spillBytes(uringConn*, const char*, uint32_t);
+static void onSend(uringConn*, int);
+static void reapConn(uringConn*);
+
+/*
+ * Function: ringOpen
+ * -------------------
+ * sets up this thread's ring and registers its receive buffers,
+ * does nothing if the thread already has a ring
+ *
+ * returns 0 on success, -1 if the kernel lacks a needed feature
+ */
+static int ringOpen() {
+  struct io_uring_params p;
+  struct io_uring_buf_reg reg;
+  size_t sqSize, cqSize;
+  char *sq;
+  if (ringFd >= 0)
+    return 0;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = RINGSIZE * 2;
+  ringFd = syscall(__NR_io_uring_setup, RINGSIZE, &p);
+  if (ringFd < 0)
+    return -1;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG))
+    goto fail;
+  //one mapping holds both rings
+  sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (cqSize > sqSize)
+    sqSize = cqSize;
+  sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED)
+    goto fail;
+  sqHead = (unsigned*)(sq + p.sq_off.head);
+  sqTail = (unsigned*)(sq + p.sq_off.tail);
+  sqMask = (unsigned*)(sq + p.sq_off.ring_mask);
+  sqArray = (unsigned*)(sq + p.sq_off.array);
+  cqHead = (unsigned*)(sq + p.cq_off.head);
+  cqTail = (unsigned*)(sq + p.cq_off.tail);
+  cqMask = (unsigned*)(sq + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe*)(sq + p.cq_off.cqes);
+  sqEntries = p.sq_entries;
+  sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED)
+    goto fail;
+  //received data lands in buffers the kernel picks from this ring
+  bufRing = mmap(NULL, RECVBUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (bufRing == MAP_FAILED)
+    goto fail;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)bufRing;
+  reg.ring_entries = RECVBUFS;
+  reg.bgid = RECVGROUP;
+  if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    goto fail;
+  if ((bufBase = malloc((size_t)RECVBUFS * RECVBUFSIZE)) == NULL)
+    goto fail;
+  bufTail = 0;
+  for (int i = 0; i < RECVBUFS; i++)
+    recycleBuffer(i);
+  return 0;
+fail:
+  close(ringFd);
+  ringFd = -1;
+  return -1;
+}
+
+/*
+ * Function: uringProbe
+ * -------------------
+ * checks that the kernel supports io_uring with provided buffers and
+ * multishot receive by receiving one byte over a socket pair,
+ * the calling thread keeps the ring for its shard
+ *
+ * returns 0 if the backend can be used, -1 otherwise
+ */
+int uringProbe() {
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  int sv[2];
+  int ok = 0;
+  if (ringOpen() < 0)
+    return -1;
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    return -1;
+  sqe = getSqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = sv[0];
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = RECVGROUP;
+  sqe->user_data = 0;
+  if (write(sv[1], "x", 1) == 1 && ringEnter(toSubmit, 1, IORING_ENTER_GETEVENTS, NULL, 0) >= 0) {
+    toSubmit = 0;
+    cqe = &cqes[*cqHead & *cqMask];
+    if (*cqHead != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+      ok = cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE) && (cqe->flags & IORING_CQE_F_BUFFER);
+      if (cqe->flags & IORING_CQE_F_BUFFER)
+        recycleBuffer(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+      __atomic_store_n(cqHead, *cqHead + 1, __ATOMIC_RELEASE);
+    }
+  }
+  //end the receive and drain what it posts
+  shutdown(sv[0], SHUT_RDWR);
+  while (ok && ringEnter(0, 1, IORING_ENTER_GETEVENTS, NULL, 0) >= 0) {
+    unsigned more = 0;
+    while (*cqHead != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+      cqe = &cqes[*cqHead & *cqMask];
+      more = cqe->flags & IORING_CQE_F_MORE;
+      if (cqe->flags & IORING_CQE_F_BUFFER)
+        recycleBuffer(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+      __atomic_store_n(cqHead, *cqHead + 1, __ATOMIC_RELEASE);
+    }
+    if (!more)
+      break;
+  }
+  close(sv[0]);
+  close(sv[1]);
+  return ok ? 0 : -1;
+}
+
+/*
+ * Function: uringInit
+ * -------------------
+ * prepares this shard's ring and starts accepting on its listener
+ *
+ * Psd:  listening socket of the shard
+ *
+ * returns 0 on success, -1 on failure
+ */
+int uringInit(int Psd) {
+  if (ringOpen() < 0)
+    return -1;
+  listenFd = Psd;
+  armAccept();
+  armMail();
+  return 0;
+}
+
+/*
+ * Function: uringLoop
+ * -------------------
+ * the io_uring reactor, submits the requests queued during a pass,
+ * waits for completions and handles them
+ */
+void uringLoop() {
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  int waitms;
+  int ret;
+  while (1) {
+    waitms = passTimeout();
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    if (waitms >= 0) {
+      ts.tv_sec = waitms / 1000;
+      ts.tv_nsec = (waitms % 1000) * 1000000L;
+      arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    ret = ringEnter(toSubmit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (ret < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+      perror("io_uring_enter()");
+      exit(EXIT_FAILURE);
+    }
+    if (ret > 0)
+      toSubmit -= ret;
+    statsPassStart();
+    //handlers queue new requests, those go out with the next enter
+    while (*cqHead != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &cqes[*cqHead & *cqMask];
+      uint64_t ud = cqe->user_data;
+      int res = cqe->res;
+      unsigned flags = cqe->flags;
+      __atomic_store_n(cqHead, *cqHead + 1, __ATOMIC_RELEASE);
+      handleCqe(ud, res, flags);
+    }
+    endPass();
+  }
+}
+
+/*
+ * Function: ringEnter
+ * -------------------
+ * wrapper for the io_uring_enter system call
+ *
+ * returns sqes consumed, or -1 with errno set
+ */
+static int ringEnter(unsigned submit, unsigned wait, unsigned flags, void *arg, size_t argsz) {
+  return syscall(__NR_io_uring_enter, ringFd, submit, wait, flags, arg, argsz);
+}
+
+/*
+ * Function: getSqe
+ * -------------------
+ * claims the next free submission entry, submitting what is queued
+ * if the ring is full
+ *
+ * returns a zeroed sqe
+ */
+static struct io_uring_sqe* getSqe() {
+  struct io_uring_sqe *sqe;
+  unsigned tail = *sqTail;
+  unsigned idx;
+  while (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+    int ret = ringEnter(toSubmit, 0, 0, NULL, 0);
+    if (ret > 0)
+      toSubmit -= ret;
+    else if (ret < 0 && errno != EINTR && errno != EBUSY) {
+      perror("io_uring_enter()");
+      exit(EXIT_FAILURE);
+    }
+  }
+  idx = tail & *sqMask;
+  sqe = &sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqArray[idx] = idx;
+  __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+  toSubmit++;
+  return sqe;
+}
+
+/*
+ * Function: recycleBuffer
+ * -------------------
+ * hands a receive buffer back to the kernel
+ *
+ * bid:  id of the buffer
+ */
+static void recycleBuffer(unsigned short bid) {
+  struct io_uring_buf *b = &bufRing->bufs[bufTail & (RECVBUFS - 1)];
+  b->addr = (uint64_t)(uintptr_t)(bufBase + (size_t)bid * RECVBUFSIZE);
+  b->len = RECVBUFSIZE;
+  b->bid = bid;
+  bufTail++;
+  __atomic_store_n(&bufRing->tail, bufTail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Function: armAccept
+ * -------------------
+ * queues a multishot accept on the shard's listener
+ */
+static void armAccept() {
+  struct io_uring_sqe *sqe = getSqe();
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listenFd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->user_data = TAG_ACCEPT;
+}
+
+/*
+ * Function: rearmAccept
+ * -------------------
+ * timer callback: accept again once a pause for want of descriptors is over
+ *
+ * *t:  the shard's acceptTimer, unused: there is only the one, but
+ *      timerArm callbacks all take the timer that fired
+ */
+static void rearmAccept(timer *t) {
+  STAT_ADD(acceptRearms, 1);
+  armAccept();
+}
+
+/*
+ * Function: armMail
+ * -------------------
+ * queues a multishot poll on the shard's mailbox eventfd
+ */
+static void armMail() {
+  struct io_uring_sqe *sqe = getSqe();
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = shards[myShard].box.efd;
+  sqe->poll32_events = POLLIN;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = TAG_MAIL;
+}
+
+/*
+ * Function: armRecv
+ * -------------------
+ * queues a multishot receive into the provided buffers
+ *
+ * *c:  connection to read from
+ */
+static void armRecv(uringConn *c) {
+  struct io_uring_sqe *sqe = getSqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = c->fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = RECVGROUP;
+  sqe->user_data = (uint64_t)(uintptr_t)c | TAG_RECV;
+  c->recvArmed = 1;
+}
+
+/*
+ * Function: handleCqe
+ * -------------------
+ * dispatches one completion to its handler
+ *
+ * ud:     user_data of the request
+ * res:    result of the request
+ * flags:  completion flags
+ */
+static void handleCqe(uint64_t ud, int res, unsigned flags) {
+  uringConn *c = (uringConn*)(uintptr_t)(ud & ~(uint64_t)TAGMASK);
+  //the handlers reap c themselves, a detach on the way must not free it
+  handling = c;
+  switch (ud & TAGMASK) {
+    case TAG_ACCEPT:
+      if (res >= 0) {
+        newParticipant(res);
+      } else if (res == -EMFILE || res == -ENFILE) {
+        //turn away what is queued, then wait for descriptors to free up,
+        //armed right away the accept would fail again before it waits
+        if (shedConnection(listenFd) != 0 && !(flags & IORING_CQE_F_MORE)) {
+          STAT_ADD(acceptPauses, 1);
+          timerArm(&acceptTimer, ACCEPTPAUSE, rearmAccept);
+          break;
+        }
+      } else if (res != -EAGAIN && res != -EINTR) {
+        STAT_ADD(acceptErrors, 1);
+        LOG(LOG_WARN, "accept failed: %s", strerror(-res));
+      }
+      if (!(flags & IORING_CQE_F_MORE)) {
+        STAT_ADD(acceptRearms, 1);
+        armAccept();
+      }
+      break;
+    case TAG_MAIL:
+      deliverMail();
+      if (!(flags & IORING_CQE_F_MORE))
+        armMail();
+      break;
+    case TAG_RECV:
+      onRecv(c, res, flags);
+      break;
+    case TAG_SEND:
+      onSend(c, res);
+      break;
+    case TAG_CANCEL:
+      c->cancelBusy = 0;
+      //the client may want reads again by now
+      if (c->owner != NULL)
+        uringUpdate(c->owner);
+      reapConn(c);
+      break;
+  }
+  handling = NULL;
+}
+
+/*
+ * Function: onRecv
+ * -------------------
+ * copies received data into the client's buffer and parses it
+ *
+ * *c:     connection the data arrived on
+ * res:    bytes received, 0 on hangup, or -errno
+ * flags:  completion flags, carry the buffer id
+ */
+static void onRecv(uringConn *c, int res, unsigned flags) {
+  client *user = c->owner;
+  if (!(flags & IORING_CQE_F_MORE))
+    c->recvArmed = 0;
+  if (flags & IORING_CQE_F_BUFFER) {
+    unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    //a client being closed stops consuming, drop what it sends
+    if (res > 0 && user != NULL && !user->closing) {
+      if (c->spillLen > 0 || user->cold->inLen + res > INBUFSIZE) {
+        //completions already queued before the cancel still arrive,
+        //keep what a throttled client sent for when it may go on
+        if (user->throttled && spillBytes(c, bufBase + (size_t)bid * RECVBUFSIZE, res) == 0)
+          STAT_ADD(bytesIn, res);
+        else
+          closeClient(user);
+      } else {
+        STAT_ADD(bytesIn, res);
+        memcpy(user->cold->inbuf + user->cold->inLen, bufBase + (size_t)bid * RECVBUFSIZE, res);
+        user->cold->inLen += res;
+        parseInput(user);
+      }
+    }
+    recycleBuffer(bid);
+  }
+  if (user != NULL && c->owner == user) {
+    //out of buffers or cancelled only ends this receive
+    if (res == 0 || (res < 0 && res != -ENOBUFS && res != -ECANCELED && res != -EINTR))
+      dropUser(user);
+    else if (!c->recvArmed)
+      uringUpdate(user);
+  }
+  reapConn(c);
+}
+
+/*
+ * Function: onSend
+ * -------------------
+ * retires what a sendmsg wrote and starts the next one
+ *
+ * *c:   connection that was written to
+ * res:  bytes written or -errno
+ */
+static void onSend(uringConn *c, int res) {
+  client *user = c->owner;
+  c->sendBusy = 0;
+  for (int i = 0; i < c->heldCnt; i++)
+    releaseMessage(c->held[i]);
+  c->heldCnt = 0;
+  if (user != NULL) {
+    user->outLocked = 0;
+    if (res < 0 && res != -EAGAIN && res != -EINTR) {
+      closeClient(user);
+    } else {
+      if (res > 0)
+        retireBytes(user, res);
+      if (user->outHead != NULL && user->outHead->sent > 0)
+        STAT_ADD(partialSends, 1);
+      afterSend(user);
+      uringSend(user);
+    }
+  }
+  reapConn(c);
+}
+
+/*
+ * Function: reapConn
+ * -------------------
+ * closes and frees a connection whose client is gone
+ * once the kernel holds no more requests for it
+ *
+ * *c:  connection to check
+ */
+static void reapConn(uringConn *c) {
+  if (c->owner != NULL || c->recvArmed || c->sendBusy || c->cancelBusy)
+    return;
+  close(c->fd);
+  poolPut(c);
+}
+
+/*
+ * Function: uringAttach
+ * -------------------
+ * gives a new client its io_uring state and starts reading
+ *
+ * *user:  client that was just added
+ */
+void uringAttach(client *user) {
+  uringConn *c = poolGet(&connPool);
+  if (c == NULL) {
+    fprintf(stderr, "Error: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  memset(c, 0, sizeof(uringConn));
+  c->owner = user;
+  c->fd = user->socket;
+  user->ur = c;
+  armRecv(c);
+}
+
+/*
+ * Function: uringDetach
+ * -------------------
+ * separates a client from its io_uring state, shutting the socket
+ * down makes outstanding requests finish so the state can be freed
+ *
+ * *user:  client being deleted
+ */
+void uringDetach(client *user) {
+  uringConn *c = user->ur;
+  user->ur = NULL;
+  user->outLocked = 0;
+  c->owner = NULL;
+  free(c->spill);
+  c->spill = NULL;
+  c->spillLen = c->spillCap = 0;
+  shutdown(c->fd, SHUT_RDWR);
+  if (c != handling)
+    reapConn(c);
+}
+
+/*
+ * Function: uringSend
+ * -------------------
+ * gathers the head of the client's queue into one sendmsg,
+ * only one send per connection is in flight at a time
+ *
+ * *user:  client with queued frames
+ */
+void uringSend(client *user) {
+  uringConn *c = user->ur;
+  struct io_uring_sqe *sqe;
+  outmsg *m = user->outHead;
+  int cnt, entries;
+  if (c == NULL || c->sendBusy || user->closing || user->outHead == NULL)
+    return;
+  //the sqe points at these, they stay put until the completion
+  cnt = gatherQueue(user, c->iov, IOVBATCH, &entries);
+  if (user->contMsgs > 0 && user->hdrSent < sizeof(contHdr)) {
+    //the client may be gone before the completion, the header goes with us
+    c->hdr = user->cont;
+    c->iov[0].iov_base = (char*)&c->hdr + user->hdrSent;
+  }
+  for (int k = 0; k < entries; k++, m = m->next)
+    c->held[k] = holdMessage(m->buf);
+  c->heldCnt = entries;
+  user->outLocked = entries;
+  memset(&c->mh, 0, sizeof(c->mh));
+  c->mh.msg_iov = c->iov;
+  c->mh.msg_iovlen = cnt;
+  sqe = getSqe();
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = c->fd;
+  sqe->addr = (uint64_t)(uintptr_t)&c->mh;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL | (m != NULL ? MSG_MORE : 0);
+  sqe->user_data = (uint64_t)(uintptr_t)c | TAG_SEND;
+  c->sendBusy = 1;
+}
+
+/*
+ * Function: uringUpdate
+ * -------------------
+ * starts or cancels the receive to match the client's pause state
+ *
+ * *user:  client whose state changed
+ */
+void uringUpdate(client *user) {
+  uringConn *c = user->ur;
+  struct io_uring_sqe *sqe;
+  int want = !user->paused && !user->throttled && !user->closing;
+  if (c == NULL || c->cancelBusy)
+    return;
+  if (want && !c->recvArmed) {
+    armRecv(c);
+  } else if (!want && c->recvArmed) {
+    sqe = getSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uint64_t)(uintptr_t)c | TAG_RECV;
+    sqe->user_data = (uint64_t)(uintptr_t)c | TAG_CANCEL;
+    c->cancelBusy = 1;
+  }
+}
+
+/*
+ * Function: spillBytes
+ * -------------------
+ * keep received bytes that do not fit the client's buffer
+ *
+ * *c:    connection they arrived on
+ * data:  the bytes
+ * len:   how many
+ *
+ * returns 0, or -1 past SPILLMAX or out of memory
+ */
+static int spillBytes(uringConn *c, const char *data, uint32_t len) {
+  if (c->spillLen + len > SPILLMAX)
+    return -1;
+  if (c->spillLen + len > c->spillCap) {
+    uint32_t cap = c->spillCap ? c->spillCap * 2 : 16384;
+    while (cap < c->spillLen + len)
+      cap *= 2;
+    char *grown = realloc(c->spill, cap);
+    if (grown == NULL)
+      return -1;
+    c->spill = grown;
+    c->spillCap = cap;
+  }
+  memcpy(c->spill + c->spillLen, data, len);
+  c->spillLen += len;
+  return 0;
+}
+
+/*
+ * Function: uringDrain
+ * -------------------
+ * parse what a throttled client's receive delivered after reads
+ * were told to stop, as far as its token buckets allow
+ *
+ * *user:  client that is no longer throttled
+ */
+void uringDrain(client *user) {
+  uringConn *c;
+  while ((c = user->ur) != NULL && c->spillLen > 0 && !user->throttled && !user->closing) {
+    clientCold *cold = user->cold;
+    uint32_t n = INBUFSIZE - cold->inLen;
+    if (n > c->spillLen)
+      n = c->spillLen;
+    if (n == 0)
+      break;
+    memcpy(cold->inbuf + cold->inLen, c->spill, n);
+    cold->inLen += n;
+    c->spillLen -= n;
+    memmove(c->spill, c->spill + n, c->spillLen);
+    parseInput(user);
+  }
+}